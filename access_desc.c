@@ -0,0 +1,266 @@
+#include "access_desc.h"
+
+#include <hashtable.h>
+
+#include "defines.h"
+#include "options.h"
+
+/* Descriptors live in fixed-size blocks that never move, so a callback can
+ * read one by index while another thread is adding more. */
+#define BLOCK_BITS 12
+#define BLOCK_SIZE (1 << BLOCK_BITS)
+#define MAX_BLOCKS 4096
+
+#define NO_DESC ((uint)-1)
+
+/* A ref under -persist: the operand's slot, and this bit for a dst. */
+#define REF_WRITE 0x100
+
+static access_desc_t *desc_blocks[MAX_BLOCKS];
+static volatile uint num_descs;
+
+/* pc -> index + 1 of the newest descriptor for that pc. */
+static hashtable_t descs_by_pc[1];
+static void *desc_lock;
+
+static void event_module_unload(void *drcontext, const module_data_t *mod);
+static void describe(void *drcontext, app_pc block, instr_t *instr, bool write,
+        uint opnd_index, access_desc_t *desc);
+static bool same_desc(access_desc_t *a, access_desc_t *b);
+static uint find_desc(app_pc pc, bool write, uint opnd_index);
+static uint opnd_size(opnd_t o);
+
+void
+access_desc_init(void)
+{
+    desc_lock = dr_mutex_create();
+    hashtable_init_ex(descs_by_pc,
+            10, /* 1024 buckets initially */
+            HASH_INTPTR, /* keys are app pcs */
+            0, /* don't duplicate string keys */
+            0, /* don't synchronize: desc_lock covers it */
+            NULL, /* values are indices */
+            NULL, /* use default key hash fn */
+            NULL /* use default key cmp fn */
+            );
+    dr_register_module_unload_event(event_module_unload);
+}
+
+void
+access_desc_exit(void)
+{
+    uint i;
+
+    DEBUG("%u access descriptors\n", num_descs);
+    dr_unregister_module_unload_event(event_module_unload);
+    for (i = 0; i < MAX_BLOCKS && desc_blocks[i] != NULL; i++)
+        dr_global_free(desc_blocks[i], BLOCK_SIZE * sizeof(access_desc_t));
+    hashtable_delete(descs_by_pc);
+    dr_mutex_destroy(desc_lock);
+}
+
+access_desc_t *
+access_desc_get(uint idx)
+{
+    return &desc_blocks[idx >> BLOCK_BITS][idx & (BLOCK_SIZE - 1)];
+}
+
+uint
+access_desc_lookup_or_add(void *drcontext, app_pc block, instr_t *instr,
+        bool write, uint opnd_index)
+{
+    app_pc pc = instr_get_app_pc(instr);
+    access_desc_t fresh;
+    access_desc_t *desc;
+    uint idx;
+
+    describe(drcontext, block, instr, write, opnd_index, &fresh);
+    dr_mutex_lock(desc_lock);
+
+    // Blocks are rebuilt for traces and after flushes; reuse what we have,
+    // unless the code at pc has changed since (rewritten JIT code, say).
+    // Then the old descriptor stays for any callback still holding its
+    // index, and a new one goes in front of it.
+    idx = find_desc(pc, write, opnd_index);
+    if (idx != NO_DESC && same_desc(access_desc_get(idx), &fresh)) {
+        desc = access_desc_get(idx);
+        if (block != NULL)
+            desc->block = block;
+        dr_mutex_unlock(desc_lock);
+        return idx;
+    }
+
+    idx = num_descs;
+    DR_ASSERT_MSG((idx >> BLOCK_BITS) < MAX_BLOCKS, "out of access descriptors");
+    if (desc_blocks[idx >> BLOCK_BITS] == NULL) {
+        desc_blocks[idx >> BLOCK_BITS] =
+            dr_global_alloc(BLOCK_SIZE * sizeof(access_desc_t));
+    }
+    desc = access_desc_get(idx);
+    *desc = fresh;
+    desc->next_same_pc = (uint)(ptr_uint_t)hashtable_lookup(descs_by_pc, pc) - 1;
+    hashtable_add_replace(descs_by_pc, pc, (void *)(ptr_uint_t)(idx + 1));
+    num_descs = idx + 1;
+
+    dr_mutex_unlock(desc_lock);
+    return idx;
+}
+
+uint
+access_desc_ref(void *drcontext, app_pc block, instr_t *instr, bool write,
+        uint opnd_index)
+{
+    if (options.persist)
+        return (write ? REF_WRITE : 0) | opnd_index;
+    return access_desc_lookup_or_add(drcontext, block, instr, write, opnd_index);
+}
+
+access_desc_t *
+access_desc_deref(app_pc pc, uint ref)
+{
+    void *drcontext;
+    instr_t instr;
+    uint idx;
+
+    if (! options.persist)
+        return access_desc_get(ref);
+
+    dr_mutex_lock(desc_lock);
+    idx = find_desc(pc, (ref & REF_WRITE) != 0, ref & ~REF_WRITE);
+    dr_mutex_unlock(desc_lock);
+    if (idx != NO_DESC)
+        return access_desc_get(idx);
+
+    // Code loaded from a persisted cache: this run hasn't seen it built.
+    drcontext = dr_get_current_drcontext();
+    instr_init(drcontext, &instr);
+    decode(drcontext, pc, &instr);
+    instr_set_translation(&instr, pc);
+    idx = access_desc_lookup_or_add(drcontext, NULL, &instr,
+            (ref & REF_WRITE) != 0, ref & ~REF_WRITE);
+    instr_free(drcontext, &instr);
+    return access_desc_get(idx);
+}
+
+app_pc
+access_desc_address(access_desc_t *desc, dr_mcontext_t *mc)
+{
+    ptr_uint_t addr;
+
+    if (desc->segment != DR_REG_NULL) {
+        // Only the machine context knows the segment base.
+        return opnd_compute_address(opnd_create_far_base_disp(desc->segment,
+                    desc->base, desc->index, desc->scale, desc->disp, OPSZ_1), mc);
+    }
+    if (desc->abs_addr != NULL)
+        return desc->abs_addr;
+
+    addr = desc->disp;
+    if (desc->base != DR_REG_NULL)
+        addr += reg_get_value(desc->base, mc);
+    if (desc->index != DR_REG_NULL)
+        addr += reg_get_value(desc->index, mc) * desc->scale;
+    return (app_pc)addr;
+}
+
+/* Whatever is loaded at a module's addresses next is new code: its
+ * descriptors are made afresh.  Old ones stay where they are for callbacks
+ * still holding their indices. */
+static void
+event_module_unload(void *drcontext, const module_data_t *mod)
+{
+    dr_mutex_lock(desc_lock);
+    hashtable_remove_range(descs_by_pc, mod->start, mod->end);
+    dr_mutex_unlock(desc_lock);
+}
+
+/* Fills in desc for one memory operand of instr, all but next_same_pc. */
+static void
+describe(void *drcontext, app_pc block, instr_t *instr, bool write,
+        uint opnd_index, access_desc_t *desc)
+{
+    app_pc pc = instr_get_app_pc(instr);
+    opnd_t o = write ? instr_get_dst(instr, opnd_index)
+                     : instr_get_src(instr, opnd_index);
+    int i;
+
+    desc->pc = pc;
+    desc->next_pc = pc + instr_length(drcontext, instr);
+    desc->opcode = instr_get_opcode(instr);
+    desc->block = block;
+    desc->segment = opnd_is_far_memory_reference(o) ?
+        opnd_get_segment(o) : DR_REG_NULL;
+    if (opnd_is_base_disp(o)) {
+        desc->base = opnd_get_base(o);
+        desc->index = opnd_get_index(o);
+        desc->scale = opnd_get_scale(o);
+        desc->disp = opnd_get_disp(o);
+        desc->abs_addr = NULL;
+    } else {
+        desc->base = DR_REG_NULL;
+        desc->index = DR_REG_NULL;
+        desc->scale = 0;
+        desc->disp = 0;
+        desc->abs_addr = opnd_get_addr(o);
+    }
+    desc->size = opnd_size(o);
+    desc->opnd_index = opnd_index;
+    desc->write = write;
+    desc->dst = DR_REG_NULL;
+    if (! write && instr_num_dsts(instr) > 0
+            && opnd_is_reg(instr_get_dst(instr, 0)))
+        desc->dst = opnd_get_reg(instr_get_dst(instr, 0));
+    desc->src = DR_REG_NULL;
+    desc->mask = DR_REG_NULL;
+    if (write && instr_num_srcs(instr) > 0
+            && opnd_is_reg(instr_get_src(instr, 0)))
+        desc->src = opnd_get_reg(instr_get_src(instr, 0));
+    for (i = 0; i < instr_num_srcs(instr); i++) {
+        opnd_t s = instr_get_src(instr, i);
+        if (! opnd_is_reg(s))
+            continue;
+        // k0 in a mask slot means no masking.
+        if (reg_is_opmask(opnd_get_reg(s))) {
+            if (opnd_get_reg(s) != DR_REG_K0)
+                desc->mask = opnd_get_reg(s);
+        } else if (! write && desc->src == DR_REG_NULL) {
+            desc->src = opnd_get_reg(s);
+        }
+    }
+    desc->next_same_pc = NO_DESC;
+}
+
+/* Whether a and b describe the same operand of the same instruction. */
+static bool
+same_desc(access_desc_t *a, access_desc_t *b)
+{
+    return a->next_pc == b->next_pc && a->opcode == b->opcode
+        && a->segment == b->segment && a->base == b->base
+        && a->index == b->index && a->scale == b->scale && a->disp == b->disp
+        && a->abs_addr == b->abs_addr && a->size == b->size
+        && a->dst == b->dst && a->src == b->src && a->mask == b->mask;
+}
+
+/* Caller holds desc_lock. */
+static uint
+find_desc(app_pc pc, bool write, uint opnd_index)
+{
+    uint idx = (uint)(ptr_uint_t)hashtable_lookup(descs_by_pc, pc) - 1;
+
+    while (idx != NO_DESC) {
+        access_desc_t *desc = access_desc_get(idx);
+        if (desc->write == write && desc->opnd_index == opnd_index)
+            return idx;
+        idx = desc->next_same_pc;
+    }
+    return NO_DESC;
+}
+
+/* Operands whose size isn't fixed are treated as a single byte so the check
+ * at least covers their start. */
+static uint
+opnd_size(opnd_t o)
+{
+    uint size = opnd_size_in_bytes(opnd_get_size(o));
+    return size == 0 ? 1 : size;
+}
@@ -0,0 +1,52 @@
+#ifndef ACCESS_DESC_H
+#define ACCESS_DESC_H
+
+#include <dr_api.h>
+
+/* Everything the slow path needs to know about one checked memory operand,
+ * captured when its block is instrumented so that the callback never has
+ * to decode the instruction again. */
+typedef struct {
+    app_pc pc;
+    app_pc next_pc;
+    int opcode;
+    app_pc block;       // start of the block last instrumented with it
+    reg_id_t base;
+    reg_id_t index;
+    reg_id_t segment;   // DR_REG_NULL unless the operand is far
+    reg_id_t dst;       // register a skipped read would have written, if any
+    reg_id_t src;       // register a write stores from, or a read's
+                        // register source, if any
+    reg_id_t mask;      // AVX-512 opmask applied, if any
+    int disp;
+    void *abs_addr;     // absolute and rip-relative operands only
+    ushort size;
+    byte scale;
+    byte opnd_index;    // src or dst slot in the instruction
+    bool write;
+    uint next_same_pc;  // chain of descriptors sharing pc
+} access_desc_t;
+
+void access_desc_init(void);
+void access_desc_exit(void);
+
+/* Returns the index of the descriptor for one memory operand of instr,
+ * creating it the first time that operand is seen.  block may be NULL when
+ * the operand is met outside of any block being built. */
+uint access_desc_lookup_or_add(void *drcontext, app_pc block, instr_t *instr,
+        bool write, uint opnd_index);
+
+access_desc_t *access_desc_get(uint idx);
+
+/* What a callback is passed, along with the pc, to find the descriptor of
+ * one operand.  Normally it is just the index.  Code that may be persisted
+ * (-persist) outlives this run's indices, so there it names the operand
+ * instead, and the descriptor is found or made again from the pc. */
+uint access_desc_ref(void *drcontext, app_pc block, instr_t *instr,
+        bool write, uint opnd_index);
+access_desc_t *access_desc_deref(app_pc pc, uint ref);
+
+/* Computes the address the operand refers to.  mc needs DR_MC_INTEGER. */
+app_pc access_desc_address(access_desc_t *desc, dr_mcontext_t *mc);
+
+#endif // ACCESS_DESC_H
@@ -0,0 +1,323 @@
+#include "adaptive.h"
+
+#include <hashtable.h>
+#include <dr_ir_macros.h>
+#include <stddef.h>
+
+#include "defines.h"
+#include "options.h"
+#include "stats.h"
+
+/* Everything we know about one block, by the pc it starts at.  Records are
+ * never freed before exit since the inline counters point into them. */
+typedef struct _block_record_t {
+    app_pc start;
+    size_t size;                // bytes of application code
+    volatile int countdown;     // clean executions left in this tier
+    check_tier_t tier;
+    bool sticky;                // it hit once: always check it fully
+} block_record_t;
+
+static hashtable_t block_records[1];
+static void *tier_lock;
+
+/* Bytes of application code instrumented at each tier, and the number of
+ * times blocks moved down and back up. */
+static ptr_uint_t tier_bytes[NUM_TIERS];
+static int promotions;
+static int demotions;
+
+static const char * const tier_names[NUM_TIERS] = { "full", "writes", "none" };
+
+static block_record_t *get_record(void *tag, instrlist_t *bb);
+static int tier_threshold(check_tier_t tier);
+static void set_tier(block_record_t *rec, check_tier_t tier);
+static bool aflags_dead(instr_t *instr);
+static void insert_counters(void *drcontext, instrlist_t *bb, block_record_t *rec,
+        int num_checks, bool countdown);
+static void promote_callback(block_record_t *rec);
+
+static void
+free_record(void *rec)
+{
+    dr_global_free(rec, sizeof(block_record_t));
+}
+
+void
+adaptive_init(void)
+{
+    tier_lock = dr_mutex_create();
+    hashtable_init_ex(block_records,
+            10, /* 1024 buckets initially */
+            HASH_INTPTR, /* keys are block start pcs */
+            0, /* don't duplicate string keys */
+            1, /* synchronize: blocks are built by any thread */
+            free_record,
+            NULL, /* use default key hash fn */
+            NULL /* use default key cmp fn */
+            );
+}
+
+void
+adaptive_exit(void)
+{
+    hashtable_delete(block_records);
+    dr_mutex_destroy(tier_lock);
+}
+
+check_tier_t
+adaptive_block_tier(void *tag, instrlist_t *bb)
+{
+    block_record_t *rec;
+
+    if (! options.adaptive)
+        return TIER_FULL;
+    rec = get_record(tag, bb);
+    return rec == NULL ? TIER_FULL : rec->tier;
+}
+
+void
+adaptive_insert_counter(void *drcontext, void *tag, instrlist_t *bb, int num_checks)
+{
+    block_record_t *rec = NULL;
+    bool count, countdown;
+
+    // Persisted code mustn't point into this run's records or rely on its
+    // TLS layout, so it isn't counted.
+    if (options.persist)
+        return;
+    // Each fragment adds its own number of checks, so a block and the trace
+    // copy of it with fewer checks are each counted right.
+    count = stats_enabled() && num_checks > 0;
+    if (options.adaptive)
+        rec = get_record(tag, bb);
+    countdown = rec != NULL && ! rec->sticky && tier_threshold(rec->tier) > 0;
+    if (count || countdown)
+        insert_counters(drcontext, bb, rec, count ? num_checks : 0, countdown);
+}
+
+uint64
+adaptive_tier_bytes(check_tier_t tier)
+{
+    return tier_bytes[tier];
+}
+
+uint64
+adaptive_promotions(void)
+{
+    return promotions;
+}
+
+uint64
+adaptive_demotions(void)
+{
+    return demotions;
+}
+
+void
+adaptive_note_hit(app_pc block)
+{
+    block_record_t *rec;
+
+    if (! options.adaptive || block == NULL)
+        return;
+    rec = hashtable_lookup(block_records, block);
+    if (rec == NULL || rec->sticky)
+        return;
+
+    dr_mutex_lock(tier_lock);
+    rec->sticky = true;
+    if (rec->tier != TIER_FULL) {
+        DEBUG("Block %p hit at tier %s, back to full checks\n", rec->start,
+                tier_names[rec->tier]);
+        set_tier(rec, TIER_FULL);
+        demotions++;
+        // We may be deep in a callback of that very block: let DR pick the
+        // moment to rebuild it.
+        dr_delay_flush_region(rec->start, rec->size, 0, NULL);
+    }
+    dr_mutex_unlock(tier_lock);
+}
+
+/* Finds or creates the record for the block at tag, by tag rather than by
+ * the first pc in bb, so that when bb is one block of a trace it is that
+ * block's record.  Returns NULL for a block with no application code. */
+static block_record_t *
+get_record(void *tag, instrlist_t *bb)
+{
+    instr_t *first = NULL, *last = NULL, *instr;
+    block_record_t *rec;
+
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        if (instr_get_app_pc(instr) == NULL)
+            continue;
+        if (first == NULL)
+            first = instr;
+        last = instr;
+    }
+    if (first == NULL)
+        return NULL;
+
+    rec = hashtable_lookup(block_records, tag);
+    if (rec != NULL)
+        return rec;
+
+    rec = dr_global_alloc(sizeof(block_record_t));
+    rec->start = (app_pc)tag;
+    rec->size = instr_get_app_pc(last) + instr_length(dr_get_current_drcontext(),
+            last) - rec->start;
+    rec->countdown = tier_threshold(TIER_FULL);
+    rec->tier = TIER_FULL;
+    rec->sticky = false;
+
+    dr_mutex_lock(tier_lock);
+    if (! hashtable_add(block_records, rec->start, rec)) {
+        // Another thread built the same block first.
+        dr_mutex_unlock(tier_lock);
+        free_record(rec);
+        return hashtable_lookup(block_records, tag);
+    }
+    tier_bytes[TIER_FULL] += rec->size;
+    dr_mutex_unlock(tier_lock);
+    return rec;
+}
+
+/* Clean executions a block spends in tier before moving down, or 0 if it
+ * stays there. */
+static int
+tier_threshold(check_tier_t tier)
+{
+    switch (tier) {
+    case TIER_FULL:
+        return options.adaptive_writes_after;
+    case TIER_WRITES:
+        return options.adaptive_none_after;
+    default:
+        return 0;
+    }
+}
+
+/* Caller holds tier_lock. */
+static void
+set_tier(block_record_t *rec, check_tier_t tier)
+{
+    tier_bytes[rec->tier] -= rec->size;
+    tier_bytes[tier] += rec->size;
+    rec->tier = tier;
+    rec->countdown = tier_threshold(tier);
+}
+
+/* Whether the arithmetic flags are written before anything reads them, so
+ * the counter needn't preserve them. */
+static bool
+aflags_dead(instr_t *instr)
+{
+    for (; instr != NULL; instr = instr_get_next(instr)) {
+        uint flags;
+        if (instr_get_app_pc(instr) == NULL)
+            continue;
+        flags = instr_get_arith_flags(instr);
+        if ((flags & EFLAGS_READ_6) != 0)
+            return false;
+        if ((flags & EFLAGS_WRITE_6) == EFLAGS_WRITE_6)
+            return true;
+        if (instr_is_cti(instr))
+            return false;
+    }
+    return false;
+}
+
+/* At the block's entry, adds its num_checks checks to the thread's own
+ * count for the stats and/or counts down its clean executions, moving it
+ * down a tier when that count runs out.  The countdown is shared by every
+ * thread and isn't atomic: a lost update only delays the move, and it stops
+ * once the block settles in a tier.
+ *
+ *      spill   xbx
+ *      save    aflags                  (if live)
+ *      mov     xbx, <thread's stats>   (if num_checks)
+ *      add     qword [xbx + checks], num_checks
+ *      mov     xbx, rec                (if countdown)
+ *      sub     dword [xbx + countdown], 1
+ *      jz      promote
+ *      restore aflags, xbx
+ *      jmp     done
+ *  promote:
+ *      restore aflags, xbx
+ *      clean call promote_callback(rec)
+ *  done:
+ */
+static void
+insert_counters(void *drcontext, instrlist_t *bb, block_record_t *rec,
+        int num_checks, bool countdown)
+{
+    instr_t *where = instrlist_first(bb);
+    instr_t *promote, *done;
+    bool save_flags = ! aflags_dead(where);
+
+    dr_save_reg(drcontext, bb, where, DR_REG_XBX, SPILL_SLOT_2);
+    if (save_flags)
+        dr_save_arith_flags(drcontext, bb, where, SPILL_SLOT_1);
+    if (num_checks > 0)
+        stats_insert_add_checks(drcontext, bb, where, DR_REG_XBX, num_checks);
+    if (! countdown) {
+        if (save_flags)
+            dr_restore_arith_flags(drcontext, bb, where, SPILL_SLOT_1);
+        dr_restore_reg(drcontext, bb, where, DR_REG_XBX, SPILL_SLOT_2);
+        return;
+    }
+
+    promote = INSTR_CREATE_label(drcontext);
+    done = INSTR_CREATE_label(drcontext);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_imm(drcontext,
+                opnd_create_reg(DR_REG_XBX), OPND_CREATE_INTPTR(rec)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_sub(drcontext,
+                OPND_CREATE_MEM32(DR_REG_XBX, offsetof(block_record_t, countdown)),
+                OPND_CREATE_INT8(1)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jz,
+                opnd_create_instr(promote)));
+    if (save_flags)
+        dr_restore_arith_flags(drcontext, bb, where, SPILL_SLOT_1);
+    dr_restore_reg(drcontext, bb, where, DR_REG_XBX, SPILL_SLOT_2);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jmp(drcontext,
+                opnd_create_instr(done)));
+
+    instrlist_meta_preinsert(bb, where, promote);
+    if (save_flags)
+        dr_restore_arith_flags(drcontext, bb, where, SPILL_SLOT_1);
+    dr_restore_reg(drcontext, bb, where, DR_REG_XBX, SPILL_SLOT_2);
+    dr_insert_clean_call(drcontext, bb, where, (void *)promote_callback,
+            false /*no fp save*/, 1, OPND_CREATE_INTPTR(rec));
+    instrlist_meta_preinsert(bb, where, done);
+}
+
+/* The block ran its quota clean.  Nothing of it has executed yet, so it is
+ * flushed and restarted from the top at the lighter tier. */
+static void
+promote_callback(block_record_t *rec)
+{
+    void *drcontext = dr_get_current_drcontext();
+    dr_mcontext_t mc;
+
+    dr_mutex_lock(tier_lock);
+    if (rec->sticky || rec->countdown > 0 || tier_threshold(rec->tier) == 0) {
+        // Lost a race with a hit or another promotion.
+        if (rec->countdown <= 0)
+            rec->countdown = tier_threshold(rec->tier);
+        dr_mutex_unlock(tier_lock);
+        return;
+    }
+    set_tier(rec, rec->tier + 1);
+    promotions++;
+    dr_mutex_unlock(tier_lock);
+
+    DEBUG("Block %p ran clean, down to tier %s\n", rec->start,
+            tier_names[rec->tier]);
+
+    mc.size = sizeof(mc);
+    mc.flags = DR_MC_ALL;
+    dr_get_mcontext(drcontext, &mc);
+    dr_flush_region(rec->start, rec->size);
+    mc.pc = rec->start;
+    dr_redirect_execution(&mc);
+}
@@ -0,0 +1,40 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <dr_api.h>
+
+/* How much of a block is checked.  With -adaptive, a block moves down a
+ * tier each time it runs the configured number of times without a hit, and
+ * a hit sends it back to full checking for good. */
+typedef enum {
+    TIER_FULL,
+    TIER_WRITES,
+    TIER_NONE,
+    NUM_TIERS
+} check_tier_t;
+
+void adaptive_init(void);
+void adaptive_exit(void);
+
+/* Returns the tier to instrument bb, the block at tag, with.  A trace is
+ * built from the bb event of each of its blocks in turn, so each block of
+ * a trace keeps its own tier there. */
+check_tier_t adaptive_block_tier(void *tag, instrlist_t *bb);
+
+/* Inserts, at the very start of bb, the counter that moves the block at tag
+ * down a tier once it has run clean often enough, and with stats enabled,
+ * the add of its num_checks checks to the running thread's count.  Call
+ * after the checks are in. */
+void adaptive_insert_counter(void *drcontext, void *tag, instrlist_t *bb,
+        int num_checks);
+
+/* Bytes of application code instrumented at tier, and the number of times
+ * blocks moved down a tier and back to full checks, for the stats. */
+uint64 adaptive_tier_bytes(check_tier_t tier);
+uint64 adaptive_promotions(void);
+uint64 adaptive_demotions(void);
+
+/* A check in the block starting at block found a real redzone access. */
+void adaptive_note_hit(app_pc block);
+
+#endif // ADAPTIVE_H
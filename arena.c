@@ -0,0 +1,374 @@
+#include "arena.h"
+
+#include <hashtable.h>
+#include <string.h>
+
+#include "defines.h"
+#include "options.h"
+#include "quarantine.h"
+#include "shadow.h"
+
+/* Each slot is [REDZONE][class bytes].  The user pointer follows the
+ * redzone and so is 16-byte aligned like a slot. */
+#define REDZONE 16
+
+/* Runs are carved from one reservation of -arena_mb, a run at a time. */
+#define RUN_SIZE (1 << 20)
+
+/* The smallest slot; tables are indexed in these units. */
+#define MIN_STRIDE (REDZONE + 16)
+
+/* What a freed block's contents are overwritten with, as in inst_malloc.c. */
+#define FREED_FILL 0xfd
+
+#define SLOT_LIVE 1
+#define SLOT_FREED 2
+
+static const uint class_sizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+    3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152, ARENA_MAX_CLASS
+};
+#define NUM_CLASSES (sizeof class_sizes / sizeof class_sizes[0])
+
+/* Out of band, one per MIN_STRIDE bytes of arena: whichever slot starts
+ * there.  next chains free slots, as index + 1. */
+typedef struct {
+    uint size;
+    volatile uint state;
+    uint next;
+} slot_meta_t;
+
+typedef struct {
+    void *lock;
+    byte *run;          // run slots are being handed out from
+    uint next_slot;
+    uint free_head;     // index + 1 of the first reusable slot
+} size_class_t;
+
+static byte *arena_base;
+static ptr_uint_t arena_size;
+static uint num_runs;
+static volatile int runs_used;
+static byte *run_class;     // per run: class + 1, or 0 while unused
+static slot_meta_t *meta;
+static ptr_uint_t meta_size;
+static size_class_t classes[NUM_CLASSES];
+
+/* Large blocks: user -> size + 1, so that an empty block isn't NULL, and
+ * guard page -> base of the block's mapping. */
+static hashtable_t large_blocks[1];
+static hashtable_t large_guards[1];
+
+static int class_of(ptr_uint_t size);
+static uint stride_of(int c);
+static byte *new_run(int c);
+static slot_meta_t *slot_meta(void *user, int *c);
+static void recycle(void *user, ptr_uint_t size);
+static void *large_alloc(ptr_uint_t size, ptr_uint_t align);
+static ptr_uint_t large_real_size(ptr_uint_t size);
+static ptr_uint_t round_up(ptr_uint_t n, ptr_uint_t to);
+
+void
+arena_init(void)
+{
+    int c;
+
+    arena_size = (ptr_uint_t)options.arena_mb << 20;
+    num_runs = arena_size / RUN_SIZE;
+    // Linux only backs the pages that get touched.
+    arena_base = dr_raw_mem_alloc(arena_size, DR_MEMPROT_READ | DR_MEMPROT_WRITE,
+            NULL);
+    meta_size = arena_size / MIN_STRIDE * sizeof(slot_meta_t);
+    meta = dr_raw_mem_alloc(meta_size, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+    if (arena_base == NULL || meta == NULL) {
+        dr_fprintf(STDERR, "shady: can't reserve a %u MB arena\n", options.arena_mb);
+        dr_abort();
+    }
+    run_class = dr_global_alloc(num_runs);
+    memset(run_class, 0, num_runs);
+
+    for (c = 0; c < NUM_CLASSES; c++) {
+        classes[c].lock = dr_mutex_create();
+        classes[c].run = NULL;
+        classes[c].next_slot = 0;
+        classes[c].free_head = 0;
+    }
+
+    hashtable_init_ex(large_blocks,
+            6, /* 64 buckets initially */
+            HASH_INTPTR, /* keys are user pointers */
+            0, /* don't duplicate string keys */
+            1, /* synchronize: any thread allocates */
+            NULL, /* values are sizes + 1 */
+            NULL, /* use default key hash fn */
+            NULL /* use default key cmp fn */
+            );
+    hashtable_init_ex(large_guards,
+            6, /* 64 buckets initially */
+            HASH_INTPTR, /* keys are guard page addresses */
+            0, /* don't duplicate string keys */
+            1, /* synchronize: any thread allocates */
+            NULL, /* values are the blocks' mapping bases */
+            NULL, /* use default key hash fn */
+            NULL /* use default key cmp fn */
+            );
+}
+
+void
+arena_exit(void)
+{
+    int c;
+
+    DEBUG("Arena: %d of %u runs used\n", runs_used, num_runs);
+    // The blocks themselves go away with the process.
+    hashtable_delete(large_guards);
+    hashtable_delete(large_blocks);
+    for (c = 0; c < NUM_CLASSES; c++)
+        dr_mutex_destroy(classes[c].lock);
+    dr_global_free(run_class, num_runs);
+}
+
+void *
+arena_alloc(ptr_uint_t size)
+{
+    int c = class_of(size);
+    size_class_t *sc;
+    byte *slot;
+    slot_meta_t *m;
+    byte *user;
+
+    if (c < 0)
+        return large_alloc(size, 16);
+    sc = &classes[c];
+
+    dr_mutex_lock(sc->lock);
+    if (sc->free_head != 0) {
+        slot = arena_base + (ptr_uint_t)(sc->free_head - 1) * MIN_STRIDE;
+        sc->free_head = meta[sc->free_head - 1].next;
+    } else {
+        if (sc->run == NULL
+                || sc->next_slot == (RUN_SIZE - REDZONE) / stride_of(c)) {
+            sc->run = new_run(c);
+            sc->next_slot = 0;
+        }
+        if (sc->run == NULL) {
+            // Out of arena: pages of its own, as for a large block.
+            dr_mutex_unlock(sc->lock);
+            return large_alloc(size, 16);
+        }
+        slot = sc->run + sc->next_slot++ * stride_of(c);
+    }
+    dr_mutex_unlock(sc->lock);
+
+    m = &meta[(slot - arena_base) / MIN_STRIDE];
+    m->size = size;
+    m->state = SLOT_LIVE;
+
+    // The slot's redzone is poisoned for good; only its tail changes.
+    user = slot + REDZONE;
+    shadow_unpoison(user, size);
+    shadow_poison(user + round_up(size, SHADOW_GRANULE),
+            class_sizes[c] - round_up(size, SHADOW_GRANULE), SHADOW_HEAP_REDZONE);
+    return user;
+}
+
+/* Slots are only 16-byte aligned, so anything stricter gets pages of its
+ * own. */
+void *
+arena_alloc_aligned(ptr_uint_t size, ptr_uint_t align)
+{
+    if (align <= 16)
+        return arena_alloc(size);
+    return large_alloc(size, align);
+}
+
+bool
+arena_owns(void *user)
+{
+    return (byte *)user >= arena_base && (byte *)user < arena_base + arena_size;
+}
+
+bool
+arena_block_size(void *user, ptr_uint_t *size)
+{
+    slot_meta_t *m = slot_meta(user, NULL);
+
+    if (m == NULL) {
+        void *sz = hashtable_lookup(large_blocks, user);
+        if (sz == NULL)
+            return false;
+        *size = (ptr_uint_t)sz - 1;
+        return true;
+    }
+    if (m->state != SLOT_LIVE)
+        return false;
+    *size = m->size;
+    return true;
+}
+
+bool
+arena_free(void *user, ptr_uint_t *size)
+{
+    slot_meta_t *m = slot_meta(user, NULL);
+    quarantine_entry_t evicted[QUARANTINE_BATCH];
+    uint n, i;
+
+    if (m != NULL) {
+        // Of several frees of one block, racing or not, one wins.
+        if (! __sync_bool_compare_and_swap(&m->state, SLOT_LIVE, SLOT_FREED))
+            return false;
+        *size = m->size;
+    } else {
+        void *sz = hashtable_lookup(large_blocks, user);
+        if (sz == NULL || ! hashtable_remove(large_blocks, user))
+            return false;
+        *size = (ptr_uint_t)sz - 1;
+    }
+
+    if (! quarantine_accepts(*size)) {
+        // Freed first, so loop checks stop trusting it before it is reused.
+        shadow_poison(user, round_up(*size, SHADOW_GRANULE), SHADOW_HEAP_FREED);
+        recycle(user, *size);
+        return true;
+    }
+    memset(user, FREED_FILL, *size);
+    shadow_poison(user, round_up(*size, SHADOW_GRANULE), SHADOW_HEAP_FREED);
+    n = quarantine_push(user, *size, evicted, QUARANTINE_BATCH);
+    for (i = 0; i < n; i++)
+        recycle(evicted[i].user, evicted[i].size);
+    return true;
+}
+
+bool
+arena_is_guard_page(app_pc addr)
+{
+    return hashtable_lookup(large_guards, (void *)ALIGN_BACKWARD(addr, PAGE_SIZE))
+        != NULL;
+}
+
+/* Index of the smallest class that fits size, or -1 for a large block. */
+static int
+class_of(ptr_uint_t size)
+{
+    int c;
+
+    for (c = 0; c < NUM_CLASSES; c++) {
+        if (size <= class_sizes[c])
+            return c;
+    }
+    return -1;
+}
+
+static uint
+stride_of(int c)
+{
+    return REDZONE + class_sizes[c];
+}
+
+/* Takes the next unused run for class c, all redzone to begin with, or
+ * returns NULL if the arena is used up. */
+static byte *
+new_run(int c)
+{
+    int r = dr_atomic_add32_return_sum(&runs_used, 1) - 1;
+    byte *run;
+
+    if (r >= (int)num_runs) {
+        DEBUG("Arena full\n");
+        return NULL;
+    }
+    run = arena_base + (ptr_uint_t)r * RUN_SIZE;
+    run_class[r] = c + 1;
+    shadow_poison(run, RUN_SIZE, SHADOW_HEAP_REDZONE);
+    return run;
+}
+
+/* The metadata of the slot user would be the user pointer of, with its
+ * class in *c, or NULL if user isn't in the arena or not at a slot's
+ * start. */
+static slot_meta_t *
+slot_meta(void *user, int *c)
+{
+    ptr_uint_t off = (byte *)user - REDZONE - arena_base;
+    ptr_uint_t r = off / RUN_SIZE;
+    ptr_uint_t in_run = off % RUN_SIZE;
+    int cls;
+
+    if ((byte *)user < arena_base + REDZONE || r >= num_runs || run_class[r] == 0)
+        return NULL;
+    cls = run_class[r] - 1;
+    if (in_run % stride_of(cls) != 0
+            || in_run / stride_of(cls) >= (RUN_SIZE - REDZONE) / stride_of(cls))
+        return NULL;
+    if (c != NULL)
+        *c = cls;
+    return &meta[off / MIN_STRIDE];
+}
+
+/* Makes a freed block available again: a slot goes on its class's free
+ * list, poisoned whole, and a large block is unmapped. */
+static void
+recycle(void *user, ptr_uint_t size)
+{
+    int c;
+    slot_meta_t *m = slot_meta(user, &c);
+
+    if (m == NULL) {
+        byte *guard = (byte *)ALIGN_FORWARD((byte *)user + size, PAGE_SIZE);
+        byte *base = hashtable_lookup(large_guards, guard);
+
+        hashtable_remove(large_guards, guard);
+        // Whatever is mapped here next starts out addressable.
+        shadow_unpoison(base, guard + PAGE_SIZE - base);
+        dr_raw_mem_free(base, guard + PAGE_SIZE - base);
+        return;
+    }
+
+    shadow_poison(user, class_sizes[c], SHADOW_HEAP_REDZONE);
+    dr_mutex_lock(classes[c].lock);
+    m->next = classes[c].free_head;
+    classes[c].free_head = m - meta + 1;
+    dr_mutex_unlock(classes[c].lock);
+}
+
+/* Pages of its own for a block: a redzone in front, the block ending
+ * against a PROT_NONE page, give or take its alignment.  The guard page
+ * stays addressable in the shadow so overflows get as far as faulting on
+ * it. */
+static void *
+large_alloc(ptr_uint_t size, ptr_uint_t align)
+{
+    // Room to slide the block down to an alignment above 16.
+    ptr_uint_t real = large_real_size(size) + (align > 16 ? align : 0);
+    byte *base = dr_raw_mem_alloc(real, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+    byte *guard, *user;
+
+    if (base == NULL)
+        return NULL;
+    user = (byte *)ALIGN_BACKWARD(base + real - PAGE_SIZE - size, align);
+    guard = (byte *)ALIGN_FORWARD(user + size, PAGE_SIZE);
+    // Whole pages the alignment left past the guard page are given back.
+    if (guard + PAGE_SIZE < base + real)
+        dr_raw_mem_free(guard + PAGE_SIZE, base + real - guard - PAGE_SIZE);
+
+    shadow_poison(base, user - base, SHADOW_HEAP_REDZONE);
+    shadow_unpoison(user, size);
+    shadow_poison(user + round_up(size, SHADOW_GRANULE),
+            guard - user - round_up(size, SHADOW_GRANULE), SHADOW_HEAP_REDZONE);
+    dr_memory_protect(guard, PAGE_SIZE, DR_MEMPROT_NONE);
+    hashtable_add(large_guards, guard, base);
+    hashtable_add(large_blocks, user, (void *)(size + 1));
+    return user;
+}
+
+static ptr_uint_t
+large_real_size(ptr_uint_t size)
+{
+    return round_up(REDZONE + round_up(size, 16), PAGE_SIZE) + PAGE_SIZE;
+}
+
+static ptr_uint_t
+round_up(ptr_uint_t n, ptr_uint_t to)
+{
+    return (n + to - 1) & ~(to - 1);
+}
@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <dr_api.h>
+
+/* Shady's own heap, used in place of the application's malloc under
+ * -replace_malloc.  Blocks up to ARENA_MAX_CLASS bytes come from runs of
+ * same-sized slots, each slot led by a redzone that is also the trailing
+ * redzone of the slot before it; bigger ones get pages of their own ending
+ * at a guard page.  Sizes and states are kept in tables beside the heap,
+ * never in it.  All of this must be called in DR state. */
+#define ARENA_MAX_CLASS 65536
+
+void arena_init(void);
+void arena_exit(void);
+
+/* Returns size addressable bytes, 16-byte aligned, or NULL if out of
+ * memory.  Once the arena is full, blocks get pages of their own. */
+void *arena_alloc(ptr_uint_t size);
+
+/* The same, aligned to align, a power of two. */
+void *arena_alloc_aligned(ptr_uint_t size, ptr_uint_t align);
+
+/* Whether user lies in the arena proper, live or not. */
+bool arena_owns(void *user);
+
+/* Whether user is a live block, and its size if so. */
+bool arena_block_size(void *user, ptr_uint_t *size);
+
+/* Frees the live block at user into the quarantine, returning its size in
+ * *size.  Returns false, doing nothing, if user isn't a live block. */
+bool arena_free(void *user, ptr_uint_t *size);
+
+/* Whether addr is in the guard page after a large block. */
+bool arena_is_guard_page(app_pc addr);
+
+#endif // ARENA_H
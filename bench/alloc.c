@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Allocation-heavy: keeps a working set of blocks of mixed sizes and
+ * replaces one at random on every step, touching each new block once. */
+
+#define LIVE 4096
+
+int
+main (int argc, char** argv)
+{
+    long steps = argc > 1 ? atol(argv[1]) : 1000000;
+    char** live = calloc(LIVE, sizeof(char*));
+    unsigned int seed = 12345;
+    unsigned long sum = 0;
+    long i;
+
+    for (i = 0; i < steps; i++)
+    {
+        size_t size;
+        int slot;
+
+        seed = seed * 1103515245 + 12345;
+        slot = (seed >> 8) % LIVE;
+        // Mostly small blocks, now and then a big one.
+        size = (seed >> 20) % 8 == 0 ? (seed >> 4) % 16384 + 1 : (seed >> 4) % 128 + 1;
+
+        free(live[slot]);
+        live[slot] = malloc(size);
+        memset(live[slot], (int)i, size);
+        sum += (unsigned char)live[slot][size - 1];
+    }
+
+    for (i = 0; i < LIVE; i++)
+        free(live[i]);
+    free(live);
+
+    printf("alloc: %ld steps, checksum %lu\n", steps, sum);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Pointer chasing: walks a linked list laid out in random order, one heap
+ * node per element, so nearly every load misses the cache and every load
+ * is a checked heap access. */
+
+struct node
+{
+    struct node* next;
+    long value;
+};
+
+int
+main (int argc, char** argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 250000;
+    int passes = argc > 2 ? atoi(argv[2]) : 10;
+    struct node** nodes = malloc(n * sizeof(struct node*));
+    struct node* p;
+    unsigned int seed = 42;
+    long sum = 0;
+    long i;
+    int pass;
+
+    for (i = 0; i < n; i++)
+    {
+        nodes[i] = malloc(sizeof(struct node));
+        nodes[i]->value = i;
+    }
+    // Fisher-Yates shuffle, then link in shuffled order.
+    for (i = n - 1; i > 0; i--)
+    {
+        long j;
+        struct node* t;
+
+        seed = seed * 1103515245 + 12345;
+        j = (seed >> 4) % (i + 1);
+        t = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = t;
+    }
+    for (i = 0; i < n - 1; i++)
+        nodes[i]->next = nodes[i + 1];
+    nodes[n - 1]->next = NULL;
+
+    for (pass = 0; pass < passes; pass++)
+        for (p = nodes[0]; p != NULL; p = p->next)
+            sum += p->value;
+
+    for (i = 0; i < n; i++)
+        free(nodes[i]);
+    free(nodes);
+
+    printf("chase: %ld nodes x %d passes, checksum %ld\n", n, passes, sum);
+    return 0;
+}
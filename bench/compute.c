@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Compute-bound: Collatz chain lengths, which live almost entirely in
+ * registers.  Shows the cost of running under DynamoRIO at all, with next
+ * to nothing for Shady to check. */
+
+int
+main (int argc, char** argv)
+{
+    long limit = argc > 1 ? atol(argv[1]) : 500000;
+    long best = 0, best_start = 0;
+    long start;
+
+    for (start = 1; start < limit; start++)
+    {
+        unsigned long x = start;
+        long len = 1;
+
+        while (x != 1)
+        {
+            x = (x & 1) ? 3 * x + 1 : x / 2;
+            len++;
+        }
+        if (len > best)
+        {
+            best = len;
+            best_start = start;
+        }
+    }
+
+    printf("compute: longest chain below %ld starts at %ld (%ld steps)\n",
+           limit, best_start, best);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* memcpy-heavy: copies, fills and scans heap buffers in chunks from 16
+ * bytes to 1 MB, the kind of bulk traffic libc's string routines and rep
+ * string instructions carry. */
+
+#define BUF_SIZE (8 << 20)
+
+int
+main (int argc, char** argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+    char* src = malloc(BUF_SIZE);
+    char* dst = malloc(BUF_SIZE);
+    unsigned long sum = 0;
+    size_t chunk;
+    size_t off;
+    int r;
+
+    memset(src, 'x', BUF_SIZE - 1);
+    src[BUF_SIZE - 1] = '\0';
+
+    for (r = 0; r < rounds; r++)
+    {
+        for (chunk = 16; chunk <= (1 << 20); chunk <<= 2)
+        {
+            for (off = 0; off + chunk <= BUF_SIZE; off += chunk)
+                memcpy(dst + off, src + off, chunk);
+            sum += dst[(r * chunk) % BUF_SIZE];
+        }
+        memset(dst, r, BUF_SIZE);
+        sum += strlen(src);
+    }
+
+    free(src);
+    free(dst);
+
+    printf("memcpy: %d rounds, checksum %lu\n", rounds, sum);
+    return 0;
+}
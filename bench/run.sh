@@ -0,0 +1,107 @@
+#!/bin/bash
+#
+# Runs every benchmark natively, under DynamoRIO with no client and under
+# Shady, REPS times each, and writes the mean time, standard deviation and
+# slowdown over native to results.csv and results.json.  Runs that fail are
+# left out of the mean and counted in the row's failed column, and the
+# script then exits non-zero.
+#
+# Needs DR_DIR and ARCH, as for the top-level Makefile.  Optional:
+#   REPS         runs per benchmark and mode (default 5)
+#   SHADY_OPTS   client options for the shady runs
+#   BENCHES      subset to run (default: all)
+
+set -e
+cd "$(dirname "$0")"
+
+: ${DR_DIR:?set DR_DIR to the DynamoRIO root}
+: ${ARCH:?set ARCH to 32 or 64}
+REPS=${REPS:-5}
+BENCHES=${BENCHES:-"alloc chase memcpy compute tar"}
+CLIENT=../shady.so
+DRRUN="$DR_DIR/bin$ARCH/drrun -dr_home $DR_DIR"
+
+bench_cmd() {
+    case $1 in
+    tar) echo "tar xzf tar-input.tar.gz -C tar-out" ;;
+    *)   echo "./$1" ;;
+    esac
+}
+
+mode_prefix() {
+    case $1 in
+    native) echo "" ;;
+    dr)     echo "$DRRUN --" ;;
+    shady)  echo "$DRRUN -client $CLIENT 0x1 \"$SHADY_OPTS\"" ;;
+    esac
+}
+
+# Prints the wall-clock seconds one run of a command takes, or fails with
+# the command.
+time_run() {
+    local start end status
+    rm -rf tar-out && mkdir tar-out
+    start=$(date +%s%N)
+    eval "$1" > /dev/null 2>&1 || {
+        status=$?
+        echo "$1: exit status $status" >&2
+        return 1
+    }
+    end=$(date +%s%N)
+    awk -v s=$start -v e=$end 'BEGIN { printf "%.4f\n", (e - s) / 1e9 }'
+}
+
+echo "bench,mode,runs,failed,mean_s,stddev_s,slowdown" > results.csv
+any_failed=0
+
+for b in $BENCHES; do
+    native_mean=
+    for mode in native dr shady; do
+        times=
+        runs=0
+        failed=0
+        for r in $(seq $REPS); do
+            if t=$(time_run "$(mode_prefix $mode) $(bench_cmd $b)"); then
+                times="$times $t"
+                runs=$((runs + 1))
+            else
+                failed=$((failed + 1))
+                any_failed=1
+            fi
+        done
+        # Empty fields when no run succeeded, or for slowdown when native
+        # didn't either.
+        mean= stddev= slowdown=
+        if [ $runs -gt 0 ]; then
+            stats=$(echo $times | awk '{
+                for (i = 1; i <= NF; i++) { sum += $i; sq += $i * $i }
+                mean = sum / NF; var = sq / NF - mean * mean
+                printf "%.4f %.4f", mean, (var > 0 ? sqrt(var) : 0) }')
+            set -- $stats
+            mean=$1 stddev=$2
+        fi
+        [ $mode = native ] && native_mean=$mean
+        if [ -n "$mean" ] && [ -n "$native_mean" ]; then
+            slowdown=$(awk -v m=$mean -v n=$native_mean 'BEGIN { printf "%.1f", (n > 0 ? m / n : 0) }')
+        fi
+        echo "$b,$mode,$runs,$failed,$mean,$stddev,$slowdown" >> results.csv
+        printf "%-8s %-7s %9s  +-%8s  %7s" $b $mode "${mean:+${mean}s}" \
+            "${stddev:+${stddev}s}" "${slowdown:+${slowdown}x}"
+        [ $failed -gt 0 ] && printf "  (%d of %d failed)" $failed $REPS
+        printf "\n"
+    done
+done
+rm -rf tar-out
+
+# The same table as a JSON array of objects, with null for empty fields.
+awk -F, 'function num(v) { return v == "" ? "null" : v }
+    NR == 1 { next }
+    { printf "%s  {\"bench\": \"%s\", \"mode\": \"%s\", \"runs\": %s, \"failed\": %s, \"mean_s\": %s, \"stddev_s\": %s, \"slowdown\": %s}",
+        (NR > 2 ? ",\n" : "[\n"), $1, $2, $3, $4, num($5), num($6), num($7) }
+    END { print "\n]" }' results.csv > results.json
+
+echo "wrote bench/results.csv and bench/results.json"
+if [ $any_failed -ne 0 ]; then
+    echo "some runs failed; see the failed column" >&2
+    exit 1
+fi
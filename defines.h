@@ -1,8 +1,6 @@
 #ifndef DEFINES_H
 #define DEFINES_H
 
-#define SENTINEL 0xdeadbeef
-
 #ifndef DEBUG_ENABLED 
 #define DEBUG_ENABLED 0
 #endif
@@ -0,0 +1,55 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+/* Layout of the binary file Shady logs its oblivious actions to
+ * (-event_log).  Shared with tools/shady_events.c, so it uses only standard
+ * types.
+ *
+ * The file is an event_log_header_t followed by records, each starting
+ * with its kind and its length in bytes, a multiple of 8.  Records of
+ * kinds a reader doesn't know can be skipped by their length. */
+
+#include <stdint.h>
+
+#define EVENT_LOG_MAGIC 0x474c4453      /* "SDLG" */
+#define EVENT_LOG_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t pid;
+} event_log_header_t;
+
+enum {
+    EVENT_SKIPPED_WRITE = 1,
+    EVENT_MANUFACTURED_READ,
+    EVENT_REPAIRED_RETURN,      /* addr: the return slot, value: what was there */
+    EVENT_BAD_FREE,             /* addr: the pointer, pc: 0 if unknown */
+    EVENT_DROPPED = 32,         /* value: events lost to a full buffer */
+    EVENT_MODULE,               /* an event_module_t */
+};
+
+typedef struct {
+    uint8_t kind;
+    uint8_t size;               /* bytes accessed */
+    uint16_t length;
+    uint32_t thread;
+    uint64_t pc;
+    uint64_t addr;
+    uint64_t value;
+} event_record_t;
+
+/* Written when a module loads, so pcs can be symbolized offline.  path is
+ * NUL-terminated and padded out to length. */
+typedef struct {
+    uint8_t kind;
+    uint8_t unused;
+    uint16_t length;
+    uint32_t unused2;
+    uint64_t start;
+    uint64_t end;
+    uint64_t preferred_base;
+    char path[];
+} event_module_t;
+
+#endif // EVENT_LOG_H
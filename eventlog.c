@@ -0,0 +1,239 @@
+#include "eventlog.h"
+
+#include <drmgr.h>
+#include <string.h>
+
+#include "defines.h"
+#include "options.h"
+
+#define EVENTLOG_INTERVAL_MS 100
+
+/* Events each thread can have waiting. */
+#define RING_SIZE 1024
+
+/* Only the owning thread writes head and dropped, and only the draining
+ * thread, holding log_lock, writes tail and dropped_logged. */
+typedef struct _ring_t {
+    event_record_t events[RING_SIZE];
+    volatile uint head;
+    volatile uint tail;
+    volatile uint dropped;
+    uint dropped_logged;
+    uint thread;
+    struct _ring_t *prev, *next;
+} ring_t;
+
+/* The flush thread's life: it runs unless exit got there first, and once
+ * told to stop signals flush_done as it leaves. */
+#define FLUSH_STARTING 0
+#define FLUSH_RUNNING 1
+#define FLUSH_STOPPING 2
+
+static ring_t *rings;
+static void *log_lock;
+static volatile int flush_state = FLUSH_STARTING;
+static void *flush_done;
+static file_t log_file = INVALID_FILE;
+static int tls_idx;
+
+static void event_thread_init(void *drcontext);
+static void event_thread_exit(void *drcontext);
+static void event_module_load(void *drcontext, const module_data_t *mod, bool loaded);
+static void drain(ring_t *ring);
+static void flush_thread_main(void *arg);
+
+void
+eventlog_init(void)
+{
+    event_log_header_t header = { EVENT_LOG_MAGIC, EVENT_LOG_VERSION, 0 };
+
+    if (options.event_log[0] == '\0')
+        return;
+    log_file = dr_open_file(options.event_log, DR_FILE_WRITE_OVERWRITE);
+    if (log_file == INVALID_FILE) {
+        dr_fprintf(STDERR, "shady: can't create %s\n", options.event_log);
+        return;
+    }
+    header.pid = dr_get_process_id();
+    dr_write_file(log_file, &header, sizeof header);
+
+    log_lock = dr_mutex_create();
+    tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(tls_idx != -1);
+    drmgr_register_thread_init_event(event_thread_init);
+    drmgr_register_thread_exit_event(event_thread_exit);
+    dr_register_module_load_event(event_module_load);
+    flush_done = dr_event_create();
+    dr_create_client_thread(flush_thread_main, NULL);
+}
+
+void
+eventlog_exit(void)
+{
+    ring_t *ring;
+
+    if (log_file == INVALID_FILE)
+        return;
+    // Nothing may be holding log_lock once it is destroyed.
+    if (! __sync_bool_compare_and_swap(&flush_state, FLUSH_STARTING, FLUSH_STOPPING)) {
+        flush_state = FLUSH_STOPPING;
+        dr_event_wait(flush_done);
+    }
+    dr_event_destroy(flush_done);
+
+    dr_mutex_lock(log_lock);
+    for (ring = rings; ring != NULL; ring = ring->next)
+        drain(ring);
+    dr_close_file(log_file);
+    log_file = INVALID_FILE;
+    dr_mutex_unlock(log_lock);
+
+    dr_unregister_module_load_event(event_module_load);
+    drmgr_unregister_tls_field(tls_idx);
+    dr_mutex_destroy(log_lock);
+}
+
+void
+eventlog_record(void *drcontext, int kind, app_pc pc, app_pc addr,
+        ptr_uint_t value, uint size)
+{
+    ring_t *ring;
+    event_record_t *e;
+
+    if (log_file == INVALID_FILE)
+        return;
+    ring = drmgr_get_tls_field(drcontext, tls_idx);
+    if (ring->head - ring->tail == RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+
+    e = &ring->events[ring->head % RING_SIZE];
+    e->kind = kind;
+    e->size = size < 255 ? size : 255;
+    e->length = sizeof(event_record_t);
+    e->thread = ring->thread;
+    e->pc = (ptr_uint_t)pc;
+    e->addr = (ptr_uint_t)addr;
+    e->value = value;
+    // The drain mustn't see the new head before the event.
+    __sync_synchronize();
+    ring->head++;
+}
+
+/* Global heap: the flush thread reads it. */
+static void
+event_thread_init(void *drcontext)
+{
+    ring_t *ring = dr_global_alloc(sizeof(ring_t));
+
+    ring->head = ring->tail = 0;
+    ring->dropped = ring->dropped_logged = 0;
+    ring->thread = dr_get_thread_id(drcontext);
+    drmgr_set_tls_field(drcontext, tls_idx, ring);
+
+    dr_mutex_lock(log_lock);
+    ring->prev = NULL;
+    ring->next = rings;
+    if (rings != NULL)
+        rings->prev = ring;
+    rings = ring;
+    dr_mutex_unlock(log_lock);
+}
+
+static void
+event_thread_exit(void *drcontext)
+{
+    ring_t *ring = drmgr_get_tls_field(drcontext, tls_idx);
+
+    dr_mutex_lock(log_lock);
+    if (log_file != INVALID_FILE)
+        drain(ring);
+    if (ring->prev != NULL)
+        ring->prev->next = ring->next;
+    else
+        rings = ring->next;
+    if (ring->next != NULL)
+        ring->next->prev = ring->prev;
+    dr_mutex_unlock(log_lock);
+
+    dr_global_free(ring, sizeof(ring_t));
+}
+
+static void
+event_module_load(void *drcontext, const module_data_t *mod, bool loaded)
+{
+    const char *path = mod->full_path != NULL ? mod->full_path : "";
+    size_t len = sizeof(event_module_t) + strlen(path) + 1;
+    event_module_t *m;
+
+    len = (len + 7) & ~(size_t)7;
+    m = dr_global_alloc(len);
+    memset(m, 0, len);
+    m->kind = EVENT_MODULE;
+    m->length = len;
+    m->start = (ptr_uint_t)mod->start;
+    m->end = (ptr_uint_t)mod->end;
+    m->preferred_base = (ptr_uint_t)mod->preferred_base;
+    strcpy(m->path, path);
+
+    dr_mutex_lock(log_lock);
+    if (log_file != INVALID_FILE)
+        dr_write_file(log_file, m, len);
+    dr_mutex_unlock(log_lock);
+    dr_global_free(m, len);
+}
+
+/* Writes out what ring has waiting, and how many events it dropped since
+ * the last time.  Caller holds log_lock. */
+static void
+drain(ring_t *ring)
+{
+    uint head = ring->head;
+    uint tail = ring->tail;
+    uint dropped = ring->dropped;
+
+    __sync_synchronize();
+    // The waiting events may wrap around the end of the ring.
+    while (tail != head) {
+        uint n = RING_SIZE - tail % RING_SIZE;
+        if (n > head - tail)
+            n = head - tail;
+        dr_write_file(log_file, &ring->events[tail % RING_SIZE],
+                n * sizeof(event_record_t));
+        tail += n;
+    }
+    __sync_synchronize();
+    ring->tail = head;
+
+    if (dropped != ring->dropped_logged) {
+        event_record_t e;
+        memset(&e, 0, sizeof e);
+        e.kind = EVENT_DROPPED;
+        e.length = sizeof e;
+        e.thread = ring->thread;
+        e.value = dropped - ring->dropped_logged;
+        dr_write_file(log_file, &e, sizeof e);
+        ring->dropped_logged = dropped;
+    }
+}
+
+/* Never suspended, not even at exit, so that it can't be stopped while
+ * holding log_lock and eventlog_exit() can wait for it to finish. */
+static void
+flush_thread_main(void *arg)
+{
+    ring_t *ring;
+
+    dr_client_thread_set_suspendable(false);
+    if (! __sync_bool_compare_and_swap(&flush_state, FLUSH_STARTING, FLUSH_RUNNING))
+        return;
+    while (flush_state == FLUSH_RUNNING) {
+        dr_sleep(EVENTLOG_INTERVAL_MS);
+        dr_mutex_lock(log_lock);
+        for (ring = rings; ring != NULL; ring = ring->next)
+            drain(ring);
+        dr_mutex_unlock(log_lock);
+    }
+    dr_event_signal(flush_done);
+}
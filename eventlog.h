@@ -0,0 +1,21 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <dr_api.h>
+
+#include "event_log.h"
+
+/* Each thread queues its events in a ring of its own, which never blocks
+ * it: when the ring is full the event is dropped and counted.  A client
+ * thread drains the rings into the -event_log file every
+ * EVENTLOG_INTERVAL_MS, so a storm of events costs no I/O on the threads
+ * causing it. */
+void eventlog_init(void);
+void eventlog_exit(void);
+
+/* Queues one event for the calling thread.  Does nothing without
+ * -event_log. */
+void eventlog_record(void *drcontext, int kind, app_pc pc, app_pc addr,
+        ptr_uint_t value, uint size);
+
+#endif // EVENTLOG_H
@@ -1,46 +1,398 @@
 #include <dr_api.h>
-#include <drsyms.h>
+#include <drmgr.h>
 #include <drwrap.h>
+#include <errno.h>
 #include <hashtable.h>
 #include <string.h>
 
+#include "arena.h"
 #include "defines.h"
+#include "eventlog.h"
 #include "inst_malloc.h"
+#include "options.h"
+#include "quarantine.h"
+#include "shadow.h"
 #include "shady_util.h"
+#include "stats.h"
+#include "symcache.h"
+
+/* Every block we hand out starts with a header in its pre-redzone, so free
+ * and realloc find a block's size with pointer arithmetic alone.  The
+ * header's granules are shadowed SHADOW_HEAP_HEADER, which nothing else
+ * uses: that is what says a pointer is genuine before the header itself is
+ * read, and it can't fault or be forged by a stray application write. */
+typedef struct {
+  ptr_uint_t size;
+  volatile ushort state;
+  ushort site;  /* index into sites, to blame overflows on */
+  ushort post;  /* bytes of post-redzone it was given; 0 if guarded */
+  ushort magic;
+} heap_header_t;
+
+#define HEADER_MAGIC 0x5ad1a110
+
+#define BLOCK_ALLOCATED 0xa1
+#define BLOCK_FREED 0xf7
+
+/* What a quarantined block's contents are overwritten with, for the sake of
+ * code that isn't checked. */
+#define FREED_FILL 0xfd
+
+static const int heap_pre_redzone_size =
+  (sizeof(heap_header_t) + SHADOW_GRANULE - 1) & ~(SHADOW_GRANULE - 1);
+
+/* Each allocation site (the caller of malloc, calloc or realloc) has its
+ * own post-redzone size.  It starts at -redzone_min, and each overflow
+ * found off a block given the site's current size doubles it, up to
+ * -redzone_max.  Once the post-redzones of live blocks add up to
+ * -redzone_budget_mb, new blocks get the minimum.  Sites past MAX_SITES
+ * share site 0. */
+#define MAX_SITES 16384
+
+/* How far back from a redzone hit the block it overflowed is looked for. */
+#define MAX_OVERFLOW_WALK (64 * 1024)
+
+typedef struct {
+  app_pc pc;
+  volatile uint post;
+} site_t;
+
+static site_t sites[MAX_SITES];
+static int num_sites = 1;
+static hashtable_t sites_by_pc[1];
+static void *site_lock;
+static volatile ptr_int_t live_redzone_bytes;
+static volatile int grown_sites;
+
+/* Blocks of -guard_above bytes or more end right against a PROT_NONE page
+ * instead of a post-redzone, so running off their end faults.  They are
+ * kept 16-byte aligned like anything malloc returns, and the allocation
+ * has two pages of slack so the guard page always fits inside it.
+ * guard_pages maps each guard page to the real base of its block. */
+#define GUARD_ALIGN 16
+
+static hashtable_t guard_pages[1];
+
+/* Under -sample N only about one allocation in N becomes a block of ours,
+ * always guarded; the rest are left to the allocator untouched, and a free
+ * of a pointer without a header passes straight through. */
+
+/* Per-thread state.  The allocator may call itself (calloc calling malloc,
+ * say), and only the outermost call gets redzones; that depth is tracked
+ * per thread so concurrent allocations don't see each other's.  The block
+ * being realloc'd is kept until we know whether realloc succeeded, and
+ * whether the outermost allocation was passed over by -sample. */
+typedef struct {
+  int malloc_level;
+  char *realloc_old;
+  ptr_uint_t realloc_old_sz;
+  uint realloc_old_post;
+  uint realloc_old_site;
+  uint random;
+  bool unsampled;
+  uint site;  /* of the outermost allocation, and the redzone it gets */
+  uint post;
+} malloc_tls_t;
+
+static int tls_idx;
 
-static const int heap_pre_redzone_size = 0;
-static const int heap_post_redzone_size = 16;
+static void exit_fn() {
+  if (options.replace_malloc)
+    arena_exit();
+  DEBUG("%d allocation sites, %d with grown redzones\n", num_sites,
+        grown_sites);
+  hashtable_delete(guard_pages);
+  hashtable_delete(sites_by_pc);
+  dr_mutex_destroy(site_lock);
+  drmgr_unregister_tls_field(tls_idx);
+  drwrap_exit();
+}
 
-static hashtable_t mallocd_ptrs[1];
+static void thread_init_fn(void *drcontext) {
+  malloc_tls_t *tls = dr_thread_alloc(drcontext, sizeof(malloc_tls_t));
+  tls->malloc_level = 0;
+  tls->realloc_old = NULL;
+  tls->random = (dr_get_thread_id(drcontext) * 2654435761u)
+    ^ (uint)dr_get_milliseconds();
+  if (tls->random == 0)
+    tls->random = 1;
+  tls->unsampled = false;
+  drmgr_set_tls_field(drcontext, tls_idx, tls);
+}
 
-static char *my_mallocs[] = {
-  "tmalloc" };
-static int num_mallocs = sizeof my_mallocs / sizeof my_mallocs[0];
+static void thread_exit_fn(void *drcontext) {
+  malloc_tls_t *tls = drmgr_get_tls_field(drcontext, tls_idx);
+  dr_thread_free(drcontext, tls, sizeof(malloc_tls_t));
+}
 
-static char *my_frees[] = {
-  "tfree" };
-static int num_frees = sizeof my_frees / sizeof my_frees[0];
+static malloc_tls_t *get_tls(void *wrapctx) {
+  return drmgr_get_tls_field(drwrap_get_drcontext(wrapctx), tls_idx);
+}
 
-static int malloc_level;
+static void count_alloc_in(void *drcontext, ptr_uint_t sz) {
+  thread_stats_t *stats = stats_thread(drcontext);
+  stats->allocs++;
+  stats->bytes_allocated += sz;
+}
 
-static void exit_fn() {
-  drsym_exit();
-  drwrap_exit();
+static void count_free_in(void *drcontext, ptr_uint_t sz) {
+  thread_stats_t *stats = stats_thread(drcontext);
+  stats->frees++;
+  stats->bytes_freed += sz;
 }
 
-static void fill_sentinel(void *_a, int n) {
-  int *a = (int*)_a;
-  int i;
-  for (i = 0; i < n; ++i) {
-    a[i] = SENTINEL;
+static void count_alloc(void *wrapctx, ptr_uint_t sz) {
+  count_alloc_in(drwrap_get_drcontext(wrapctx), sz);
+}
+
+static void count_free(void *wrapctx, ptr_uint_t sz) {
+  count_free_in(drwrap_get_drcontext(wrapctx), sz);
+}
+
+/* Sizes are rounded to whole shadow granules so that redzones never share
+ * a granule with anything else. */
+static ptr_uint_t round_to_granule(ptr_uint_t sz) {
+  return (sz + SHADOW_GRANULE - 1) & ~(ptr_uint_t)(SHADOW_GRANULE - 1);
+}
+
+static ptr_uint_t round_to_guard_align(ptr_uint_t sz) {
+  return (sz + GUARD_ALIGN - 1) & ~(ptr_uint_t)(GUARD_ALIGN - 1);
+}
+
+static bool is_guarded(ptr_uint_t sz) {
+  if (options.sample > 0)
+    return true;
+  return options.guard_above > 0 && sz >= options.guard_above;
+}
+
+/* Whether to pass over an allocation under -sample (xorshift32). */
+static bool skip_sample(malloc_tls_t *tls) {
+  if (options.sample == 0)
+    return false;
+  tls->random ^= tls->random << 13;
+  tls->random ^= tls->random >> 17;
+  tls->random ^= tls->random << 5;
+  return tls->random % options.sample != 0;
+}
+
+static ptr_uint_t real_size(ptr_uint_t sz, uint post) {
+  if (is_guarded(sz))
+    return heap_pre_redzone_size + round_to_guard_align(sz) + 2 * PAGE_SIZE;
+  return heap_pre_redzone_size + round_to_granule(sz) + post;
+}
+
+/* Returns the index of the site at pc, adding it the first time. */
+static uint find_site(app_pc pc) {
+  uint site = (uint)(ptr_uint_t)hashtable_lookup(sites_by_pc, pc);
+  if (site != 0)
+    return site;
+  dr_mutex_lock(site_lock);
+  site = (uint)(ptr_uint_t)hashtable_lookup(sites_by_pc, pc);
+  if (site == 0 && num_sites < MAX_SITES) {
+    site = num_sites++;
+    sites[site].pc = pc;
+    sites[site].post = options.redzone_min;
+    hashtable_add(sites_by_pc, pc, (void*)(ptr_uint_t)site);
   }
+  dr_mutex_unlock(site_lock);
+  return site;
+}
+
+/* Picks the site and post-redzone of an outermost allocation of sz bytes
+ * called from pc. */
+static void choose_redzone(malloc_tls_t *tls, app_pc pc, ptr_uint_t sz) {
+  tls->site = find_site(pc);
+  tls->post = sites[tls->site].post;
+  if (is_guarded(sz))
+    tls->post = 0;
+  else if (tls->post > options.redzone_min
+           && live_redzone_bytes + tls->post
+              > (ptr_int_t)options.redzone_budget_mb << 20)
+    tls->post = options.redzone_min;
+}
+
+/* Ties a header to the user pointer it sits in front of, so a copy of a
+ * header somewhere else doesn't validate. */
+static ushort header_magic(char *user) {
+  uint h = (uint)(((ptr_uint_t)user >> 3) * 2654435761u) ^ HEADER_MAGIC;
+  return (ushort)(h ^ (h >> 16));
+}
+
+/* Marks the user region of a block addressable, byte for byte, and its
+ * header and the post bytes of redzone after it as such. */
+static void poison_block(char *user, ptr_uint_t sz, ptr_uint_t post) {
+  shadow_poison((app_pc)user - heap_pre_redzone_size, heap_pre_redzone_size,
+                SHADOW_HEAP_HEADER);
+  shadow_unpoison((app_pc)user, sz);
+  shadow_poison((app_pc)user + sz, round_to_granule(sz) - sz + post,
+                SHADOW_HEAP_REDZONE);
+}
+
+/* Hands a block back to the allocator with no redzones left in it. */
+static void unpoison_block(char *real_base, ptr_uint_t sz, uint post) {
+  shadow_unpoison((app_pc)real_base, real_size(sz, post));
+  __sync_fetch_and_sub(&live_redzone_bytes, post);
+}
+
+/* Turns what the allocator returned into a block of sz user bytes and
+ * returns the pointer the application gets.  The first carried bytes after
+ * the header's usual place are contents realloc brought along; a guarded
+ * block's user region starts elsewhere, so they are moved there. */
+static char *new_block(char *real_base, ptr_uint_t sz, uint site, uint post,
+                       ptr_uint_t carried) {
+  char *user = real_base + heap_pre_redzone_size;
+  ptr_uint_t redzone = post;
+
+  if (is_guarded(sz)) {
+    char *guard = (char*)ALIGN_FORWARD(user + round_to_guard_align(sz),
+                                       PAGE_SIZE);
+    user = guard - round_to_guard_align(sz);
+    redzone = round_to_guard_align(sz) - round_to_granule(sz);
+    if (carried > 0)
+      memmove(user, real_base + heap_pre_redzone_size, carried);
+    /* the slack in front of the header */
+    shadow_poison((app_pc)real_base, user - heap_pre_redzone_size - real_base,
+                  SHADOW_HEAP_REDZONE);
+    /* the guard page itself stays addressable in the shadow, so the inline
+     * checks let overflows through to fault on it */
+    dr_memory_protect(guard, PAGE_SIZE, DR_MEMPROT_NONE);
+    hashtable_add(guard_pages, guard, real_base);
+  }
+
+  heap_header_t *hdr = (heap_header_t*)(user - heap_pre_redzone_size);
+  hdr->size = sz;
+  hdr->state = BLOCK_ALLOCATED;
+  hdr->site = site;
+  hdr->post = post;
+  hdr->magic = header_magic(user);
+  poison_block(user, sz, redzone);
+  __sync_fetch_and_add(&live_redzone_bytes, post);
+  return user;
+}
+
+/* Returns the real base of a block we handed out, making its guard page
+ * accessible again if it has one. */
+static char *block_base(char *user, ptr_uint_t sz) {
+  char *guard, *real_base;
+
+  if (!is_guarded(sz))
+    return user - heap_pre_redzone_size;
+  guard = user + round_to_guard_align(sz);
+  real_base = hashtable_lookup(guard_pages, guard);
+  DR_ASSERT(real_base != NULL);
+  dr_memory_protect(guard, PAGE_SIZE, DR_MEMPROT_READ | DR_MEMPROT_WRITE);
+  hashtable_remove(guard_pages, guard);
+  return real_base;
+}
+
+bool malloc_is_guard_page(app_pc addr) {
+  if (options.replace_malloc)
+    return arena_is_guard_page(addr);
+  return hashtable_lookup(guard_pages, (void*)ALIGN_BACKWARD(addr, PAGE_SIZE))
+    != NULL;
+}
+
+/* Returns the header of a block we handed out, or NULL if user isn't the
+ * start of one.  The shadow is checked first since it is always readable. */
+static heap_header_t *find_header(char *user) {
+  char *real_base = user - heap_pre_redzone_size;
+  heap_header_t *hdr = (heap_header_t*)real_base;
+  int off;
+
+  if (((ptr_uint_t)user & (SHADOW_GRANULE - 1)) != 0)
+    return NULL;
+  for (off = 0; off < heap_pre_redzone_size; off += SHADOW_GRANULE) {
+    if (shadow_get((app_pc)real_base + off) != SHADOW_HEAP_HEADER)
+      return NULL;
+  }
+  if (hdr->magic != header_magic(user))
+    return NULL;
+  return hdr;
+}
+
+/* Walks back from a redzone hit at addr over the post-redzone and the user
+ * bytes before it to the block's header, and doubles the redzone of the
+ * block's site unless it has grown since the block was made. */
+void malloc_note_overflow(app_pc addr) {
+  ptr_uint_t a = ALIGN_BACKWARD(addr, SHADOW_GRANULE);
+  ptr_uint_t stop = a > MAX_OVERFLOW_WALK ? a - MAX_OVERFLOW_WALK : 0;
+  heap_header_t *hdr;
+  site_t *site;
+  uint post;
+
+  /* past the end of a block's partial last granule: its redzone is next */
+  if (shadow_get((app_pc)a) > 0 && shadow_get((app_pc)a) < SHADOW_GRANULE)
+    a += SHADOW_GRANULE;
+  if (shadow_get((app_pc)a) != SHADOW_HEAP_REDZONE)
+    return;
+  while (a > stop && shadow_get((app_pc)a) == SHADOW_HEAP_REDZONE)
+    a -= SHADOW_GRANULE;
+  while (a > stop && (shadow_get((app_pc)a) & 0x80) == 0)
+    a -= SHADOW_GRANULE;
+  if (shadow_get((app_pc)a) != SHADOW_HEAP_HEADER)
+    return;
+  hdr = find_header((char*)a + SHADOW_GRANULE);
+  if (hdr == NULL || hdr->post == 0)
+    return;
+
+  site = &sites[hdr->site];
+  post = site->post;
+  if (hdr->post != post || post >= options.redzone_max)
+    return;
+  if (__sync_bool_compare_and_swap(&site->post, post,
+                                   post * 2 < options.redzone_max ?
+                                   post * 2 : options.redzone_max)) {
+    DEBUG("overflow off a block from %p: redzone now %u\n", site->pc,
+          site->post);
+    if (post == options.redzone_min)
+      __sync_fetch_and_add(&grown_sites, 1);
+  }
+}
+
+uint64 malloc_redzone_bytes(void) {
+  return live_redzone_bytes;
+}
+
+uint64 malloc_grown_sites(void) {
+  return grown_sites;
+}
+
+/* Marks a freed block's user region as such and queues it.  Returns the
+ * real base of the block the allocator should free in its place, if any. */
+static char *quarantine_block(char *user, ptr_uint_t sz) {
+  quarantine_entry_t e;
+  ptr_uint_t evicted_sz;
+  char *evicted;
+  uint post;
+
+  memset(user, FREED_FILL, sz);
+  shadow_poison((app_pc)user, round_to_granule(sz), SHADOW_HEAP_FREED);
+  /* free can only hand the allocator one block */
+  if (quarantine_push(user, sz, &e, 1) == 0)
+    return NULL;
+  evicted = e.user;
+  evicted_sz = e.size;
+  DEBUG("evicting %p from quarantine\n", evicted);
+  /* its header is left alone while it is queued */
+  post = ((heap_header_t*)(evicted - heap_pre_redzone_size))->post;
+  evicted = block_base(evicted, evicted_sz);
+  unpoison_block(evicted, evicted_sz, post);
+  return evicted;
+}
+
+/* Claims a live block for freeing.  Of several frees of the same block,
+ * racing or not, only the first gets true. */
+static bool release_block(heap_header_t *hdr) {
+  return __sync_bool_compare_and_swap(&hdr->state, BLOCK_ALLOCATED,
+                                      BLOCK_FREED);
 }
 
 static void before_malloc(void *wrapctx, OUT void **user_data) {
+  malloc_tls_t *tls = get_tls(wrapctx);
   print_mem_registers(NULL, "before_malloc start.");
-  DEBUG("Malloc level is %d\n", malloc_level);
+  DEBUG("Malloc level is %d\n", tls->malloc_level);
 
-  if (malloc_level++ > 0) {
+  if (tls->malloc_level++ > 0) {
     DEBUG("NESTED BEFORE_MALLOC\n");
     return;
   }
@@ -48,13 +400,14 @@ static void before_malloc(void *wrapctx, OUT void **user_data) {
   void *arg = drwrap_get_arg(wrapctx, 0);
   ptr_uint_t sz = (ptr_uint_t)arg;
   DEBUG("malloc called with size of %d\n", sz);
-  int mod = sz % sizeof (ptr_uint_t);
-  if (mod != 0) {
-    sz += sizeof(ptr_uint_t) - mod;
-  }
-  DEBUG("rounded up to %d\n", sz);
 
-  ptr_uint_t new_sz = sz + heap_pre_redzone_size + heap_post_redzone_size;
+  tls->unsampled = skip_sample(tls);
+  if (tls->unsampled)
+    return;
+
+  choose_redzone(tls, drwrap_get_retaddr(wrapctx), sz);
+  ptr_uint_t new_sz = real_size(sz, tls->post);
+  DEBUG("real size is %d\n", new_sz);
   drwrap_set_arg(wrapctx, 0, (void*)new_sz);
 
   /* save original size request */
@@ -64,12 +417,15 @@ static void before_malloc(void *wrapctx, OUT void **user_data) {
 }
 
 static void after_malloc(void *wrapctx, void *user_data) {
+  malloc_tls_t *tls = get_tls(wrapctx);
   print_mem_registers(NULL, "after_malloc start");
-  DEBUG("malloc level is %d\n", malloc_level);
-  if (--malloc_level > 0) {
+  DEBUG("malloc level is %d\n", tls->malloc_level);
+  if (--tls->malloc_level > 0) {
     DEBUG("NESTED AFTER_MALLOC\n");
     return;
   }
+  if (tls->unsampled)
+    return;
   void *ret = drwrap_get_retval(wrapctx);
   DEBUG("malloc returning with ptr %p\n", ret);
 
@@ -78,22 +434,17 @@ static void after_malloc(void *wrapctx, void *user_data) {
     return;
   }
 
-  fill_sentinel(ret, heap_pre_redzone_size / sizeof (ptr_uint_t));
-  int orig_sz = (int)user_data;
-  char *new_retval = (char*)ret + heap_pre_redzone_size;
-  fill_sentinel(new_retval + orig_sz, heap_post_redzone_size / sizeof (ptr_uint_t));
-
+  ptr_uint_t orig_sz = (ptr_uint_t)user_data;
+  char *new_retval = new_block(ret, orig_sz, tls->site, tls->post, 0);
   drwrap_set_retval(wrapctx, new_retval);
-
-  /* We save user base ptr / size */
-  DEBUG ("adding %p to hashtable\n", new_retval);
-  hashtable_add(mallocd_ptrs, new_retval, (void*)orig_sz);
+  count_alloc(wrapctx, orig_sz);
 
   print_mem_registers(NULL, "after_malloc end");
 }
 
 static void before_calloc(void *wrapctx, OUT void **user_data) {
-  if (malloc_level++ > 0) {
+  malloc_tls_t *tls = get_tls(wrapctx);
+  if (tls->malloc_level++ > 0) {
     DEBUG("NESTED BEFORE_CALLOC\n");
     return;
   }
@@ -104,15 +455,14 @@ static void before_calloc(void *wrapctx, OUT void **user_data) {
 
   DEBUG("calloc called with args (%u, %u)\n", n, sz);
 
-  int total_sz = n * sz;
-  int mod = total_sz % sizeof (ptr_uint_t);
-  if (mod != 0) {
-    total_sz += sizeof(ptr_uint_t) - mod;
-  }
-  DEBUG("Rounded up to total size of %d\n", total_sz);
+  tls->unsampled = skip_sample(tls);
+  if (tls->unsampled)
+    return;
 
-  ptr_uint_t new_sz = total_sz + heap_pre_redzone_size +
-    heap_post_redzone_size;
+  ptr_uint_t total_sz = n * sz;
+  choose_redzone(tls, drwrap_get_retaddr(wrapctx), total_sz);
+  ptr_uint_t new_sz = real_size(total_sz, tls->post);
+  DEBUG("real size is %d\n", new_sz);
   drwrap_set_arg(wrapctx, 0, (void*)new_sz);
   drwrap_set_arg(wrapctx, 1, (void*)1);
 
@@ -125,10 +475,13 @@ static void before_calloc(void *wrapctx, OUT void **user_data) {
 }
 
 static void after_calloc(void *wrapctx, void *user_data) {
-  if (--malloc_level > 0) {
+  malloc_tls_t *tls = get_tls(wrapctx);
+  if (--tls->malloc_level > 0) {
     DEBUG("NESTED AFTER_CALLOC\n");
     return;
   }
+  if (tls->unsampled)
+    return;
   void *ret = drwrap_get_retval(wrapctx);
   DEBUG("malloc returning with ptr %p\n", ret);
 
@@ -137,24 +490,19 @@ static void after_calloc(void *wrapctx, void *user_data) {
     return;
   }
 
-  fill_sentinel(ret, heap_pre_redzone_size / sizeof (ptr_uint_t));
-  int orig_sz = (int)user_data;
-  char *new_retval = (char*)ret + heap_pre_redzone_size;
-  fill_sentinel(new_retval + orig_sz, heap_post_redzone_size / sizeof (ptr_uint_t));
-
+  ptr_uint_t orig_sz = (ptr_uint_t)user_data;
+  char *new_retval = new_block(ret, orig_sz, tls->site, tls->post, 0);
   drwrap_set_retval(wrapctx, new_retval);
-
-  /* We save user base ptr / size */
-  DEBUG ("adding %p to hashtable\n", new_retval);
-  hashtable_add(mallocd_ptrs, new_retval, (void*)orig_sz);
+  count_alloc(wrapctx, orig_sz);
 
   print_mem_registers(NULL, "after_calloc end");
 }
 
 static void before_free(void *wrapctx, OUT void **user_data) {
+  malloc_tls_t *tls = get_tls(wrapctx);
   print_mem_registers(NULL, "before_free start.");
-  DEBUG("malloc_level is %d\n", malloc_level);
-  if (malloc_level++ > 0) {
+  DEBUG("malloc_level is %d\n", tls->malloc_level);
+  if (tls->malloc_level++ > 0) {
     DEBUG("NESTED BEFORE_FREE\n");
     return;
   }
@@ -165,105 +513,307 @@ static void before_free(void *wrapctx, OUT void **user_data) {
   }
   DEBUG("free called with %p\n", arg);
 
-  void *lookup = hashtable_lookup(mallocd_ptrs, arg);
-  if (lookup == NULL) {
-    /* We "skip" free by setting arg to NULL */
+  heap_header_t *hdr = find_header(arg);
+  if (hdr == NULL && options.sample > 0) {
+    return; /* most likely a block -sample passed over */
+  }
+  if (hdr == NULL || !release_block(hdr)) {
+    /* Not ours, or already freed: we "skip" free by setting arg to NULL */
     DEBUG("skipping\n");
+    eventlog_record(drwrap_get_drcontext(wrapctx), EVENT_BAD_FREE,
+                    drwrap_get_retaddr(wrapctx), arg, 0, 0);
     drwrap_set_arg(wrapctx, 0, NULL);
+  } else if (quarantine_accepts(hdr->size)) {
+    /* free the oldest quarantined block instead, or nothing */
+    count_free(wrapctx, hdr->size);
+    char *real_base = quarantine_block(arg, hdr->size);
+    DEBUG("setting free val to %p\n", real_base);
+    drwrap_set_arg(wrapctx, 0, real_base);
   } else {
-    int orig_sz = (int)lookup;
-    char *real_base = (char*)arg - heap_pre_redzone_size;
-    /* zero out to avoid false positives */
-    memset(real_base, 0, heap_pre_redzone_size +
-           heap_post_redzone_size + orig_sz);           
+    char *real_base = block_base(arg, hdr->size);
+    /* the allocator is free to touch all of it again */
+    unpoison_block(real_base, hdr->size, hdr->post);
+    count_free(wrapctx, hdr->size);
 
     DEBUG("setting free val to %p\n", real_base);
     drwrap_set_arg(wrapctx, 0, real_base);
-    hashtable_remove(mallocd_ptrs, arg);
   }
   print_mem_registers(NULL, "before_free end.");
 }
 
 static void after_free(void *wrapctx, void *user_data) {
+  malloc_tls_t *tls = get_tls(wrapctx);
   print_mem_registers(NULL, "after_free start");
-  DEBUG("malloc_level is %d\n", malloc_level);
-  malloc_level--;
+  DEBUG("malloc_level is %d\n", tls->malloc_level);
+  tls->malloc_level--;
 }
 
 static void before_realloc(void *wrapctx, OUT void **user_data) {
-  if (malloc_level++ > 0) {
+  malloc_tls_t *tls = get_tls(wrapctx);
+  if (tls->malloc_level++ > 0) {
     DEBUG("NESTED BEFORE_REALLOC\n");
     return;
   }
   void *ptr = drwrap_get_arg(wrapctx, 0);
   void *sz_arg = drwrap_get_arg(wrapctx, 1);
-  int sz = (int)sz_arg;
+  ptr_uint_t sz = (ptr_uint_t)sz_arg;
   DEBUG("realloc called with (%p, %d)\n", ptr, sz);
-  int mod = sz % sizeof (ptr_uint_t);
-  if (mod != 0) {
-    sz += sizeof(ptr_uint_t) - mod;
-  }
-  DEBUG("rounded up to size %d\n", sz);
+
+  tls->realloc_old = NULL;
+  *(ptr_uint_t*)user_data = 0;
 
   if (ptr == NULL && sz == 0) {
     // TODO:  Is this a no-op? Can we just return NULL?
     return;
   }
   if (ptr == NULL) {
-    // TODO: this is really a malloc(sz)
+    /* this is really a malloc(sz) */
+    if (skip_sample(tls))
+      return;
+    choose_redzone(tls, drwrap_get_retaddr(wrapctx), sz);
+    drwrap_set_arg(wrapctx, 1, (void*)real_size(sz, tls->post));
+    *(ptr_uint_t*)user_data = sz;
     return;
   }
-  if (sz == 0) {
-    // TODO: this doesn't touch the hashmap or anything
-    char *real_base = (char*)ptr - heap_pre_redzone_size;
-    drwrap_set_arg(wrapctx, 0, real_base);
-    *(int*)user_data = sz;
+
+  heap_header_t *hdr = find_header(ptr);
+  if (hdr == NULL) {
+    DEBUG("realloc of unknown ptr %p\n", ptr);
+    // TODO: what if we don't know about this ptr?
     return;
   }
-  /* At this point we know this is a real realloc. We need to update
-     args to handle redzones. */
-  void *lookup = hashtable_lookup(mallocd_ptrs, ptr);
-  if (lookup == NULL) {
-    DEBUG("realloc lookup fail\n");
-    // TODO: what if we don't know about this ptr?
+  if (!release_block(hdr)) {
+    /* realloc of a freed block: keep the allocator away from it */
+    DEBUG("realloc of freed ptr %p\n", ptr);
+    drwrap_set_arg(wrapctx, 0, NULL);
+    choose_redzone(tls, drwrap_get_retaddr(wrapctx), sz);
+    drwrap_set_arg(wrapctx, 1, (void*)real_size(sz, tls->post));
+    *(ptr_uint_t*)user_data = sz;
     return;
-  } else {
-    // TODO: debug this code
-    int real_sz = sz + heap_pre_redzone_size + heap_post_redzone_size;
-    char *real_base = (char*)ptr - heap_pre_redzone_size;
-    int prev_sz = (int)lookup;
+  }
 
-    /* remove old red zone so it doesn't lead to false positive */
-    memset((char*)ptr + prev_sz, 0, heap_post_redzone_size);
+  char *real_base = block_base(ptr, hdr->size);
+  /* remove old red zones so the copy doesn't lead to false positives */
+  unpoison_block(real_base, hdr->size, hdr->post);
+  /* the allocator copies from where an unguarded block keeps its bytes */
+  if (is_guarded(hdr->size))
+    memmove(real_base + heap_pre_redzone_size, ptr, hdr->size);
+  tls->realloc_old = real_base;
+  tls->realloc_old_sz = hdr->size;
+  tls->realloc_old_post = hdr->post;
+  tls->realloc_old_site = hdr->site;
+  drwrap_set_arg(wrapctx, 0, real_base);
 
-    drwrap_set_arg(wrapctx, 0, real_base);
-    drwrap_set_arg(wrapctx, 1, (void*)real_sz);
-    DEBUG("realloc args rewritten to (%p, %d)\n", real_base, real_sz);
-    *(int*)user_data = sz;
+  if (sz == 0) {
+    /* this frees the block */
+    return;
   }
+  choose_redzone(tls, drwrap_get_retaddr(wrapctx), sz);
+  ptr_uint_t real_sz = real_size(sz, tls->post);
+  drwrap_set_arg(wrapctx, 1, (void*)real_sz);
+  DEBUG("realloc args rewritten to (%p, %d)\n", real_base, real_sz);
+  *(ptr_uint_t*)user_data = sz;
 }
 
 static void after_realloc(void *wrapctx, void *user_data) {
-  if (--malloc_level > 0) {
+  malloc_tls_t *tls = get_tls(wrapctx);
+  if (--tls->malloc_level > 0) {
     DEBUG("NESTED AFTER_REALLOC\n");
     return;
   }
-  int sz = (int)user_data;
+  ptr_uint_t sz = (ptr_uint_t)user_data;
   if (sz > 0) {
     void *ret = drwrap_get_retval(wrapctx);
     if (ret == NULL) {
+      /* the old block is still the application's */
+      if (tls->realloc_old != NULL)
+        new_block(tls->realloc_old, tls->realloc_old_sz,
+                  tls->realloc_old_site, tls->realloc_old_post,
+                  tls->realloc_old_sz);
       return;
     }
-    char *new_retval = (char*)ret + heap_pre_redzone_size;
-    fill_sentinel(new_retval + sz, heap_post_redzone_size / sizeof(ptr_uint_t));
+    ptr_uint_t carried = 0;
+    if (tls->realloc_old != NULL)
+      carried = sz < tls->realloc_old_sz ? sz : tls->realloc_old_sz;
+    char *new_retval = new_block(ret, sz, tls->site, tls->post, carried);
     drwrap_set_retval(wrapctx, new_retval);
-    hashtable_add_replace(mallocd_ptrs, new_retval, (void*)sz);
+    count_alloc(wrapctx, sz);
+  }
+  if (tls->realloc_old != NULL)
+    count_free(wrapctx, tls->realloc_old_sz);
+}
+
+/* Under -replace_malloc the allocator entry points are replaced outright
+ * and run natively: no call reaches the application's allocator, so there
+ * is no nesting to track and only one switch into DR per call. */
+static size_t (*app_usable_size)(void *);
+static void (*app_free)(void *);
+
+static void *enter_replacement(void) {
+  void *drcontext = dr_get_current_drcontext();
+  dr_switch_to_dr_state(drcontext);
+  return drcontext;
+}
+
+static void leave_replacement(void *drcontext) {
+  dr_switch_to_app_state(drcontext);
+  drwrap_replace_native_fini(drcontext);
+}
+
+/* Like leave_replacement(), but first hands foreign, a block from before
+ * the replacement went in, back to the application's allocator, in the
+ * application's state so that it runs on the application's TLS. */
+static void leave_replacement_freeing(void *drcontext, void *foreign) {
+  dr_switch_to_app_state(drcontext);
+  if (foreign != NULL && app_free != NULL)
+    app_free(foreign);
+  drwrap_replace_native_fini(drcontext);
+}
+
+/* The usable size of a block the application's allocator handed out before
+ * the replacement went in, or 0 if ptr doesn't look like one: it has to
+ * lie outside the arena, be unpoisoned and have a readable chunk header.
+ * glibc's malloc_usable_size only reads that header, so it is safe to run
+ * from here. */
+static size_t foreign_usable_size(void *ptr) {
+  size_t chunk;
+  if (app_usable_size == NULL || arena_owns(ptr) ||
+      shadow_get(ptr) != SHADOW_ADDRESSABLE ||
+      !dr_safe_read((char *)ptr - sizeof chunk, sizeof chunk, &chunk, NULL))
+    return 0;
+  return app_usable_size(ptr);
+}
+
+static void *arena_alloc_counted(void *drcontext, ptr_uint_t sz,
+                                 ptr_uint_t align) {
+  void *user = arena_alloc_aligned(sz, align);
+  if (user != NULL)
+    count_alloc_in(drcontext, sz);
+  return user;
+}
+
+static void arena_free_counted(void *drcontext, void *user) {
+  ptr_uint_t sz;
+  if (user == NULL)
+    return;
+  if (!arena_free(user, &sz)) {
+    /* not ours, or already freed: skip it */
+    DEBUG("skipping free of %p\n", user);
+    eventlog_record(drcontext, EVENT_BAD_FREE, NULL, user, 0, 0);
+    return;
   }
+  count_free_in(drcontext, sz);
+}
 
-  if (sz < 0) {
-    // TODO: we should use sz < 0 codes to signal that this is a weird
-    // realloc 
+static void *replace_malloc(size_t sz) {
+  void *drcontext = enter_replacement();
+  void *user = arena_alloc_counted(drcontext, sz, 16);
+  leave_replacement(drcontext);
+  return user;
+}
+
+static void *replace_calloc(size_t n, size_t sz) {
+  void *drcontext = enter_replacement();
+  void *user = NULL;
+  if (sz == 0 || n <= (size_t)-1 / sz) {
+    user = arena_alloc_counted(drcontext, n * sz, 16);
+    /* a reused slot holds FREED_FILL */
+    if (user != NULL)
+      memset(user, 0, n * sz);
   }
+  leave_replacement(drcontext);
+  return user;
+}
+
+static void *replace_realloc(void *ptr, size_t sz) {
+  void *drcontext = enter_replacement();
+  void *user = NULL;
+  void *foreign = NULL;
+  ptr_uint_t old_sz;
+
+  if (ptr != NULL && sz == 0) {
+    /* this frees the block */
+    arena_free_counted(drcontext, ptr);
+  } else if (ptr == NULL || !arena_block_size(ptr, &old_sz)) {
+    /* a malloc, or a block from before the replacement went in, whose
+     * contents carry over as far as the application's allocator says */
+    user = arena_alloc_counted(drcontext, sz, 16);
+    old_sz = ptr == NULL ? 0 : foreign_usable_size(ptr);
+    if (ptr != NULL && old_sz == 0)
+      DEBUG("realloc of unknown or freed ptr %p\n", ptr);
+    if (user != NULL && old_sz > 0) {
+      dr_safe_read(ptr, sz < old_sz ? sz : old_sz, user, NULL);
+      foreign = ptr;
+    }
+  } else {
+    user = arena_alloc_counted(drcontext, sz, 16);
+    /* on failure the old block is still the application's */
+    if (user != NULL) {
+      memcpy(user, ptr, sz < old_sz ? sz : old_sz);
+      arena_free_counted(drcontext, ptr);
+    }
+  }
+  leave_replacement_freeing(drcontext, foreign);
+  return user;
+}
+
+static void replace_free(void *ptr) {
+  void *drcontext = enter_replacement();
+  void *foreign = NULL;
+  /* blocks from before go back where they came from */
+  if (ptr != NULL && foreign_usable_size(ptr) > 0)
+    foreign = ptr;
+  else
+    arena_free_counted(drcontext, ptr);
+  leave_replacement_freeing(drcontext, foreign);
+}
+
+static bool is_power_of_two(size_t n) {
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+/* aligned_alloc has the same contract in glibc. */
+static void *replace_memalign(size_t align, size_t sz) {
+  void *drcontext = enter_replacement();
+  void *user = NULL;
+  if (is_power_of_two(align))
+    user = arena_alloc_counted(drcontext, sz, align);
+  leave_replacement(drcontext);
+  return user;
+}
+
+static int replace_posix_memalign(void **out, size_t align, size_t sz) {
+  void *drcontext;
+  void *user;
+  if (!is_power_of_two(align) || align % sizeof(void *) != 0)
+    return EINVAL;
+  drcontext = enter_replacement();
+  user = arena_alloc_counted(drcontext, sz, align);
+  leave_replacement(drcontext);
+  if (user == NULL)
+    return ENOMEM;
+  *out = user;
+  return 0;
+}
+
+/* Exactly what was asked for, so nothing relies on slack we would flag. */
+static size_t replace_malloc_usable_size(void *ptr) {
+  void *drcontext = enter_replacement();
+  ptr_uint_t sz;
+  if (ptr == NULL)
+    sz = 0;
+  else if (!arena_block_size(ptr, &sz))
+    sz = foreign_usable_size(ptr);
+  leave_replacement(drcontext);
+  return sz;
+}
+
+static void wrap_or_replace(app_pc addr, void (*pre)(void *, void **),
+                            void (*post)(void *, void *), void *replacement) {
+  if (options.replace_malloc)
+    drwrap_replace_native(addr, replacement, true /*at entry*/, 0, NULL, false);
+  else
+    drwrap_wrap(addr, pre, post);
 }
 
 /*
@@ -278,58 +828,104 @@ static void before_test_fn(void *wrapctx, OUT void **user_data) {
 static void module_load_fn(void *drcontext, const module_data_t *mod,
                            bool loaded) {
 
+  char key[SYMCACHE_KEY_SIZE];
   size_t modoffs;
   int i;
-  for (i = 0; i < num_mallocs; ++i) {
-    if (drsym_lookup_symbol(mod->full_path, my_mallocs[i], &modoffs, 0)
-        == DRSYM_SUCCESS) {
+
+  symcache_module_key(mod, key, sizeof key);
+
+  for (i = 0; i < options.malloc_names.num_names; ++i) {
+    if (symcache_lookup(mod, key, options.malloc_names.names[i], false,
+                        &modoffs)) {
       app_pc addr = mod->start + modoffs;
-      drwrap_wrap(addr, before_malloc, after_malloc);
+      wrap_or_replace(addr, before_malloc, after_malloc, replace_malloc);
     }
   }
 
-  for (i = 0; i < num_frees; ++i) {
-    if (drsym_lookup_symbol(mod->full_path, my_frees[i], &modoffs, 0)
-        == DRSYM_SUCCESS) {
+  for (i = 0; i < options.free_names.num_names; ++i) {
+    if (symcache_lookup(mod, key, options.free_names.names[i], false,
+                        &modoffs)) {
       app_pc addr = mod->start + modoffs;
-      drwrap_wrap(addr, before_free, after_free);
+      wrap_or_replace(addr, before_free, after_free, replace_free);
     }
   }
 
-  app_pc malloc_pc = (app_pc)dr_get_proc_address(mod->start, "malloc");
-  if (malloc_pc != NULL) {
-    drwrap_wrap(malloc_pc, before_malloc, after_malloc);
+  if (symcache_lookup(mod, key, "malloc", true, &modoffs)) {
+    wrap_or_replace(mod->start + modoffs, before_malloc, after_malloc,
+                    replace_malloc);
   }
 
-  app_pc calloc_pc = (app_pc)dr_get_proc_address(mod->start, "calloc");
-  if (calloc_pc != NULL) {
-    drwrap_wrap(calloc_pc, before_calloc, after_calloc);
+  if (symcache_lookup(mod, key, "calloc", true, &modoffs)) {
+    wrap_or_replace(mod->start + modoffs, before_calloc, after_calloc,
+                    replace_calloc);
   }
 
-  app_pc realloc_pc = (app_pc)dr_get_proc_address(mod->start, "realloc");
-  if (realloc_pc != NULL) {
-    drwrap_wrap(realloc_pc, before_realloc, after_realloc);
+  if (symcache_lookup(mod, key, "realloc", true, &modoffs)) {
+    wrap_or_replace(mod->start + modoffs, before_realloc, after_realloc,
+                    replace_realloc);
   }
 
-  app_pc free_pc = (app_pc)dr_get_proc_address(mod->start, "free");
-  if (free_pc != NULL) {
-    drwrap_wrap(free_pc, before_free, after_free);
+  if (symcache_lookup(mod, key, "free", true, &modoffs)) {
+    wrap_or_replace(mod->start + modoffs, before_free, after_free,
+                    replace_free);
+  }
+
+  /* only the arena can stand in for these */
+  if (!options.replace_malloc)
+    return;
+  if (symcache_lookup(mod, key, "memalign", true, &modoffs))
+    drwrap_replace_native(mod->start + modoffs, (app_pc)replace_memalign,
+                          true /*at entry*/, 0, NULL, false);
+  if (symcache_lookup(mod, key, "aligned_alloc", true, &modoffs))
+    drwrap_replace_native(mod->start + modoffs, (app_pc)replace_memalign,
+                          true /*at entry*/, 0, NULL, false);
+  if (symcache_lookup(mod, key, "posix_memalign", true, &modoffs))
+    drwrap_replace_native(mod->start + modoffs, (app_pc)replace_posix_memalign,
+                          true /*at entry*/, 0, NULL, false);
+  if (symcache_lookup(mod, key, "malloc_usable_size", true, &modoffs)) {
+    /* the first is libc's, called natively for blocks from before, and
+     * so is the free beside it */
+    if (app_usable_size == NULL) {
+      app_usable_size = (size_t (*)(void *))(mod->start + modoffs);
+      if (symcache_lookup(mod, key, "free", true, &modoffs))
+        app_free = (void (*)(void *))(mod->start + modoffs);
+    }
+    drwrap_replace_native(mod->start + modoffs, (app_pc)replace_malloc_usable_size,
+                          true /*at entry*/, 0, NULL, false);
   }
 }
 
 void malloc_init(client_id_t id) {
   drwrap_init();
-  drsym_init(0);
+  if (options.replace_malloc)
+    arena_init();
   dr_register_exit_event(exit_fn);
   dr_register_module_load_event(module_load_fn);
 
-  hashtable_init_ex(mallocd_ptrs,
-                    4, /* 16 buckets initially */
-                    HASH_INTPTR, /* keys are ptrs */
+  hashtable_init_ex(guard_pages,
+                    6, /* 64 buckets initially */
+                    HASH_INTPTR, /* keys are guard page addresses */
+                    0, /* don't duplicate string keys */
+                    1, /* synchronize: any thread allocates */
+                    NULL, /* values are real bases */
+                    NULL, /* use default key hash fn */
+                    NULL /* use default key cmp fn */
+                    );
+
+  site_lock = dr_mutex_create();
+  sites[0].post = options.redzone_min;
+  hashtable_init_ex(sites_by_pc,
+                    10, /* 1024 buckets initially */
+                    HASH_INTPTR, /* keys are call site pcs */
                     0, /* don't duplicate string keys */
-                    0, /* don't synchronize */
-                    NULL, /* no free function (TODO) */
+                    1, /* synchronize: any thread allocates */
+                    NULL, /* values are site indices */
                     NULL, /* use default key hash fn */
                     NULL /* use default key cmp fn */
                     );
+
+  tls_idx = drmgr_register_tls_field();
+  DR_ASSERT(tls_idx != -1);
+  drmgr_register_thread_init_event(thread_init_fn);
+  drmgr_register_thread_exit_event(thread_exit_fn);
 }
@@ -5,4 +5,15 @@
 
 void malloc_init(client_id_t id);
 
+/* Whether addr is in the guard page after a large heap block. */
+bool malloc_is_guard_page(app_pc addr);
+
+/* Blames a redzone hit at addr on the site that allocated the block it ran
+ * off, giving that site bigger redzones from then on. */
+void malloc_note_overflow(app_pc addr);
+
+/* Post-redzone bytes of live blocks, and sites whose redzones have grown. */
+uint64 malloc_redzone_bytes(void);
+uint64 malloc_grown_sites(void);
+
 #endif // INST_MALLOC_H
@@ -1,35 +1,204 @@
 #include "inst_readwrite.h"
 
+#include <drmgr.h>
 #include <hashtable.h>
 #include <dr_ir_macros.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
 
+#include "access_desc.h"
+#include "adaptive.h"
 #include "defines.h"
+#include "eventlog.h"
+#include "inst_malloc.h"
+#include "options.h"
+#include "retstack.h"
+#include "scope.h"
+#include "shadow.h"
 #include "shady_util.h"
+#include "stats.h"
+#include "trigger.h"
 
 #define MAX_TRACE_ERRORS 1
 
 static void event_exit();
 static dr_emit_flags_t event_basic_block(void *drcontext, void* tag, instrlist_t *bb, bool for_trace, bool translating);
 
-static void instrument_read(void * drcontext, instrlist_t * bb, instr_t * orig);
-static void instrument_write(void * drcontext, instrlist_t * bb, instr_t * orig);
+/* One memory operand of a block that needs a check. */
+typedef struct {
+    instr_t *instr;
+    uint index;         // src or dst slot of the operand
+    bool write;
+    int group;          // index into the block's groups, or -1
+} access_t;
 
-static void read_callback(app_pc addr, uint i);
-static void write_callback(app_pc addr, uint i);
+/* Accesses [base + disp] off the same, unmodified base register.  A group
+ * of two or more is covered by one check of [base + lo, base + hi). */
+typedef struct {
+    instr_t *leader;    // first instruction of the group
+    app_pc last_pc;     // pc of the last member
+    reg_id_t base;
+    int lo, hi;
+    int members;
+} check_group_t;
 
-static uint read_count = 0;
-static uint write_count = 0;
+/* What simd_kind() says of an access, and the widest it handles: a zmm
+ * register. */
+#define SIMD_NONE 0
+#define SIMD_MOVE 1         // SSE move: the rest of the register is kept
+#define SIMD_MOVE_VEX 2     // VEX or EVEX move: a load zeroes the rest
+#define SIMD_OP 3           // SSE load-op: dst = dst op memory
+#define SIMD_OP_VEX 4       // VEX load-op: dst = src op memory, rest zeroed
+#define MAX_SIMD_SIZE 64
 
-static void skip_instruction(void* drcontext, dr_mcontext_t* mc, app_pc addr);
-static void skip_read(void* drcontext, dr_mcontext_t* mc, app_pc addr, instr_t* instr);
-static void skip_write(void* drcontext, dr_mcontext_t* mc, app_pc addr, instr_t* instr);
-static bool try_read(app_pc ptr, int* val);
+/* Largest span a coalesced check may cover. */
+#define MAX_GROUP_SPAN 64
+/* Base registers tracked at once. */
+#define MAX_OPEN_GROUPS 16
+
+/* access_t.group of an access an earlier block of the trace already
+ * checked. */
+#define DOMINATED -2
+
+/* [base + lo, base + hi), checked at pc and valid until base is written. */
+typedef struct {
+    reg_id_t base;
+    int lo, hi;
+    app_pc pc;
+} covered_range_t;
+
+/* While a trace is built its blocks come through event_basic_block one
+ * after the other.  What the blocks so far left checked is handed on to
+ * the next one, if DR extends the trace with it. */
+#define MAX_COVERED 16
+typedef struct {
+    void *next_tag;
+    covered_range_t covered[MAX_COVERED];
+    int num_covered;
+} trace_state_t;
+
+/* access_t.group of a strided access in a loop, checked through a slot
+ * (-hoist_loops). */
+#define HOISTED -3
+
+/* How far ahead a hoisted check looks, and the largest step it follows. */
+#define LOOP_WINDOW 4096
+#define MAX_LOOP_STRIDE 64
+#define MAX_LOOP_SLOTS 1024
+
+/* What a hoisted check last found addressable, per thread: an access
+ * starting in [lo, last] needs no check while the shadow generation is
+ * unchanged. */
+typedef struct {
+    ptr_uint_t lo;
+    ptr_uint_t last;
+    uint generation;
+} loop_slot_t;
+
+static int collect_accesses(instr_t * instr, access_t * accesses, int n, bool writes_only, bool for_trace);
+static void group_accesses(instrlist_t * bb, access_t * accesses, int num_accesses, check_group_t * groups, int * num_groups);
+static bool needs_check(opnd_t o, bool for_trace);
+static bool access_range(access_t * a, reg_id_t * base, int * lo, int * hi);
+
+static int take_covered(void * drcontext, void * tag, covered_range_t * covered);
+static void elide_dominated(instrlist_t * bb, access_t * accesses, int num_accesses, covered_range_t * covered, int * num_covered);
+static void pass_covered(void * drcontext, instrlist_t * bb, access_t * accesses, int num_accesses, covered_range_t * covered, int num_covered);
+static bool drop_dominator(app_pc pc);
+
+static void find_strided(instrlist_t * bb, app_pc block, access_t * accesses, int num_accesses);
+static int induction_step(instrlist_t * bb, reg_id_t reg);
+static int count_writes(instrlist_t * bb, reg_id_t reg, instr_t ** writer);
+static bool instrument_hoisted(void * drcontext, instrlist_t * bb, app_pc block, access_t * a);
+static void loop_callback(app_pc pc, uint desc_ref, uint slot);
+static dr_custom_trace_action_t event_end_trace(void *drcontext, void *trace_tag, void *next_tag);
+static dr_emit_flags_t event_trace(void *drcontext, void *tag, instrlist_t *trace, bool translating);
+static void event_thread_init(void *drcontext);
+static void event_thread_exit(void *drcontext);
+
+static void instrument_access(void * drcontext, instrlist_t * bb, app_pc block, instr_t * orig, bool write, uint i);
+static bool insert_check(void * drcontext, instrlist_t * bb, instr_t * where, opnd_t o, uint size, void * callback, uint num_args, opnd_t arg1, opnd_t arg2);
+static void insert_shadow_test(void * drcontext, instrlist_t * bb, instr_t * where, reg_id_t addr, reg_id_t shadow, reg_id_t tmp, uint size, instr_t * ok, instr_t * hit);
+static void insert_partial_test(void * drcontext, instrlist_t * bb, instr_t * where, reg_id_t addr, reg_id_t shadow, reg_id_t tmp, uint n, instr_t * hit);
+static bool pick_scratch_regs(instr_t * instr, reg_id_t * regs, int n);
+static uint opnd_access_size(opnd_t o);
+static void insert_compute_address(void * drcontext, instrlist_t * bb, instr_t * where, opnd_t o, reg_id_t reg);
+
+static void read_callback(app_pc pc, uint desc_ref);
+static void write_callback(app_pc pc, uint desc_ref);
+static void string_callback(app_pc pc, uint desc_ref);
+static void group_callback(app_pc first, app_pc last);
+
+/* Static counts of memory operands seen while building blocks, by class.
+ * Only OPND_CLASS_UNKNOWN operands get a check; trace rebuilds aren't
+ * counted again. */
+static int opnd_class_count[NUM_OPND_CLASSES];
+/* Checks folded into a coalesced group check, counted the same way. */
+static int coalesced_count;
+/* Checks left out of traces because an earlier block checked the same. */
+static int dominated_count;
+/* Accesses checked through a loop slot. */
+static int hoisted_count;
+
+static void get_full_mcontext(void* drcontext, dr_mcontext_t* mc);
+static void skip_instruction(void* drcontext, dr_mcontext_t* mc, access_desc_t* desc);
+static void skip_read(void* drcontext, dr_mcontext_t* mc, access_desc_t* desc, app_pc addr);
+static bool read_is_skippable(access_desc_t* desc);
+static void skip_write(void* drcontext, dr_mcontext_t* mc, access_desc_t* desc, app_pc addr);
+static int simd_kind(access_desc_t* desc);
+static void simd_op(int opcode, byte* a, const byte* b, uint size);
+static void load_simd_lanes(dr_mcontext_t* mc, access_desc_t* desc, app_pc addr);
+static void store_simd_lanes(dr_mcontext_t* mc, access_desc_t* desc, app_pc addr);
 static bool instr_is_str_op(instr_t* instr);
+static bool str_op_is_rep(int opcode);
+
+static bool instrument_string(void * drcontext, instrlist_t * bb, app_pc block, instr_t * instr, bool writes_only);
+static void insert_string_range_test(void * drcontext, instrlist_t * bb, instr_t * where, reg_id_t base, uint size, bool rep, reg_id_t * regs, instr_t * hit);
+static ptr_uint_t string_good_iterations(dr_mcontext_t * mc, access_desc_t * desc, ptr_uint_t count);
+static void emulate_string_store(void * drcontext, dr_mcontext_t * mc, access_desc_t * desc, ptr_uint_t count);
+static bool string_iteration(dr_mcontext_t * mc, access_desc_t * desc);
+static bool string_element(app_pc addr, uint size, ptr_uint_t * v);
+static void set_compare_flags(dr_mcontext_t * mc, ptr_uint_t a, ptr_uint_t b, uint size);
+
+static dr_signal_action_t event_signal(void *drcontext, dr_siginfo_t *info);
+static int guard_page_operand(instr_t * instr, dr_mcontext_t * mc, app_pc page, bool * write);
+
+/* Registers the inline check may borrow.  xax is not listed because
+ * dr_save_arith_flags() keeps the application flags in it. */
+static const reg_id_t scratch_regs[] = {
+    DR_REG_XBX, DR_REG_XCX, DR_REG_XDX, DR_REG_XSI, DR_REG_XDI,
+#ifdef X86_64
+    DR_REG_R8, DR_REG_R9, DR_REG_R10, DR_REG_R11,
+    DR_REG_R12, DR_REG_R13, DR_REG_R14, DR_REG_R15,
+#endif
+};
+static const int num_scratch_regs = sizeof scratch_regs / sizeof scratch_regs[0];
+
+#define NUM_SCRATCH 3
+#define FLAGS_SLOT SPILL_SLOT_1
+static const dr_spill_slot_t scratch_slots[NUM_SCRATCH] = {
+    SPILL_SLOT_2, SPILL_SLOT_3, SPILL_SLOT_4 };
+
+/* What every block is emitted with; -persist adds DR_EMIT_PERSISTABLE. */
+static dr_emit_flags_t emit_flags = DR_EMIT_STORE_TRANSLATIONS;
 
 /* Hash table stuff. */
 static int get_read_value(app_pc addr);
 
 static hashtable_t read_return_values[1];
+
+/* Instructions whose group check hit a redzone.  They are checked one
+ * access at a time from then on. */
+static hashtable_t precise_pcs[1];
+/* Checks that some later check in a trace was dropped in favour of. */
+static hashtable_t dominators[1];
+
+static int trace_tls_idx;
+
+/* Descriptor index + 1 -> slot + 1 of each hoisted access. */
+static hashtable_t loop_slots[1];
+static volatile int num_loop_slots;
+static int loop_tls_idx;
 /* ----------------- */
 
 void
@@ -37,180 +206,1768 @@ readwrite_init(client_id_t id)
 {
     dr_register_exit_event(event_exit);
     dr_register_bb_event(event_basic_block);
+    dr_register_end_trace_event(event_end_trace);
+    dr_register_trace_event(event_trace);
+    drmgr_register_signal_event(event_signal);
+
+    trace_tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(trace_tls_idx != -1);
+    drmgr_register_thread_init_event(event_thread_init);
+    drmgr_register_thread_exit_event(event_thread_exit);
+
+    if (options.hoist_loops) {
+        loop_tls_idx = drmgr_register_tls_field();
+        DR_ASSERT(loop_tls_idx != -1);
+        hashtable_init_ex(loop_slots,
+                8, /* 256 buckets initially */
+                HASH_INTPTR, /* keys are descriptor indices */
+                0, /* don't duplicate string keys */
+                1, /* synchronize: blocks are built by any thread */
+                NULL, /* values are slot indices */
+                NULL, /* use default key hash fn */
+                NULL /* use default key cmp fn */
+                );
+    }
+
+    access_desc_init();
+    if (options.persist)
+        emit_flags |= DR_EMIT_PERSISTABLE;
 
     hashtable_init_ex(read_return_values,
             4, /* 16 buckets initially */
             HASH_INTPTR, /* keys are ptrs */
             0, /* don't duplicate string keys */
-            0, /* don't synchronize */
+            1, /* synchronize: any thread may skip a read */
             NULL, /* no free function (TODO) */
             NULL, /* use default key hash fn */
             NULL /* use default key cmp fn */
             );
+
+    hashtable_init_ex(precise_pcs,
+            6, /* 64 buckets initially */
+            HASH_INTPTR, /* keys are app pcs */
+            0, /* don't duplicate string keys */
+            1, /* synchronize: filled from any thread's clean call */
+            NULL, /* values are just flags */
+            NULL, /* use default key hash fn */
+            NULL /* use default key cmp fn */
+            );
+
+    hashtable_init_ex(dominators,
+            6, /* 64 buckets initially */
+            HASH_INTPTR, /* keys are app pcs */
+            0, /* don't duplicate string keys */
+            1, /* synchronize: traces are built by any thread */
+            NULL, /* values are just flags */
+            NULL, /* use default key hash fn */
+            NULL /* use default key cmp fn */
+            );
 }
 
 static void
 event_exit()
 {
-    DEBUG("Reads: %u, Writes: %u\n", read_count, write_count);
+    DEBUG("Checks inserted: %d, elided: %d stack, %d static, %d tls\n",
+            opnd_class_count[OPND_CLASS_UNKNOWN],
+            opnd_class_count[OPND_CLASS_STACK],
+            opnd_class_count[OPND_CLASS_STATIC],
+            opnd_class_count[OPND_CLASS_TLS]);
+    DEBUG("Checks coalesced: %d, dominated in traces: %d, hoisted: %d\n",
+            coalesced_count, dominated_count, hoisted_count);
+
+    if (options.hoist_loops) {
+        hashtable_delete(loop_slots);
+        drmgr_unregister_tls_field(loop_tls_idx);
+    }
+
+    hashtable_delete(dominators);
+    hashtable_delete(precise_pcs);
+    hashtable_delete(read_return_values);
+    access_desc_exit();
+    drmgr_unregister_tls_field(trace_tls_idx);
+}
+
+static void
+event_thread_init(void *drcontext)
+{
+    trace_state_t *ts = dr_thread_alloc(drcontext, sizeof(trace_state_t));
+    ts->next_tag = NULL;
+    ts->num_covered = 0;
+    drmgr_set_tls_field(drcontext, trace_tls_idx, ts);
+
+    if (options.hoist_loops) {
+        // Generation 0 never matches, so every slot starts out empty.
+        loop_slot_t *slots = dr_thread_alloc(drcontext,
+                MAX_LOOP_SLOTS * sizeof(loop_slot_t));
+        memset(slots, 0, MAX_LOOP_SLOTS * sizeof(loop_slot_t));
+        drmgr_set_tls_field(drcontext, loop_tls_idx, slots);
+    }
+}
+
+static void
+event_thread_exit(void *drcontext)
+{
+    trace_state_t *ts = drmgr_get_tls_field(drcontext, trace_tls_idx);
+    dr_thread_free(drcontext, ts, sizeof(trace_state_t));
+
+    if (options.hoist_loops) {
+        dr_thread_free(drcontext, drmgr_get_tls_field(drcontext, loop_tls_idx),
+                MAX_LOOP_SLOTS * sizeof(loop_slot_t));
+    }
 }
 
 static dr_emit_flags_t
 event_basic_block(void *drcontext, void *tag,
         instrlist_t *bb, bool for_trace, bool translating)
 {
-    instr_t *instr, *next_instr;
+    instr_t *instr;
+    access_t *accesses;
+    check_group_t *groups;
+    int max_accesses = 0;
+    int num_accesses = 0;
+    int num_groups = 0;
+    int num_checks = 0;
+    int i;
+    check_tier_t tier;
+    app_pc block = (app_pc)tag;
+    covered_range_t covered[MAX_COVERED];
+    int num_covered = 0;
 
     //DEBUG("Instrumenting block %p.\n", tag);
 
-    /* count the number of instructions in this block */
-    for (instr = instrlist_first(bb); instr != NULL; instr = next_instr) {
-        next_instr = instr_get_next(instr);
+    // Nothing is handed on from a block that returns early.
+    if (for_trace)
+        num_covered = take_covered(drcontext, tag, covered);
+
+    // Returns are watched in all code, so calls and rets stay paired.
+    if (options.shadow_stack)
+        retstack_instrument(drcontext, bb);
 
-        if (instr_reads_memory(instr)) {
-            instrument_read(drcontext, bb, instr);
+    // Sampled blocks are watched by their guard pages alone.
+    if (options.sample > 0)
+        return emit_flags;
+
+    // Until checking starts, blocks only watch for what starts it.
+    if (! trigger_checking()) {
+        trigger_instrument(drcontext, bb);
+        return emit_flags;
+    }
+
+    // Trusted code runs as is.
+    if (! scope_should_check(block))
+        return emit_flags;
+
+    tier = adaptive_block_tier(tag, bb);
+    if (tier == TIER_NONE)
+        return emit_flags;
+
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr))
+        max_accesses += instr_num_srcs(instr) + instr_num_dsts(instr);
+    if (max_accesses == 0)
+        return emit_flags;
+
+    accesses = dr_thread_alloc(drcontext, max_accesses * sizeof(access_t));
+    groups = dr_thread_alloc(drcontext, max_accesses * sizeof(check_group_t));
+
+    /* Analysis: find the operands that need a check. */
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        if (instr_ok_to_mangle(instr)
+                && (instr_reads_memory(instr) || instr_writes_memory(instr))) {
+            num_accesses += collect_accesses(instr, accesses + num_accesses,
+                    max_accesses - num_accesses, tier == TIER_WRITES,
+                    for_trace);
         }
-        if (instr_writes_memory(instr)) {
-            instrument_write(drcontext, bb, instr);
+    }
+    if (for_trace)
+        elide_dominated(bb, accesses, num_accesses, covered, &num_covered);
+    if (options.hoist_loops)
+        find_strided(bb, block, accesses, num_accesses);
+    group_accesses(bb, accesses, num_accesses, groups, &num_groups);
+    if (for_trace)
+        pass_covered(drcontext, bb, accesses, num_accesses, covered, num_covered);
+
+    /* One check per group that coalesced... */
+    for (i = 0; i < num_groups; i++) {
+        check_group_t *g = &groups[i];
+        if (g->members < 2)
+            continue;
+        if (! insert_check(drcontext, bb, g->leader,
+                    opnd_create_base_disp(g->base, DR_REG_NULL, 0, g->lo, OPSZ_lea),
+                    g->hi - g->lo, (void *)group_callback, 2,
+                    OPND_CREATE_INTPTR(instr_get_app_pc(g->leader)),
+                    OPND_CREATE_INTPTR(g->last_pc))) {
+            g->members = 1; // no registers to spare; check them one by one
+            continue;
+        }
+        num_checks++;
+        if (! for_trace)
+            dr_atomic_add32_return_sum(&coalesced_count, g->members - 1);
+    }
+
+    /* ...and one per access that isn't covered by one. */
+    for (i = 0; i < num_accesses; i++) {
+        access_t *a = &accesses[i];
+        if (a->group == DOMINATED
+                || (a->group >= 0 && groups[a->group].members >= 2))
+            continue;
+        if (a->group == HOISTED && instrument_hoisted(drcontext, bb, block, a)) {
+            num_checks++;
+            if (! for_trace)
+                dr_atomic_add32_return_sum(&hoisted_count, 1);
+            continue;
         }
+        instrument_access(drcontext, bb, block, a->instr, a->write, a->index);
+        num_checks++;
     }
 
-    return DR_EMIT_STORE_TRANSLATIONS;
+    /* String instructions get one check of their whole range. */
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        if (instr_ok_to_mangle(instr) && instr_is_str_op(instr)
+                && instrument_string(drcontext, bb, block, instr,
+                    tier == TIER_WRITES))
+            num_checks++;
+    }
+
+    /* Blocks with checks count their clean runs under -adaptive, and their
+     * checks for the stats. */
+    if (num_checks > 0)
+        adaptive_insert_counter(drcontext, tag, bb, num_checks);
+
+    dr_thread_free(drcontext, groups, max_accesses * sizeof(check_group_t));
+    dr_thread_free(drcontext, accesses, max_accesses * sizeof(access_t));
+
+    return emit_flags;
+}
+
+/* Records the operands of instr that need a check, or only the ones it
+ * writes if writes_only. */
+static int
+collect_accesses(instr_t * instr, access_t * accesses, int n, bool writes_only,
+        bool for_trace)
+{
+    int count = 0;
+    uint i;
+    opnd_t o;
+
+    // String instructions are checked as a whole by instrument_string().
+    if (instr_is_str_op(instr))
+        return 0;
+
+    for (i = 0; ! writes_only && i < instr_num_srcs(instr) && count < n; i++) {
+        o = instr_get_src(instr, i);
+        if (opnd_is_memory_reference(o) && needs_check(o, for_trace)) {
+            access_t a = { instr, i, false, -1 };
+            accesses[count++] = a;
+        }
+    }
+    for (i = 0; i < instr_num_dsts(instr) && count < n; i++) {
+        o = instr_get_dst(instr, i);
+        if (opnd_is_memory_reference(o) && needs_check(o, for_trace)) {
+            access_t a = { instr, i, true, -1 };
+            accesses[count++] = a;
+        }
+    }
+    return count;
 }
 
+/* Groups [reg + disp] accesses that share a base register with no write to
+ * it in between.  A group closes when its base is written (after the
+ * instruction's own accesses, which still see the old value) or when it
+ * would grow past MAX_GROUP_SPAN. */
+static void
+group_accesses(instrlist_t * bb, access_t * accesses, int num_accesses,
+        check_group_t * groups, int * num_groups)
+{
+    int open[MAX_OPEN_GROUPS]; // indices of groups still accepting members
+    int num_open = 0;
+    int next = 0;
+    int j;
+    instr_t *instr;
+
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        bool precise = hashtable_lookup(precise_pcs, instr_get_app_pc(instr)) != NULL;
+
+        for (; next < num_accesses && accesses[next].instr == instr; next++) {
+            access_t *a = &accesses[next];
+            reg_id_t base;
+            int lo, hi;
+            check_group_t *g = NULL;
 
+            // Dominated and hoisted accesses are taken care of.
+            if (precise || a->group != -1 || ! access_range(a, &base, &lo, &hi))
+                continue;
+
+            for (j = 0; j < num_open; j++) {
+                if (groups[open[j]].base == base)
+                    break;
+            }
+            if (j < num_open) {
+                g = &groups[open[j]];
+                if ((hi > g->hi ? hi : g->hi) - (lo < g->lo ? lo : g->lo)
+                        > MAX_GROUP_SPAN) {
+                    // Too wide: start over from this access.
+                    open[j] = open[--num_open];
+                    g = NULL;
+                }
+            }
+            if (g == NULL) {
+                if (num_open == sizeof open / sizeof open[0])
+                    continue;
+                g = &groups[*num_groups];
+                g->leader = instr;
+                g->base = base;
+                g->lo = lo;
+                g->hi = hi;
+                g->members = 0;
+                open[num_open++] = (*num_groups)++;
+            }
+            if (lo < g->lo)
+                g->lo = lo;
+            if (hi > g->hi)
+                g->hi = hi;
+            g->last_pc = instr_get_app_pc(instr);
+            g->members++;
+            a->group = g - groups;
+        }
+
+        for (j = 0; j < num_open; j++) {
+            if (instr_writes_to_reg(instr, groups[open[j]].base)) {
+                open[j] = open[--num_open];
+                j--;
+            }
+        }
+    }
+}
+
+/* The inline check only gets here when the shadow is non-zero.  Everything
+ * about the operand was recorded when the block was built, so the address is
+ * recomputed from the registers without decoding the instruction again. */
 static void
-read_callback(app_pc addr, uint i)
+read_callback(app_pc pc, uint desc_ref)
 {
-    instr_t instr;
+    access_desc_t *desc = access_desc_deref(pc, desc_ref);
 
-    TRACE("Read callback at %p.\n", addr);
+    TRACE("Read callback at %p.\n", desc->pc);
 
     // Get the drcontext
     void* drcontext = dr_get_current_drcontext();
 
-    // Load the memory context.
+    // The integer registers are enough to compute the address.
     dr_mcontext_t mc;
     mc.size = sizeof(mc);
-    mc.flags = DR_MC_ALL;
+    mc.flags = DR_MC_INTEGER | DR_MC_CONTROL;
     dr_get_mcontext(drcontext, &mc);
 
-    // Get the instruction
-    instr_init(drcontext, &instr);
-    decode(drcontext, addr, &instr);
+    app_pc accessed_mem = access_desc_address(desc, &mc);
+    thread_stats_t *stats = stats_thread(drcontext);
+
+    stats->slow_path++;
+    if (! shadow_is_addressable(accessed_mem, desc->size)) {
+        // Increment the counter
+        DEBUG("Read of redzone at %p (pc = %p, sp = %p, bp = %p)\n", accessed_mem, desc->pc, mc.xsp, mc.xbp);
+        stats->manufactured_reads++;
+        adaptive_note_hit(desc->block);
+        malloc_note_overflow(shadow_first_unaddressable(accessed_mem, desc->size));
+        if (drop_dominator(desc->pc) && ! read_is_skippable(desc)) {
+            // Nothing to skip, but the rest of the trace mustn't run.
+            get_full_mcontext(drcontext, &mc);
+            mc.pc = desc->pc;
+            dr_redirect_execution(&mc);
+        }
+        skip_read(drcontext, &mc, desc, accessed_mem);
+    }
 
-    // Get word-aligned address.
-    app_pc accessed_mem = align_ptr(opnd_compute_address(instr_get_src(&instr, i), &mc));
+    TRACE("Read callback complete for %p.\n", desc->pc);
+}
 
-    int accessed_val;
+static void
+write_callback(app_pc pc, uint desc_ref)
+{
+    access_desc_t *desc = access_desc_deref(pc, desc_ref);
 
-    if (! try_read(accessed_mem, &accessed_val)) {
-        DEBUG("Read of unaccessable value at %p (pc = %p, sp = %p, bp = %p)\n", accessed_mem, addr, mc.xsp, mc.xbp);
-        read_count++;
-        skip_read(drcontext, &mc, addr, &instr);
-    } else 
-    if (accessed_val == SENTINEL) {
-        // Increment the counter
-        DEBUG("Read of sentinel at %p (pc = %p, sp = %p, bp = %p)\n", accessed_mem, addr, mc.xsp, mc.xbp);
-        read_count++;
-        skip_read(drcontext, &mc, addr, &instr);
+    TRACE("Write callback at %p.\n", desc->pc);
+
+    // Get the drcontext
+    void* drcontext = dr_get_current_drcontext();
+
+    // The integer registers are enough to compute the address.
+    dr_mcontext_t mc;
+    mc.size = sizeof(mc);
+    mc.flags = DR_MC_INTEGER | DR_MC_CONTROL;
+    dr_get_mcontext(drcontext, &mc);
+
+    app_pc accessed_mem = access_desc_address(desc, &mc);
+    thread_stats_t *stats = stats_thread(drcontext);
+
+    stats->slow_path++;
+    if (! shadow_is_addressable(accessed_mem, desc->size)) {
+        // Increment the counter.
+        DEBUG("Write of redzone at %p (pc = %p, sp = %p, bp = %p)\n", accessed_mem, desc->pc, mc.xsp, mc.xbp);
+        stats->skipped_writes++;
+        adaptive_note_hit(desc->block);
+        malloc_note_overflow(shadow_first_unaddressable(accessed_mem, desc->size));
+        drop_dominator(desc->pc);
+        eventlog_record(drcontext, EVENT_SKIPPED_WRITE, desc->pc, accessed_mem, 0,
+                desc->size);
+        skip_write(drcontext, &mc, desc, accessed_mem);
     }
 
-    TRACE("Read callback complete for %p.\n", addr);
+    TRACE("Write callback complete for %p.\n", desc->pc);
+}
+
+/* Longest rep range tested inline; longer ones are left to the callback,
+ * which scans the shadow in C. */
+#define MAX_INLINE_STRING 512
+
+/* Inserts a check of everything a string instruction will touch, made
+ * once per execution rather than once per iteration.  A rep instruction
+ * with a zero count touches nothing and is let through without a call.
+ * The ranges at xsi and xdi are tested inline, and only one that isn't all
+ * addressable, or that the inline test can't handle, calls out.
+ *
+ *      jecxz   zero                            (rep only)
+ *      jmp     check
+ *  zero:
+ *      jmp     done
+ *  check:
+ *      spill   addr, shadow, tmp
+ *      save    aflags
+ *      <test the range at xsi, jumping to hit if it fails>
+ *      <test the range at xdi, jumping to hit if it fails>
+ *      restore aflags, tmp, shadow, addr
+ *      jmp     done
+ *  hit:
+ *      restore aflags, tmp, shadow, addr
+ *      clean call string_callback(pc, desc)
+ *  done:
+ *      <instr>
+ */
+static bool
+instrument_string(void * drcontext, instrlist_t * bb, app_pc block,
+        instr_t * instr, bool writes_only)
+{
+    int opcode = instr_get_opcode(instr);
+    bool write = opcode == OP_movs || opcode == OP_rep_movs
+        || opcode == OP_stos || opcode == OP_rep_stos;
+    bool uses_si = opcode != OP_stos && opcode != OP_rep_stos
+        && opcode != OP_scas && opcode != OP_rep_scas && opcode != OP_repne_scas;
+    bool uses_di = opcode != OP_lods && opcode != OP_rep_lods;
+    bool rep = str_op_is_rep(opcode);
+    uint n = write ? instr_num_dsts(instr) : instr_num_srcs(instr);
+    reg_id_t regs[NUM_SCRATCH];
+    uint i, size = 0;
+    int r;
+
+    // Port I/O is left alone.
+    if (opcode == OP_ins || opcode == OP_rep_ins
+            || opcode == OP_outs || opcode == OP_rep_outs)
+        return false;
+    if (writes_only && ! write)
+        return false;
+
+    // The descriptor is keyed on the first memory operand.
+    for (i = 0; i < n; i++) {
+        opnd_t o = write ? instr_get_dst(instr, i) : instr_get_src(instr, i);
+        if (opnd_is_memory_reference(o)) {
+            size = opnd_access_size(o);
+            break;
+        }
+    }
+    if (i == n)
+        return false;
+    opnd_t pc = OPND_CREATE_INTPTR(instr_get_app_pc(instr));
+    opnd_t desc = OPND_CREATE_INT32(access_desc_ref(drcontext, block,
+                instr, write, i));
+
+    instr_t *done = INSTR_CREATE_label(drcontext);
+    if (rep) {
+        // jecxz only reaches 127 bytes, so it hops over a near jmp.
+        instr_t *zero = INSTR_CREATE_label(drcontext);
+        instr_t *check = INSTR_CREATE_label(drcontext);
+        instrlist_meta_preinsert(bb, instr, INSTR_CREATE_jecxz(drcontext,
+                    opnd_create_instr(zero)));
+        instrlist_meta_preinsert(bb, instr, INSTR_CREATE_jmp(drcontext,
+                    opnd_create_instr(check)));
+        instrlist_meta_preinsert(bb, instr, zero);
+        instrlist_meta_preinsert(bb, instr, INSTR_CREATE_jmp(drcontext,
+                    opnd_create_instr(done)));
+        instrlist_meta_preinsert(bb, instr, check);
+    }
+
+    // Without registers to borrow, every execution calls out.
+    if (pick_scratch_regs(instr, regs, NUM_SCRATCH)) {
+        instr_t *hit = INSTR_CREATE_label(drcontext);
+
+        for (r = 0; r < NUM_SCRATCH; r++)
+            dr_save_reg(drcontext, bb, instr, regs[r], scratch_slots[r]);
+        dr_save_arith_flags(drcontext, bb, instr, FLAGS_SLOT);
+        if (uses_si)
+            insert_string_range_test(drcontext, bb, instr, DR_REG_XSI, size,
+                    rep, regs, hit);
+        if (uses_di)
+            insert_string_range_test(drcontext, bb, instr, DR_REG_XDI, size,
+                    rep, regs, hit);
+        dr_restore_arith_flags(drcontext, bb, instr, FLAGS_SLOT);
+        for (r = NUM_SCRATCH - 1; r >= 0; r--)
+            dr_restore_reg(drcontext, bb, instr, regs[r], scratch_slots[r]);
+        instrlist_meta_preinsert(bb, instr, INSTR_CREATE_jmp(drcontext,
+                    opnd_create_instr(done)));
+
+        instrlist_meta_preinsert(bb, instr, hit);
+        dr_restore_arith_flags(drcontext, bb, instr, FLAGS_SLOT);
+        for (r = NUM_SCRATCH - 1; r >= 0; r--)
+            dr_restore_reg(drcontext, bb, instr, regs[r], scratch_slots[r]);
+    }
+    dr_insert_clean_call(drcontext, bb, instr, (void *)string_callback,
+            false /*no fp save*/, 2, pc, desc);
+    instrlist_meta_preinsert(bb, instr, done);
+    return true;
 }
 
+/* Emits the test that every iteration of a string instruction through
+ * base lands on addressable memory, branching to hit if not or if it can't
+ * tell.  A single iteration is tested like any other access.  A rep range
+ * is only tested going forwards, up to MAX_INLINE_STRING bytes and inside
+ * one chunk, by comparing its shadow bytes against zero from the last one
+ * back, a word at a time while it can.  Clobbers regs and the flags.
+ *
+ *      lea     xsp, [xsp - 128]                (64-bit: skip the red zone)
+ *      pushf
+ *      pop     tmp
+ *      lea     xsp, [xsp + 128]
+ *      test    tmp, EFLAGS_DF
+ *      jnz     hit
+ *      cmp     xcx, MAX_INLINE_STRING / size
+ *      ja      hit
+ *      mov     addr, base
+ *      <shadow = address of the shadow byte of addr>
+ *      lea     tmp, [addr + xcx * size - 1]
+ *      xor     addr, tmp
+ *      test    addr, ~CHUNK_MASK
+ *      jnz     hit
+ *      xor     addr, tmp
+ *      shr     tmp, SHADOW_SCALE
+ *      shr     addr, SHADOW_SCALE
+ *      sub     tmp, addr                       (index of the last shadow byte)
+ *      cmp     tmp, ptr - 1
+ *      jbe     bytes
+ *  words:
+ *      cmp     ptr [shadow + tmp - (ptr - 1)], 0
+ *      jnz     hit
+ *      sub     tmp, ptr
+ *      cmp     tmp, ptr - 1
+ *      ja      words
+ *  bytes:
+ *      cmp     byte [shadow + tmp], 0
+ *      jnz     hit
+ *      sub     tmp, 1
+ *      jae     bytes
+ */
 static void
-write_callback(app_pc addr, uint i)
+insert_string_range_test(void * drcontext, instrlist_t * bb, instr_t * where,
+        reg_id_t base, uint size, bool rep, reg_id_t * regs, instr_t * hit)
 {
+    reg_id_t addr = regs[0], shadow = regs[1], tmp = regs[2];
+    const int word = sizeof(ptr_uint_t);
+    instr_t *next, *words, *bytes;
 
-    instr_t instr;
+    if (! rep) {
+        next = INSTR_CREATE_label(drcontext);
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                    opnd_create_reg(addr), opnd_create_reg(base)));
+        insert_shadow_test(drcontext, bb, where, addr, shadow, tmp, size,
+                next, hit);
+        instrlist_meta_preinsert(bb, where, next);
+        return;
+    }
 
-    TRACE("Write callback at %p.\n", addr);
+    words = INSTR_CREATE_label(drcontext);
+    bytes = INSTR_CREATE_label(drcontext);
+
+#ifdef X86_64
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext,
+                opnd_create_reg(DR_REG_XSP),
+                opnd_create_base_disp(DR_REG_XSP, DR_REG_NULL, 0, -128, OPSZ_lea)));
+#endif
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_pushf(drcontext));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_pop(drcontext,
+                opnd_create_reg(tmp)));
+#ifdef X86_64
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext,
+                opnd_create_reg(DR_REG_XSP),
+                opnd_create_base_disp(DR_REG_XSP, DR_REG_NULL, 0, 128, OPSZ_lea)));
+#endif
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_test(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT32(EFLAGS_DF)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jnz,
+                opnd_create_instr(hit)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(DR_REG_XCX),
+                OPND_CREATE_INT32(MAX_INLINE_STRING / size)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_ja,
+                opnd_create_instr(hit)));
+
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(addr), opnd_create_reg(base)));
+    shadow_insert_lea(drcontext, bb, where, addr, shadow, tmp);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext,
+                opnd_create_reg(tmp),
+                opnd_create_base_disp(addr, DR_REG_XCX, size, -1, OPSZ_lea)));
+
+    // The shadow of the range is only contiguous inside one chunk.
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_xor(drcontext,
+                opnd_create_reg(addr), opnd_create_reg(tmp)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_test(drcontext,
+                opnd_create_reg(addr), OPND_CREATE_INT32((int)~CHUNK_MASK)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jnz,
+                opnd_create_instr(hit)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_xor(drcontext,
+                opnd_create_reg(addr), opnd_create_reg(tmp)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_shr(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(SHADOW_SCALE)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_shr(drcontext,
+                opnd_create_reg(addr), OPND_CREATE_INT8(SHADOW_SCALE)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_sub(drcontext,
+                opnd_create_reg(tmp), opnd_create_reg(addr)));
+
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(word - 1)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jbe,
+                opnd_create_instr(bytes)));
+    instrlist_meta_preinsert(bb, where, words);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_base_disp(shadow, tmp, 1, -(word - 1), OPSZ_PTR),
+                OPND_CREATE_INT32(0)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jnz,
+                opnd_create_instr(hit)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_sub(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(word)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(word - 1)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_ja,
+                opnd_create_instr(words)));
+    instrlist_meta_preinsert(bb, where, bytes);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_base_disp(shadow, tmp, 1, 0, OPSZ_1),
+                OPND_CREATE_INT8(0)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jnz,
+                opnd_create_instr(hit)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_sub(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(1)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jae,
+                opnd_create_instr(bytes)));
+}
+
+/* Checks the range a string instruction is about to touch.  When part of
+ * it is unaddressable, movs and stos are carried out here element by
+ * element, skipping bad writes and reading zeroes for bad reads.  For the
+ * others the iterations that are safe and then the first bad one are
+ * carried out here, the bad one with a made-up value, and the instruction
+ * is restarted with whatever count is left. */
+static void
+string_callback(app_pc pc, uint desc_ref)
+{
+    access_desc_t *desc = access_desc_deref(pc, desc_ref);
+    int op = desc->opcode;
+    bool rep = str_op_is_rep(op);
+    ptr_uint_t count, good;
+
+    TRACE("String callback at %p.\n", desc->pc);
 
-    // Get the drcontext
     void* drcontext = dr_get_current_drcontext();
 
-    // Load the memory context.
+    dr_mcontext_t mc;
+    mc.size = sizeof(mc);
+    mc.flags = DR_MC_INTEGER | DR_MC_CONTROL;
+    dr_get_mcontext(drcontext, &mc);
+    thread_stats_t *stats = stats_thread(drcontext);
+    stats->slow_path++;
+
+    count = rep ? mc.xcx : 1;
+    good = string_good_iterations(&mc, desc, count);
+    if (good == count)
+        return;
+
+    DEBUG("String op at %p touches a redzone after %u of %u iterations\n",
+            desc->pc, (uint)good, (uint)count);
+    adaptive_note_hit(desc->block);
+    get_full_mcontext(drcontext, &mc);
+
+    if (op == OP_movs || op == OP_rep_movs || op == OP_stos || op == OP_rep_stos) {
+        emulate_string_store(drcontext, &mc, desc, count);
+        mc.pc = desc->next_pc;
+        dr_redirect_execution(&mc);
+    }
+
+    // None of the safe iterations ends the instruction, unless memory
+    // changed under us since they were counted.
+    for (; good > 0; good--) {
+        if (! string_iteration(&mc, desc))
+            dr_redirect_execution(&mc);
+    }
+
+    stats->manufactured_reads++;
+    eventlog_record(drcontext, EVENT_MANUFACTURED_READ, desc->pc,
+            access_desc_address(desc, &mc), 0, desc->size);
+    string_iteration(&mc, desc);
+    dr_redirect_execution(&mc);
+}
+
+/* Reads one string element into v, or sets v to zero and returns false if
+ * it isn't addressable or can't be read (a guard page). */
+static bool
+string_element(app_pc addr, uint size, ptr_uint_t * v)
+{
+    *v = 0;
+    if (shadow_is_addressable(addr, size) && dr_safe_read(addr, size, v, NULL))
+        return true;
+    *v = 0;
+    return false;
+}
+
+/* Sets the arithmetic flags in mc as cmp a, b on size-byte operands would. */
+static void
+set_compare_flags(dr_mcontext_t * mc, ptr_uint_t a, ptr_uint_t b, uint size)
+{
+    ptr_uint_t mask = size < sizeof(ptr_uint_t)
+        ? ((ptr_uint_t)1 << (size * 8)) - 1 : ~(ptr_uint_t)0;
+    ptr_uint_t sign = (ptr_uint_t)1 << (size * 8 - 1);
+    ptr_uint_t r, flags;
+    byte parity;
+
+    a &= mask;
+    b &= mask;
+    r = (a - b) & mask;
+    parity = (byte)r;
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+
+    flags = mc->xflags & ~(ptr_uint_t)(EFLAGS_CF | EFLAGS_PF | EFLAGS_AF
+            | EFLAGS_ZF | EFLAGS_SF | EFLAGS_OF);
+    if (a < b)
+        flags |= EFLAGS_CF;
+    if ((parity & 1) == 0)
+        flags |= EFLAGS_PF;
+    if ((a ^ b ^ r) & 0x10)
+        flags |= EFLAGS_AF;
+    if (r == 0)
+        flags |= EFLAGS_ZF;
+    if (r & sign)
+        flags |= EFLAGS_SF;
+    if ((a ^ b) & (a ^ r) & sign)
+        flags |= EFLAGS_OF;
+    mc->xflags = flags;
+}
+
+/* Carries out one iteration of a string instruction other than movs and
+ * stos on mc, with made-up values for elements that aren't addressable:
+ * the next of get_read_value()'s for lods, and zero for cmps and scas, so
+ * that a scan for a terminator stops at the redzone.  Points mc at the
+ * instruction again if it goes on, else past it, and returns which. */
+static bool
+string_iteration(dr_mcontext_t * mc, access_desc_t * desc)
+{
+    int op = desc->opcode;
+    uint size = desc->size;
+    int dir = (mc->xflags & EFLAGS_DF) ? -1 : 1;
+    bool stop = false;
+
+    if (op == OP_lods || op == OP_rep_lods) {
+        ptr_uint_t v;
+        if (! string_element((app_pc)mc->xsi, size, &v))
+            v = get_read_value(desc->pc);
+        reg_set_value(desc->dst, mc, v);
+        mc->xsi += dir * size;
+    } else {
+        bool cmps = op == OP_cmps || op == OP_rep_cmps || op == OP_repne_cmps;
+        ptr_uint_t a = mc->xax, b;
+
+        if (cmps)
+            string_element((app_pc)mc->xsi, size, &a);
+        string_element((app_pc)mc->xdi, size, &b);
+        set_compare_flags(mc, a, b, size);
+        if (op == OP_repne_cmps || op == OP_repne_scas)
+            stop = (mc->xflags & EFLAGS_ZF) != 0;
+        else
+            stop = (mc->xflags & EFLAGS_ZF) == 0;
+        if (cmps)
+            mc->xsi += dir * size;
+        mc->xdi += dir * size;
+    }
+    if (str_op_is_rep(op) && --mc->xcx > 0 && ! stop) {
+        mc->pc = desc->pc;
+        return true;
+    }
+    mc->pc = desc->next_pc;
+    return false;
+}
+
+/* Number of the count iterations, starting now, that the string
+ * instruction would run entirely on addressable memory.  For cmps and
+ * scas, which may stop early, iterations past the one that ends the
+ * instruction are not looked at. */
+static ptr_uint_t
+string_good_iterations(dr_mcontext_t * mc, access_desc_t * desc, ptr_uint_t count)
+{
+    int op = desc->opcode;
+    uint size = desc->size;
+    bool backward = (mc->xflags & EFLAGS_DF) != 0;
+    app_pc si = (app_pc)mc->xsi;
+    app_pc di = (app_pc)mc->xdi;
+    ptr_uint_t i;
+
+    if (op == OP_cmps || op == OP_rep_cmps || op == OP_repne_cmps
+            || op == OP_scas || op == OP_rep_scas || op == OP_repne_scas) {
+        bool cmps = op == OP_cmps || op == OP_rep_cmps || op == OP_repne_cmps;
+        bool until_equal = op == OP_repne_cmps || op == OP_repne_scas;
+
+        for (i = 0; i < count; i++) {
+            ptr_uint_t a = 0, b = 0;
+            app_pc d = backward ? di - i * size : di + i * size;
+            app_pc s = backward ? si - i * size : si + i * size;
+
+            if (! shadow_is_addressable(d, size)
+                    || (cmps && ! shadow_is_addressable(s, size)))
+                return i;
+            if (count == 1)
+                break;
+            if (! dr_safe_read(d, size, &a, NULL))
+                return count; // let the instruction fault natively
+            if (cmps) {
+                if (! dr_safe_read(s, size, &b, NULL))
+                    return count;
+            } else {
+                b = mc->xax;
+                if (size < sizeof(b))
+                    b &= ((ptr_uint_t)1 << (size * 8)) - 1;
+            }
+            if ((a == b) == until_equal)
+                break;
+        }
+        return count;
+    }
+
+    // movs, stos and lods always run count iterations.
+    {
+        bool reads = op != OP_stos && op != OP_rep_stos;
+        bool writes = op != OP_lods && op != OP_rep_lods;
+        ptr_uint_t span = count * size;
+
+        if (count > (ptr_uint_t)-1 / size)
+            return count; // would wrap; leave it to fault natively
+        if (! backward) {
+            app_pc bad_s = reads ? shadow_first_unaddressable(si, span) : NULL;
+            app_pc bad_d = writes ? shadow_first_unaddressable(di, span) : NULL;
+            ptr_uint_t good = count;
+            if (bad_s != NULL)
+                good = (bad_s - si) / size;
+            if (bad_d != NULL && (ptr_uint_t)(bad_d - di) / size < good)
+                good = (bad_d - di) / size;
+            return good;
+        }
+        if ((! reads || shadow_first_unaddressable(si - span + size, span) == NULL)
+                && (! writes || shadow_first_unaddressable(di - span + size, span) == NULL))
+            return count;
+        for (i = 0; i < count; i++) {
+            if ((reads && ! shadow_is_addressable(si - i * size, size))
+                    || (writes && ! shadow_is_addressable(di - i * size, size)))
+                break;
+        }
+        return i;
+    }
+}
+
+/* Performs a movs or stos of count elements, skipping the writes that would
+ * land in a redzone and storing zeroes for the reads that would come from
+ * one, then updates xsi, xdi and xcx as the instruction would have.  Guard
+ * pages are addressable in the shadow, so accesses that fault are counted
+ * the same way. */
+static void
+emulate_string_store(void * drcontext, dr_mcontext_t * mc, access_desc_t * desc,
+        ptr_uint_t count)
+{
+    bool movs = desc->opcode == OP_movs || desc->opcode == OP_rep_movs;
+    uint size = desc->size;
+    int step = (mc->xflags & EFLAGS_DF) ? -(int)size : (int)size;
+    thread_stats_t *stats = stats_thread(drcontext);
+    app_pc si = (app_pc)mc->xsi;
+    app_pc di = (app_pc)mc->xdi;
+    ptr_uint_t i;
+
+    for (i = 0; i < count; i++, si += step, di += step) {
+        ptr_uint_t v = 0;
+
+        if (! shadow_is_addressable(di, size)) {
+            stats->skipped_writes++;
+            eventlog_record(drcontext, EVENT_SKIPPED_WRITE, desc->pc, di, 0, size);
+            continue;
+        }
+        if (! movs) {
+            v = mc->xax;
+        } else if (! shadow_is_addressable(si, size)
+                || ! dr_safe_read(si, size, &v, NULL)) {
+            v = 0;
+            stats->manufactured_reads++;
+            eventlog_record(drcontext, EVENT_MANUFACTURED_READ, desc->pc, si, 0, size);
+        }
+        if (! dr_safe_write(di, size, &v, NULL)) {
+            stats->skipped_writes++;
+            eventlog_record(drcontext, EVENT_SKIPPED_WRITE, desc->pc, di, 0, size);
+        }
+    }
+
+    if (movs)
+        mc->xsi = (ptr_uint_t)si;
+    mc->xdi = (ptr_uint_t)di;
+    if (desc->opcode == OP_rep_movs || desc->opcode == OP_rep_stos)
+        mc->xcx = 0;
+}
+
+/* A group check hit a redzone.  That may only be the gap between two
+ * members, so rather than decide here, every instruction in the group is
+ * marked for one-by-one checking and the block is rebuilt from the
+ * leader, which hasn't executed yet. */
+static void
+group_callback(app_pc first, app_pc last)
+{
+    void *drcontext = dr_get_current_drcontext();
+    app_pc pc;
+
     dr_mcontext_t mc;
     mc.size = sizeof(mc);
     mc.flags = DR_MC_ALL;
     dr_get_mcontext(drcontext, &mc);
+    stats_thread(drcontext)->slow_path++;
 
-    // Get the instruction
-    instr_init(drcontext, &instr);
-    decode(drcontext, addr, &instr);
+    DEBUG("Group check hit for %p-%p.\n", first, last);
 
-    // Get word-aligned address.
-    app_pc accessed_mem = align_ptr(opnd_compute_address(instr_get_dst(&instr, i), &mc));
+    for (pc = first; pc <= last; pc = decode_next_pc(drcontext, pc))
+        hashtable_add(precise_pcs, pc, (void *)1);
 
-    int accessed_val;
+    dr_flush_region(first, last + 1 - first);
+    mc.pc = first;
+    dr_redirect_execution(&mc);
+}
 
-    if (! try_read(accessed_mem, &accessed_val)) {
-        DEBUG("Write of unaccessable value at %p (pc = %p, sp = %p, bp = %p)\n", accessed_mem, addr, mc.xsp, mc.xbp);
-        write_count++;
-        skip_write(drcontext, &mc, addr, &instr);
-    } else 
-    if (accessed_val == SENTINEL) {
-        // Increment the counter.
-        DEBUG("Write of sentinel at %p (pc = %p, sp = %p, bp = %p)\n", accessed_mem, addr, mc.xsp, mc.xbp);
-        write_count++;
-        skip_write(drcontext, &mc, addr, &instr);
+/* [base + lo, base + hi) is what a plain [base + disp] access touches.
+ * Returns false for any other kind of operand. */
+static bool
+access_range(access_t * a, reg_id_t * base, int * lo, int * hi)
+{
+    opnd_t o = a->write ? instr_get_dst(a->instr, a->index)
+                        : instr_get_src(a->instr, a->index);
+
+    if (opnd_is_far_memory_reference(o) || ! opnd_is_base_disp(o)
+            || opnd_get_index(o) != DR_REG_NULL
+            || opnd_get_base(o) == DR_REG_NULL)
+        return false;
+    *base = opnd_get_base(o);
+    *lo = opnd_get_disp(o);
+    *hi = *lo + opnd_access_size(o);
+    return true;
+}
+
+/* Copies what the previous block of the trace left checked into covered,
+ * if the block at tag continues that trace, and returns how many ranges
+ * there are.  A trace head always starts a new trace. */
+static int
+take_covered(void * drcontext, void * tag, covered_range_t * covered)
+{
+    trace_state_t *ts = drmgr_get_tls_field(drcontext, trace_tls_idx);
+    int n = 0;
+
+    if (tag == ts->next_tag && ! dr_trace_head_at(drcontext, tag)) {
+        n = ts->num_covered;
+        memcpy(covered, ts->covered, n * sizeof(covered_range_t));
     }
+    ts->next_tag = NULL;
+    ts->num_covered = 0;
+    return n;
+}
+
+/* Marks the accesses that fall inside a range an earlier block of the trace
+ * checked, with the base register unchanged since, as DOMINATED.  A trace
+ * has a single entry, so that check always ran first.  Leaves in covered
+ * the ranges still valid at the end of the block. */
+static void
+elide_dominated(instrlist_t * bb, access_t * accesses, int num_accesses,
+        covered_range_t * covered, int * num_covered)
+{
+    instr_t *instr;
+    int next = 0;
+    int j;
+
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        bool precise = hashtable_lookup(precise_pcs, instr_get_app_pc(instr)) != NULL;
+
+        for (; next < num_accesses && accesses[next].instr == instr; next++) {
+            access_t *a = &accesses[next];
+            reg_id_t base;
+            int lo, hi;
+
+            if (precise || ! access_range(a, &base, &lo, &hi))
+                continue;
+            for (j = 0; j < *num_covered; j++) {
+                covered_range_t *c = &covered[j];
+                if (c->base == base && c->lo <= lo && hi <= c->hi) {
+                    a->group = DOMINATED;
+                    hashtable_add(dominators, c->pc, (void *)1);
+                    dr_atomic_add32_return_sum(&dominated_count, 1);
+                    break;
+                }
+            }
+        }
 
-    TRACE("Write callback complete for %p.\n", addr);
+        if (! instr_ok_to_mangle(instr))
+            continue;
+        for (j = 0; j < *num_covered; j++) {
+            if (instr_writes_to_reg(instr, covered[j].base))
+                covered[j--] = covered[--*num_covered];
+        }
+    }
 }
 
+/* Hands the ranges this block leaves checked, along with those still valid
+ * from earlier blocks, on to the next block of the trace.  A call may free
+ * memory and an indirect branch or syscall may go anywhere, so nothing
+ * survives those. */
 static void
-instrument_read(void * drcontext, instrlist_t * bb, instr_t * orig)
+pass_covered(void * drcontext, instrlist_t * bb, access_t * accesses,
+        int num_accesses, covered_range_t * covered, int num_covered)
 {
-    uint i;
-    opnd_t o;
+    trace_state_t *ts = drmgr_get_tls_field(drcontext, trace_tls_idx);
+    instr_t *instr, *last = NULL;
+    int next = 0;
+    int j;
+
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        bool precise = hashtable_lookup(precise_pcs, instr_get_app_pc(instr)) != NULL;
+
+        for (; next < num_accesses && accesses[next].instr == instr; next++) {
+            access_t *a = &accesses[next];
+            covered_range_t *c = &covered[num_covered];
 
-    for (i = 0; i < instr_num_srcs(orig); i++) {
-        o = instr_get_src(orig, i);
-
-
-        if (opnd_is_memory_reference(o)
-            && ! instr_is_str_op(orig)) {
-            dr_insert_clean_call(
-                    drcontext,
-                    bb,
-                    orig,
-                    (void *)read_callback,
-                    false /*no fp save*/,
-                    2,
-                    OPND_CREATE_INTPTR(instr_get_app_pc(orig)),
-                    OPND_CREATE_INT32(i)
-                    );
+            if (precise || a->group == DOMINATED || num_covered == MAX_COVERED
+                    || ! access_range(a, &c->base, &c->lo, &c->hi))
+                continue;
+            c->pc = instr_get_app_pc(instr);
+            num_covered++;
         }
 
+        if (! instr_ok_to_mangle(instr))
+            continue;
+        last = instr;
+        for (j = 0; j < num_covered; j++) {
+            if (instr_writes_to_reg(instr, covered[j].base))
+                covered[j--] = covered[--num_covered];
+        }
     }
+
+    if (last == NULL || instr_is_call(last) || instr_is_return(last)
+            || instr_is_mbr(last) || instr_is_syscall(last)
+            || instr_is_interrupt(last))
+        num_covered = 0;
+    memcpy(ts->covered, covered, num_covered * sizeof(covered_range_t));
+    ts->num_covered = num_covered;
+}
+
+/* A check that others in a trace rely on found a redzone, so it no longer
+ * vouches for them: it is made precise and the traces holding it are
+ * rebuilt without the elision.  Returns true if so; the flush happens
+ * once the caller leaves the code cache. */
+static bool
+drop_dominator(app_pc pc)
+{
+    if (! hashtable_remove(dominators, pc))
+        return false;
+    DEBUG("Dominating check at %p hit, rebuilding its traces\n", pc);
+    hashtable_add(precise_pcs, pc, (void *)1);
+    dr_delay_flush_region(pc, 1, 0, NULL);
+    return true;
 }
 
+static dr_custom_trace_action_t
+event_end_trace(void *drcontext, void *trace_tag, void *next_tag)
+{
+    trace_state_t *ts = drmgr_get_tls_field(drcontext, trace_tls_idx);
+
+    // If DR goes on, next_tag's block is built next.
+    ts->next_tag = next_tag;
+    return CUSTOM_TRACE_DR_DECIDES;
+}
+
+static dr_emit_flags_t
+event_trace(void *drcontext, void *tag, instrlist_t *trace, bool translating)
+{
+    trace_state_t *ts = drmgr_get_tls_field(drcontext, trace_tls_idx);
+
+    ts->next_tag = NULL;
+    ts->num_covered = 0;
+    return emit_flags;
+}
+
+/* Marks the accesses of a block that jumps back to its own start whose
+ * address steps forward by a constant each time round as HOISTED: one
+ * register of the address is only ever changed by an add, sub, inc or dec
+ * of a constant, and the other not at all.  Nothing depends on the loop
+ * being read right, since the slot check still sees every address. */
 static void
-instrument_write(void * drcontext, instrlist_t * bb, instr_t * orig)
+find_strided(instrlist_t * bb, app_pc block, access_t * accesses, int num_accesses)
 {
-    uint i;
-    opnd_t o;
+    instr_t *last = instrlist_last(bb);
+    int i;
+
+    if (! instr_is_cbr(last) || ! opnd_is_pc(instr_get_target(last))
+            || opnd_get_pc(instr_get_target(last)) != block)
+        return;
+
+    for (i = 0; i < num_accesses; i++) {
+        access_t *a = &accesses[i];
+        opnd_t o = a->write ? instr_get_dst(a->instr, a->index)
+                            : instr_get_src(a->instr, a->index);
+        reg_id_t base, index;
+        int step, stride;
+
+        if (a->group != -1 || opnd_is_far_memory_reference(o)
+                || ! opnd_is_base_disp(o))
+            continue;
+        base = opnd_get_base(o);
+        index = opnd_get_index(o);
+        if (base == index)
+            continue;
+
+        if (index != DR_REG_NULL && (step = induction_step(bb, index)) != 0
+                && (base == DR_REG_NULL || count_writes(bb, base, NULL) == 0))
+            stride = step * opnd_get_scale(o);
+        else if (index == DR_REG_NULL && base != DR_REG_NULL
+                && (step = induction_step(bb, base)) != 0)
+            stride = step;
+        else
+            continue;
+
+        // The slot only looks ahead.
+        if (stride > 0 && stride <= MAX_LOOP_STRIDE)
+            a->group = HOISTED;
+    }
+}
+
+/* How much reg goes up by each time through the block, or 0 unless it is
+ * changed exactly once, by a constant. */
+static int
+induction_step(instrlist_t * bb, reg_id_t reg)
+{
+    instr_t *w;
+    int opcode;
+
+    if (! reg_is_pointer_sized(reg) || count_writes(bb, reg, &w) != 1)
+        return 0;
+    if (! opnd_is_reg(instr_get_dst(w, 0)) || opnd_get_reg(instr_get_dst(w, 0)) != reg)
+        return 0;
+
+    opcode = instr_get_opcode(w);
+    if (opcode == OP_inc)
+        return 1;
+    if (opcode == OP_dec)
+        return -1;
+    if ((opcode == OP_add || opcode == OP_sub)
+            && opnd_is_immed_int(instr_get_src(w, 0))) {
+        int v = (int)opnd_get_immed_int(instr_get_src(w, 0));
+        return opcode == OP_add ? v : -v;
+    }
+    return 0;
+}
 
-    for (i = 0; i < instr_num_dsts(orig); i++) {
-        o = instr_get_dst(orig, i);
-
-
-        if (opnd_is_memory_reference(o)
-            && ! instr_is_str_op(orig)) {
-            dr_insert_clean_call(
-                    drcontext,
-                    bb,
-                    orig,
-                    (void *)write_callback,
-                    false /*no fp save*/,
-                    2,
-                    OPND_CREATE_INTPTR(instr_get_app_pc(orig)),
-                    OPND_CREATE_INT32(i)
-                    );
+/* Number of instructions in bb writing reg; writer gets the last. */
+static int
+count_writes(instrlist_t * bb, reg_id_t reg, instr_t ** writer)
+{
+    instr_t *instr;
+    int n = 0;
+
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        if (instr_ok_to_mangle(instr) && instr_writes_to_reg(instr, reg)) {
+            n++;
+            if (writer != NULL)
+                *writer = instr;
         }
+    }
+    return n;
+}
+
+/* Inserts the check of a HOISTED access against its thread's slot.  Only
+ * when the address has left what the slot covers, or something has been
+ * poisoned since, does loop_callback() look again.  Returns false if no
+ * registers or slots are left, for a plain check instead.
+ *
+ *      spill   addr, slots
+ *      lea     addr, <o>
+ *      save    aflags
+ *      mov     slots, <this thread's loop slots>
+ *      cmp     addr, [slots + slot.lo]
+ *      jb      miss
+ *      cmp     addr, [slots + slot.last]
+ *      ja      miss
+ *      mov     addr, &generation
+ *      mov     addr32, [addr]
+ *      cmp     addr32, [slots + slot.generation]
+ *      jne     miss
+ *      restore aflags, slots, addr
+ *      jmp     done
+ *  miss:
+ *      restore aflags, slots, addr
+ *      clean call loop_callback(pc, desc, slot)
+ *  done:
+ */
+static bool
+instrument_hoisted(void * drcontext, instrlist_t * bb, app_pc block, access_t * a)
+{
+    instr_t *where = a->instr;
+    opnd_t o = a->write ? instr_get_dst(where, a->index)
+                        : instr_get_src(where, a->index);
+    reg_id_t regs[2];
+    uint desc, slot;
+    int disp;
+    instr_t *miss, *done;
+    int r;
+
+    if (! pick_scratch_regs(where, regs, 2))
+        return false;
+
+    // Rebuilt blocks keep their access's slot.
+    desc = access_desc_ref(drcontext, block, where, a->write, a->index);
+    slot = (uint)(ptr_uint_t)hashtable_lookup(loop_slots, (void *)(ptr_uint_t)(desc + 1));
+    if (slot == 0) {
+        slot = dr_atomic_add32_return_sum(&num_loop_slots, 1);
+        if (slot > MAX_LOOP_SLOTS)
+            return false;
+        hashtable_add(loop_slots, (void *)(ptr_uint_t)(desc + 1),
+                (void *)(ptr_uint_t)slot);
+        slot = (uint)(ptr_uint_t)hashtable_lookup(loop_slots,
+                (void *)(ptr_uint_t)(desc + 1));
+    }
+    slot--;
+    disp = slot * sizeof(loop_slot_t);
+
+    miss = INSTR_CREATE_label(drcontext);
+    done = INSTR_CREATE_label(drcontext);
+
+    for (r = 0; r < 2; r++)
+        dr_save_reg(drcontext, bb, where, regs[r], scratch_slots[r]);
+    insert_compute_address(drcontext, bb, where, o, regs[0]);
+    dr_save_arith_flags(drcontext, bb, where, FLAGS_SLOT);
+    drmgr_insert_read_tls_field(drcontext, loop_tls_idx, bb, where, regs[1]);
+
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(regs[0]),
+                OPND_CREATE_MEMPTR(regs[1], disp + offsetof(loop_slot_t, lo))));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jb,
+                opnd_create_instr(miss)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(regs[0]),
+                OPND_CREATE_MEMPTR(regs[1], disp + offsetof(loop_slot_t, last))));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_ja,
+                opnd_create_instr(miss)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_imm(drcontext,
+                opnd_create_reg(regs[0]),
+                OPND_CREATE_INTPTR(shadow_generation_address())));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(reg_resize_to_opsz(regs[0], OPSZ_4)),
+                OPND_CREATE_MEM32(regs[0], 0)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(reg_resize_to_opsz(regs[0], OPSZ_4)),
+                OPND_CREATE_MEM32(regs[1], disp + offsetof(loop_slot_t, generation))));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jne,
+                opnd_create_instr(miss)));
+
+    dr_restore_arith_flags(drcontext, bb, where, FLAGS_SLOT);
+    for (r = 1; r >= 0; r--)
+        dr_restore_reg(drcontext, bb, where, regs[r], scratch_slots[r]);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jmp(drcontext,
+                opnd_create_instr(done)));
+
+    instrlist_meta_preinsert(bb, where, miss);
+    dr_restore_arith_flags(drcontext, bb, where, FLAGS_SLOT);
+    for (r = 1; r >= 0; r--)
+        dr_restore_reg(drcontext, bb, where, regs[r], scratch_slots[r]);
+    dr_insert_clean_call(drcontext, bb, where, (void *)loop_callback,
+            false /*no fp save*/, 3, OPND_CREATE_INTPTR(instr_get_app_pc(where)),
+            OPND_CREATE_INT32(desc), OPND_CREATE_INT32(slot));
+
+    instrlist_meta_preinsert(bb, where, done);
+    return true;
+}
+
+/* A hoisted access left its slot's range.  If it is itself bad it is
+ * handled like any other; otherwise the slot is refilled with the
+ * addressable stretch starting at it, up to LOOP_WINDOW bytes, which the
+ * iterations to come will walk through. */
+static void
+loop_callback(app_pc pc, uint desc_ref, uint slot)
+{
+    access_desc_t *desc = access_desc_deref(pc, desc_ref);
+    void *drcontext = dr_get_current_drcontext();
+    loop_slot_t *s = (loop_slot_t *)drmgr_get_tls_field(drcontext, loop_tls_idx) + slot;
+    // Taken before the scan, so a poisoning during it empties the slot.
+    uint generation = shadow_generation();
+    app_pc addr, bad;
+
+    dr_mcontext_t mc;
+    mc.size = sizeof(mc);
+    mc.flags = DR_MC_INTEGER | DR_MC_CONTROL;
+    dr_get_mcontext(drcontext, &mc);
 
+    addr = access_desc_address(desc, &mc);
+    if (! shadow_is_addressable(addr, desc->size)) {
+        if (desc->write)
+            write_callback(pc, desc_ref);
+        else
+            read_callback(pc, desc_ref);
+        return;
+    }
+
+    stats_thread(drcontext)->slow_path++;
+    bad = shadow_first_unaddressable(addr, LOOP_WINDOW);
+    s->lo = (ptr_uint_t)addr;
+    s->last = (ptr_uint_t)(bad != NULL ? bad : addr + LOOP_WINDOW) - desc->size;
+    s->generation = generation;
+}
+
+/* An access ran into the guard page after a large heap block (see
+ * inst_malloc.c).  The shadow leaves guard pages addressable, so this is
+ * where overflows off those blocks are dealt with: the same way the
+ * callbacks deal with redzone hits. */
+static dr_signal_action_t
+event_signal(void *drcontext, dr_siginfo_t *info)
+{
+    dr_mcontext_t *mc = info->mcontext;
+    thread_stats_t *stats;
+    access_desc_t *desc;
+    app_pc page;
+    instr_t instr;
+    bool write;
+    int i;
+
+    if (info->sig != SIGSEGV || info->access_address == NULL
+            || ! malloc_is_guard_page(info->access_address))
+        return DR_SIGNAL_DELIVER;
+    page = (app_pc)ALIGN_BACKWARD(info->access_address, PAGE_SIZE);
+
+    instr_init(drcontext, &instr);
+    if (decode(drcontext, mc->pc, &instr) == NULL
+            || (i = guard_page_operand(&instr, mc, page, &write)) < 0) {
+        instr_free(drcontext, &instr);
+        return DR_SIGNAL_DELIVER;
+    }
+    instr_set_translation(&instr, mc->pc);
+    desc = access_desc_get(access_desc_lookup_or_add(drcontext, NULL, &instr,
+                write, i));
+    instr_free(drcontext, &instr);
+
+    DEBUG("%s of guard page %p (pc = %p)\n", write ? "Write" : "Read",
+            info->access_address, mc->pc);
+    stats = stats_thread(drcontext);
+    stats->slow_path++;
+    adaptive_note_hit(desc->block);
+
+    if (desc->opcode == OP_movs || desc->opcode == OP_rep_movs
+            || desc->opcode == OP_stos || desc->opcode == OP_rep_stos) {
+        emulate_string_store(drcontext, mc, desc,
+                str_op_is_rep(desc->opcode) ? mc->xcx : 1);
+        mc->pc = desc->next_pc;
+    } else if (str_op_is_rep(desc->opcode) || desc->opcode == OP_lods
+            || desc->opcode == OP_cmps || desc->opcode == OP_scas) {
+        stats->manufactured_reads++;
+        eventlog_record(drcontext, EVENT_MANUFACTURED_READ, desc->pc,
+                info->access_address, 0, desc->size);
+        string_iteration(mc, desc);
+    } else if (write) {
+        stats->skipped_writes++;
+        eventlog_record(drcontext, EVENT_SKIPPED_WRITE, desc->pc,
+                info->access_address, 0, desc->size);
+        if (simd_kind(desc) != SIMD_NONE)
+            store_simd_lanes(mc, desc, access_desc_address(desc, mc));
+        mc->pc = desc->next_pc;
+    } else {
+        ptr_uint_t val = 0;
+        stats->manufactured_reads++;
+        if (simd_kind(desc) != SIMD_NONE) {
+            load_simd_lanes(mc, desc, access_desc_address(desc, mc));
+        } else if (desc->dst != DR_REG_NULL && reg_is_gpr(desc->dst)) {
+            val = get_read_value(desc->pc);
+            reg_set_value(desc->dst, mc, val);
+        }
+        eventlog_record(drcontext, EVENT_MANUFACTURED_READ, desc->pc,
+                info->access_address, val, desc->size);
+        mc->pc = desc->next_pc;
+    }
+    return DR_SIGNAL_REDIRECT;
+}
+
+/* Finds the memory operand of instr that touches page, preferring a
+ * destination.  Returns its src or dst slot, or -1. */
+static int
+guard_page_operand(instr_t * instr, dr_mcontext_t * mc, app_pc page, bool * write)
+{
+    int i;
+
+    for (*write = true; ; *write = false) {
+        int n = *write ? instr_num_dsts(instr) : instr_num_srcs(instr);
+        for (i = 0; i < n; i++) {
+            opnd_t o = *write ? instr_get_dst(instr, i) : instr_get_src(instr, i);
+            app_pc addr;
+            if (! opnd_is_memory_reference(o))
+                continue;
+            addr = opnd_compute_address(o, mc);
+            if (addr < page + PAGE_SIZE && addr + opnd_access_size(o) > page)
+                return i;
+        }
+        if (! *write)
+            return -1;
+    }
+}
+
+/* Spills, pushes, frame accesses through xsp, globals and TLS can't touch a
+ * heap redzone, so they are left unchecked. */
+static bool
+needs_check(opnd_t o, bool for_trace)
+{
+    opnd_class_t class = opnd_classify(o);
+
+    if (! for_trace)
+        dr_atomic_add32_return_sum(&opnd_class_count[class], 1);
+
+    return class == OPND_CLASS_UNKNOWN;
+}
+
+/* Inserts the check for one memory operand, falling back to a plain clean
+ * call when no inline check is possible.  The callback gets the pc and
+ * the reference to the operand's descriptor. */
+static void
+instrument_access(void * drcontext, instrlist_t * bb, app_pc block,
+        instr_t * orig, bool write, uint i)
+{
+    opnd_t o = write ? instr_get_dst(orig, i) : instr_get_src(orig, i);
+    void *callback = write ? (void *)write_callback : (void *)read_callback;
+    opnd_t pc = OPND_CREATE_INTPTR(instr_get_app_pc(orig));
+    opnd_t desc = OPND_CREATE_INT32(access_desc_ref(drcontext, block,
+                orig, write, i));
+
+    if (! insert_check(drcontext, bb, orig, o, opnd_access_size(o), callback,
+                2, pc, desc)) {
+        // Segment-relative operands can't be computed with a lea, and an
+        // instruction may use too many of the registers we could borrow.
+        // Both are rare enough to leave on the clean call.
+        dr_insert_clean_call(drcontext, bb, orig, callback,
+                false /*no fp save*/, 2, pc, desc);
+    }
+}
+
+/* Inserts an inline check that [o, o + size) is addressable before where.
+ * The fast path computes the address into a borrowed register and tests
+ * the shadow; only a non-zero shadow byte falls through to the clean call,
+ * which makes the exact decision.  The application's registers and flags
+ * are restored on both paths so that the callback sees the real machine
+ * context.  Returns false if where leaves no registers to borrow.
+ *
+ *      spill   addr, shadow, tmp
+ *      lea     addr, <o>
+ *      save    aflags
+ *      <test the shadow of [addr, addr + size), jumping to hit if set>
+ *  ok:
+ *      restore aflags, tmp, shadow, addr
+ *      jmp     done
+ *  hit:
+ *      restore aflags, tmp, shadow, addr
+ *      clean call <callback>(arg1[, arg2])
+ *  done:
+ *      <where>
+ */
+static bool
+insert_check(void * drcontext, instrlist_t * bb, instr_t * where,
+        opnd_t o, uint size, void * callback, uint num_args,
+        opnd_t arg1, opnd_t arg2)
+{
+    reg_id_t regs[NUM_SCRATCH];
+    instr_t *ok, *hit, *done;
+    int r;
+
+    if (opnd_is_far_memory_reference(o)
+            || ! pick_scratch_regs(where, regs, NUM_SCRATCH))
+        return false;
+
+    ok = INSTR_CREATE_label(drcontext);
+    hit = INSTR_CREATE_label(drcontext);
+    done = INSTR_CREATE_label(drcontext);
+
+    for (r = 0; r < NUM_SCRATCH; r++)
+        dr_save_reg(drcontext, bb, where, regs[r], scratch_slots[r]);
+    insert_compute_address(drcontext, bb, where, o, regs[0]);
+    dr_save_arith_flags(drcontext, bb, where, FLAGS_SLOT);
+
+    insert_shadow_test(drcontext, bb, where, regs[0], regs[1], regs[2],
+            size, ok, hit);
+
+    instrlist_meta_preinsert(bb, where, ok);
+    dr_restore_arith_flags(drcontext, bb, where, FLAGS_SLOT);
+    for (r = NUM_SCRATCH - 1; r >= 0; r--)
+        dr_restore_reg(drcontext, bb, where, regs[r], scratch_slots[r]);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jmp(drcontext,
+                opnd_create_instr(done)));
+
+    instrlist_meta_preinsert(bb, where, hit);
+    dr_restore_arith_flags(drcontext, bb, where, FLAGS_SLOT);
+    for (r = NUM_SCRATCH - 1; r >= 0; r--)
+        dr_restore_reg(drcontext, bb, where, regs[r], scratch_slots[r]);
+    dr_insert_clean_call(drcontext, bb, where, callback,
+            false /*no fp save*/, num_args, arg1, arg2);
+
+    instrlist_meta_preinsert(bb, where, done);
+    return true;
+}
+
+/* Emits the shadow test for [addr, addr + size), branching to hit when any
+ * of it isn't addressable.  Falls through (or jumps to ok) when the whole
+ * range is addressable.  Clobbers addr, shadow, tmp and flags.
+ *
+ * An access inside one granule needs a single lookup, and only a granule
+ * that isn't wholly addressable needs the compare against its shadow:
+ *
+ *      <shadow = shadow byte of addr>
+ *      test    shadow, shadow
+ *      jnz     partial
+ *      mov     tmp, addr                       (size > 1 only, to jmp ok)
+ *      and     tmp, SHADOW_GRANULE - 1
+ *      cmp     tmp, SHADOW_GRANULE - size
+ *      jbe     ok
+ *      lea     addr, [addr + size - 1]
+ *      <shadow = shadow byte of addr>
+ *      test    shadow, shadow
+ *      jz      ok
+ *      <partial test of the byte at addr>
+ *      jmp     ok
+ *  partial:
+ *      <partial test of [addr, addr + size)>
+ *
+ * where the partial test of n bytes passes if they lie in the addressable
+ * head of a partly addressable granule:
+ *
+ *      cmp     shadow, SHADOW_GRANULE
+ *      jae     hit
+ *      mov     tmp, addr
+ *      and     tmp, SHADOW_GRANULE - 1
+ *      add     tmp, n - 1                      (n > 1 only)
+ *      cmp     tmp, shadow
+ *      jae     hit
+ *
+ * A wider range must lie inside one chunk for its shadow to be contiguous.
+ * It compares the shadow bytes of the granules it covers before its last
+ * one for certain, several at a time, then the one before the last, which
+ * depends on how addr is aligned, and then the last, which may be partial:
+ *
+ *      mov     tmp, addr
+ *      and     tmp, CHUNK_MASK
+ *      cmp     tmp, CHUNK_SIZE - size
+ *      ja      hit
+ *      <shadow = address of the shadow byte of addr>
+ *      cmp     qword/dword/word/byte [shadow + n], 0
+ *      jnz     hit
+ *      ...
+ *      mov     tmp, addr
+ *      and     tmp, SHADOW_GRANULE - 1
+ *      add     tmp, size - 1
+ *      shr     tmp, SHADOW_SCALE
+ *      cmp     byte [shadow + tmp - 1], 0
+ *      jnz     hit
+ *      movzx   tmp, byte [shadow + tmp]
+ *      test    tmp, tmp
+ *      jz      ok
+ *      lea     addr, [addr + size - 1]
+ *      <partial test of the byte at addr>
+ */
+static void
+insert_shadow_test(void * drcontext, instrlist_t * bb, instr_t * where,
+        reg_id_t addr, reg_id_t shadow, reg_id_t tmp, uint size,
+        instr_t * ok, instr_t * hit)
+{
+    if (size <= SHADOW_GRANULE) {
+        instr_t *partial = INSTR_CREATE_label(drcontext);
+
+        shadow_insert_load(drcontext, bb, where, addr, shadow, tmp);
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_test(drcontext,
+                    opnd_create_reg(shadow), opnd_create_reg(shadow)));
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jnz,
+                    opnd_create_instr(partial)));
+        if (size > 1) {
+            // Most accesses stay inside one granule and are done.
+            instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                        opnd_create_reg(tmp), opnd_create_reg(addr)));
+            instrlist_meta_preinsert(bb, where, INSTR_CREATE_and(drcontext,
+                        opnd_create_reg(tmp),
+                        OPND_CREATE_INT8(SHADOW_GRANULE - 1)));
+            instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                        opnd_create_reg(tmp),
+                        OPND_CREATE_INT8(SHADOW_GRANULE - size)));
+            instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jbe,
+                        opnd_create_instr(ok)));
+
+            // The rest spill into the next granule, which may be partial.
+            instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext,
+                        opnd_create_reg(addr),
+                        opnd_create_base_disp(addr, DR_REG_NULL, 0, size - 1,
+                            OPSZ_lea)));
+            shadow_insert_load(drcontext, bb, where, addr, shadow, tmp);
+            instrlist_meta_preinsert(bb, where, INSTR_CREATE_test(drcontext,
+                        opnd_create_reg(shadow), opnd_create_reg(shadow)));
+            instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jz,
+                        opnd_create_instr(ok)));
+            insert_partial_test(drcontext, bb, where, addr, shadow, tmp, 1, hit);
+        }
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_jmp(drcontext,
+                    opnd_create_instr(ok)));
+        instrlist_meta_preinsert(bb, where, partial);
+        insert_partial_test(drcontext, bb, where, addr, shadow, tmp, size, hit);
+        return;
+    }
+
+    // The shadow of the range is only contiguous inside one chunk.
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(tmp), opnd_create_reg(addr)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_and(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT32(CHUNK_MASK)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT32(CHUNK_SIZE - size)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_ja,
+                opnd_create_instr(hit)));
+
+    // The granules before the last one however addr is aligned.
+    uint granules = (size - 1) / SHADOW_GRANULE;
+    int offs = 0;
+
+    shadow_insert_lea(drcontext, bb, where, addr, shadow, tmp);
+    while (granules > 0) {
+        opnd_t mem;
+        uint n;
+#ifdef X86_64
+        if (granules >= 8) {
+            n = 8;
+            mem = OPND_CREATE_MEM64(shadow, offs);
+        } else
+#endif
+        if (granules >= 4) {
+            n = 4;
+            mem = OPND_CREATE_MEM32(shadow, offs);
+        } else if (granules >= 2) {
+            n = 2;
+            mem = OPND_CREATE_MEM16(shadow, offs);
+        } else {
+            n = 1;
+            mem = OPND_CREATE_MEM8(shadow, offs);
+        }
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                    mem, n == 1 ? OPND_CREATE_INT8(0) :
+                    n == 2 ? OPND_CREATE_INT16(0) : OPND_CREATE_INT32(0)));
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext,
+                    OP_jnz, opnd_create_instr(hit)));
+        granules -= n;
+        offs += n;
+    }
+
+    // tmp = how many granules on the last one is.  The one before it may
+    // not have been compared yet.
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(tmp), opnd_create_reg(addr)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_and(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(SHADOW_GRANULE - 1)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_add(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT32(size - 1)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_shr(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(SHADOW_SCALE)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_base_disp(shadow, tmp, 1, -1, OPSZ_1),
+                OPND_CREATE_INT8(0)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jnz,
+                opnd_create_instr(hit)));
+
+    // The last granule may be partial; shadow is done with as an address.
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_movzx(drcontext,
+                opnd_create_reg(tmp),
+                opnd_create_base_disp(shadow, tmp, 1, 0, OPSZ_1)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_test(drcontext,
+                opnd_create_reg(tmp), opnd_create_reg(tmp)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jz,
+                opnd_create_instr(ok)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext,
+                opnd_create_reg(addr),
+                opnd_create_base_disp(addr, DR_REG_NULL, 0, size - 1, OPSZ_lea)));
+    insert_partial_test(drcontext, bb, where, addr, tmp, shadow, 1, hit);
+}
+
+/* Emits the test that the n bytes at addr, all in one granule whose shadow
+ * byte is in shadow and non-zero, lie in the addressable head of it,
+ * branching to hit if not.  Clobbers tmp and flags. */
+static void
+insert_partial_test(void * drcontext, instrlist_t * bb, instr_t * where,
+        reg_id_t addr, reg_id_t shadow, reg_id_t tmp, uint n, instr_t * hit)
+{
+    // A redzone marker is never below SHADOW_GRANULE.
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(shadow), OPND_CREATE_INT8(SHADOW_GRANULE)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jae,
+                opnd_create_instr(hit)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(tmp), opnd_create_reg(addr)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_and(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(SHADOW_GRANULE - 1)));
+    if (n > 1) {
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_add(drcontext,
+                    opnd_create_reg(tmp), OPND_CREATE_INT8(n - 1)));
+    }
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(tmp), opnd_create_reg(shadow)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jae,
+                opnd_create_instr(hit)));
+}
+
+/* Finds n registers that instr doesn't touch, so the check can clobber them
+ * without disturbing the operand it is about to compute. */
+static bool
+pick_scratch_regs(instr_t * instr, reg_id_t * regs, int n)
+{
+    int i;
+    int found = 0;
+    for (i = 0; i < num_scratch_regs && found < n; i++) {
+        if (! instr_uses_reg(instr, scratch_regs[i]))
+            regs[found++] = scratch_regs[i];
+    }
+    return found == n;
+}
+
+/* Number of bytes an operand touches.  Operands whose size isn't fixed are
+ * treated as a single byte so the check at least covers their start. */
+static uint
+opnd_access_size(opnd_t o)
+{
+    uint size = opnd_size_in_bytes(opnd_get_size(o));
+    return size == 0 ? 1 : size;
+}
+
+/* Loads the effective address of a near memory operand into reg.  Must be
+ * inserted before anything clobbers the application's registers. */
+static void
+insert_compute_address(void * drcontext, instrlist_t * bb, instr_t * where,
+        opnd_t o, reg_id_t reg)
+{
+    if (opnd_is_base_disp(o)) {
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext,
+                    opnd_create_reg(reg),
+                    opnd_create_base_disp(opnd_get_base(o), opnd_get_index(o),
+                        opnd_get_scale(o), opnd_get_disp(o), OPSZ_lea)));
+    } else {
+        // Absolute or rip-relative: the address is known now.
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_imm(drcontext,
+                    opnd_create_reg(reg),
+                    OPND_CREATE_INTPTR(opnd_get_addr(o))));
     }
 }
 
@@ -224,43 +1981,199 @@ get_read_value(app_pc addr)
     return (int) lookup;
 }
 
+/* The callbacks only fetch what they need to compute the address;
+ * redirecting needs the rest. */
 static void
-skip_instruction(void* drcontext, dr_mcontext_t* mc, app_pc addr)
+get_full_mcontext(void* drcontext, dr_mcontext_t* mc)
 {
-    app_pc next = (app_pc)decode_next_pc(drcontext, addr);
-    mc->pc = next;
+    mc->size = sizeof(*mc);
+    mc->flags = DR_MC_ALL;
+    dr_get_mcontext(drcontext, mc);
+}
+
+static void
+skip_instruction(void* drcontext, dr_mcontext_t* mc, access_desc_t* desc)
+{
+    mc->pc = desc->next_pc;
     dr_redirect_execution(mc);
 }
 
 static void
-skip_read(void* drcontext, dr_mcontext_t* mc, app_pc addr, instr_t * instr)
-{
-    if (instr_num_dsts(instr) > 0) {
-        opnd_t dst = instr_get_dst(instr, 0);
-        if (opnd_is_reg(dst)) {
-            // set register value.
-            int val = get_read_value(addr);
-            reg_set_value(opnd_get_reg(dst), mc, val);
-
-            // Skip it.
-            DEBUG("Replacing read with %i.\n", val);
-            skip_instruction(drcontext, mc, addr);
+skip_read(void* drcontext, dr_mcontext_t* mc, access_desc_t* desc, app_pc addr)
+{
+    if (simd_kind(desc) != SIMD_NONE) {
+        get_full_mcontext(drcontext, mc);
+        load_simd_lanes(mc, desc, addr);
+        eventlog_record(drcontext, EVENT_MANUFACTURED_READ, desc->pc, addr, 0,
+                desc->size);
+        DEBUG("Loading the addressable bytes of a %u-byte read.\n", desc->size);
+        skip_instruction(drcontext, mc, desc);
+    } else if (! read_is_skippable(desc)) {
+        // Nothing to make up; the instruction reads the redzone as is.
+        eventlog_record(drcontext, EVENT_MANUFACTURED_READ, desc->pc, addr, 0,
+                desc->size);
+    } else {
+        get_full_mcontext(drcontext, mc);
+
+        // set register value.
+        int val = get_read_value(desc->pc);
+        reg_set_value(desc->dst, mc, val);
+        eventlog_record(drcontext, EVENT_MANUFACTURED_READ, desc->pc, addr, val,
+                desc->size);
+
+        // Skip it.
+        DEBUG("Replacing read with %i.\n", val);
+        skip_instruction(drcontext, mc, desc);
+    }
+}
+
+/* Whether skip_read() skips the instruction, rather than letting it read
+ * the redzone: only a general register or a SIMD move's destination can be
+ * given a made-up value. */
+static bool
+read_is_skippable(access_desc_t* desc)
+{
+    return simd_kind(desc) != SIMD_NONE
+        || (desc->dst != DR_REG_NULL && reg_is_gpr(desc->dst));
+}
+
+static void
+skip_write(void* drcontext, dr_mcontext_t* mc, access_desc_t* desc, app_pc addr)
+{
+    get_full_mcontext(drcontext, mc);
+    if (simd_kind(desc) != SIMD_NONE) {
+        DEBUG("Storing the addressable bytes of a %u-byte write.\n", desc->size);
+        store_simd_lanes(mc, desc, addr);
+    } else {
+        DEBUG("Skipping write.\n");
+    }
+    skip_instruction(drcontext, mc, desc);
+}
+
+/* Moves between memory and an xmm, ymm or zmm register, and the load-ops
+ * that vectorized string functions (strlen, memchr and the like) read their
+ * last, partly out of bounds, vector with.  A wide access that only partly
+ * overlaps a redzone is carried out a byte at a time, so the addressable
+ * lanes keep their values instead of the whole access being skipped or made
+ * up; the missing bytes of a load-op's operand read as zero.  VEX and EVEX
+ * forms also zero the register above what they write.  Masked AVX-512
+ * accesses, and compares into opmask registers, are left to the whole
+ * access handling. */
+static int
+simd_kind(access_desc_t* desc)
+{
+    reg_id_t reg = desc->write ? desc->src : desc->dst;
+
+    if (reg == DR_REG_NULL || ! (reg_is_xmm(reg) || reg_is_strictly_zmm(reg))
+            || desc->size > MAX_SIMD_SIZE || desc->mask != DR_REG_NULL)
+        return SIMD_NONE;
+    switch (desc->opcode) {
+    case OP_movdqu: case OP_movdqa: case OP_movups: case OP_movaps:
+    case OP_movupd: case OP_movapd: case OP_movntdq: case OP_movntps:
+    case OP_movntpd: case OP_lddqu: case OP_movd: case OP_movq:
+    case OP_movss: case OP_movsd:
+        return SIMD_MOVE;
+    case OP_vmovdqu: case OP_vmovdqa: case OP_vmovups: case OP_vmovaps:
+    case OP_vmovupd: case OP_vmovapd: case OP_vmovntdq: case OP_vmovntps:
+    case OP_vmovntpd: case OP_vlddqu: case OP_vmovd: case OP_vmovq:
+    case OP_vmovss: case OP_vmovsd:
+    case OP_vmovdqu8: case OP_vmovdqu16: case OP_vmovdqu32: case OP_vmovdqu64:
+    case OP_vmovdqa32: case OP_vmovdqa64:
+        return SIMD_MOVE_VEX;
+    case OP_pcmpeqb: case OP_pcmpeqw: case OP_pcmpeqd: case OP_pminub:
+    case OP_pmaxub: case OP_pand: case OP_pandn: case OP_por: case OP_pxor:
+        return desc->write || desc->src == DR_REG_NULL ? SIMD_NONE : SIMD_OP;
+    case OP_vpcmpeqb: case OP_vpcmpeqw: case OP_vpcmpeqd: case OP_vpminub:
+    case OP_vpmaxub: case OP_vpand: case OP_vpandn: case OP_vpor: case OP_vpxor:
+        return desc->write || desc->src == DR_REG_NULL ? SIMD_NONE : SIMD_OP_VEX;
+    default:
+        return SIMD_NONE;
+    }
+}
+
+/* Does the lane-wise work of a load-op that simd_kind() knows, a = a op b,
+ * over size bytes. */
+static void
+simd_op(int opcode, byte* a, const byte* b, uint size)
+{
+    uint elt = 1, i;
+
+    if (opcode == OP_pcmpeqw || opcode == OP_vpcmpeqw)
+        elt = 2;
+    else if (opcode == OP_pcmpeqd || opcode == OP_vpcmpeqd)
+        elt = 4;
+    for (i = 0; i < size; i += elt) {
+        switch (opcode) {
+        case OP_pcmpeqb: case OP_pcmpeqw: case OP_pcmpeqd:
+        case OP_vpcmpeqb: case OP_vpcmpeqw: case OP_vpcmpeqd:
+            memset(a + i, memcmp(a + i, b + i, elt) == 0 ? 0xff : 0, elt);
+            break;
+        case OP_pminub: case OP_vpminub:
+            a[i] = a[i] < b[i] ? a[i] : b[i];
+            break;
+        case OP_pmaxub: case OP_vpmaxub:
+            a[i] = a[i] > b[i] ? a[i] : b[i];
+            break;
+        case OP_pand: case OP_vpand:
+            a[i] &= b[i];
+            break;
+        case OP_pandn: case OP_vpandn:
+            a[i] = ~a[i] & b[i];
+            break;
+        case OP_por: case OP_vpor:
+            a[i] |= b[i];
+            break;
+        case OP_pxor: case OP_vpxor:
+            a[i] ^= b[i];
+            break;
         }
     }
 }
 
+/* Loads the bytes of a SIMD read's operand that are addressable, zeroes
+ * for the rest, into its destination, through the load-op if there is
+ * one.  Guard pages are addressable in the shadow, hence the safe reads.
+ * mc must be full. */
 static void
-skip_write(void* drcontext, dr_mcontext_t* mc, app_pc addr, instr_t * instr)
+load_simd_lanes(dr_mcontext_t* mc, access_desc_t* desc, app_pc addr)
 {
-    DEBUG("Skipping write.\n");
-    skip_instruction(drcontext, mc, addr);
+    byte buf[MAX_SIMD_SIZE], val[MAX_SIMD_SIZE];
+    int kind = simd_kind(desc);
+    reg_id_t reg = desc->dst;
+    uint i;
+
+    memset(buf, 0, sizeof buf);
+    for (i = 0; i < desc->size; i++) {
+        if (shadow_is_addressable(addr + i, 1)
+                && ! dr_safe_read(addr + i, 1, &buf[i], NULL))
+            buf[i] = 0;
+    }
+    if (kind == SIMD_OP || kind == SIMD_OP_VEX) {
+        memset(val, 0, sizeof val);
+        reg_get_value_ex(desc->src, mc, val);
+        simd_op(desc->opcode, val, buf, desc->size);
+        memcpy(buf, val, desc->size);
+    }
+    // VEX and EVEX writes clear the register up to the widest there is.
+    if ((kind == SIMD_MOVE_VEX || kind == SIMD_OP_VEX)
+            && ! reg_is_strictly_zmm(reg))
+        reg = reg_resize_to_opsz(reg, proc_avx512_enabled() ? OPSZ_64 : OPSZ_32);
+    reg_set_value_ex(reg, mc, buf);
 }
 
-static bool
-try_read(app_pc ptr, int* val)
+/* Stores the bytes of a SIMD move's source that land on addressable
+ * memory and drops the rest.  mc must be full. */
+static void
+store_simd_lanes(dr_mcontext_t* mc, access_desc_t* desc, app_pc addr)
 {
-    size_t bytes_read;
-    return dr_safe_read(ptr, 4, (void*) val, &bytes_read);
+    byte buf[MAX_SIMD_SIZE];
+    uint i;
+
+    reg_get_value_ex(desc->src, mc, buf);
+    for (i = 0; i < desc->size; i++) {
+        if (shadow_is_addressable(addr + i, 1))
+            dr_safe_write(addr + i, 1, &buf[i], NULL);
+    }
 }
 
 static bool
@@ -285,3 +2198,17 @@ instr_is_str_op(instr_t* instr)
          || opcode == OP_rep_scas
          || opcode == OP_repne_scas);
 }
+
+static bool
+str_op_is_rep(int opcode)
+{
+    return (opcode == OP_rep_ins
+         || opcode == OP_rep_outs
+         || opcode == OP_rep_movs
+         || opcode == OP_rep_stos
+         || opcode == OP_rep_lods
+         || opcode == OP_rep_cmps
+         || opcode == OP_repne_cmps
+         || opcode == OP_rep_scas
+         || opcode == OP_repne_scas);
+}
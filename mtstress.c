@@ -0,0 +1,98 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Multithreaded allocation stress: every thread churns through its own set
+ * of live blocks, writing and reading each one in bounds.  Run it with 1, 2,
+ * 4, ... threads natively and under Shady to see how the client scales. */
+
+#define LIVE_BLOCKS 64
+#define MAX_BLOCK 256
+
+static long iterations = 100000;
+
+static unsigned int
+next_rand(unsigned int *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void*
+worker(void* arg)
+{
+    unsigned int seed = (unsigned int)(long)arg * 2654435761u + 1;
+    char* blocks[LIVE_BLOCKS] = { 0 };
+    unsigned long sum = 0;
+    long i;
+    size_t j;
+
+    for (i = 0; i < iterations; i++)
+    {
+        int slot = next_rand(&seed) % LIVE_BLOCKS;
+        size_t size = next_rand(&seed) % MAX_BLOCK + 1;
+
+        switch (next_rand(&seed) % 8)
+        {
+        case 0:
+            free(blocks[slot]);
+            blocks[slot] = calloc(1, size);
+            break;
+        case 1:
+            if (blocks[slot] != NULL)
+            {
+                blocks[slot] = realloc(blocks[slot], size);
+                break;
+            }
+            /* fall through */
+        default:
+            free(blocks[slot]);
+            blocks[slot] = malloc(size);
+            break;
+        }
+
+        memset(blocks[slot], (int)i, size);
+        for (j = 0; j < size; j += 8)
+            sum += blocks[slot][j];
+    }
+
+    for (i = 0; i < LIVE_BLOCKS; i++)
+        free(blocks[i]);
+
+    return (void*)sum;
+}
+
+int
+main (int argc, char** argv)
+{
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    pthread_t* threads;
+    struct timespec start, end;
+    double secs;
+    int i;
+
+    if (argc > 2)
+        iterations = atol(argv[2]);
+    if (nthreads < 1)
+        nthreads = 1;
+
+    threads = malloc(nthreads * sizeof(pthread_t));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, (void*)(long)i);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("threads %d  ops %ld  secs %.3f  ops/sec %.0f\n",
+           nthreads, nthreads * iterations, secs, nthreads * iterations / secs);
+
+    free(threads);
+    return 0;
+}
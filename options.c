@@ -0,0 +1,314 @@
+#include "options.h"
+
+#include <string.h>
+
+#include "defines.h"
+
+shady_options_t options = {
+    false,      /* adaptive */
+    10000,      /* adaptive_writes_after */
+    0,          /* adaptive_none_after */
+    false,      /* hoist_loops */
+    false,      /* shadow_stack */
+    { { { 0 } }, 0, { { 0 } }, 0 },     /* include */
+    { { { 0 } }, 0, { { 0 } }, 0 },     /* exclude */
+    16 << 20,   /* quarantine_bytes */
+    4096,       /* quarantine_blocks */
+    0,          /* guard_above */
+    8,          /* redzone_min */
+    256,        /* redzone_max */
+    64,         /* redzone_budget_mb */
+    0,          /* sample */
+    false,      /* replace_malloc */
+    1024,       /* arena_mb */
+    { { { 0 } }, 0 },   /* malloc_names */
+    { { { 0 } }, 0 },   /* free_names */
+    "",         /* start_at */
+    false,      /* start_paused */
+    "",         /* symcache */
+    false,      /* persist */
+    "",         /* stats_file */
+    "",         /* stats_json */
+    1000,       /* stats_interval_ms */
+    "",         /* event_log */
+};
+
+static void usage(const char *bad);
+static const char *get_uint(const char *s, const char *name, uint *val);
+static const char *get_module(const char *s, const char *name, scope_list_t *list);
+static const char *get_range(const char *s, const char *name, scope_list_t *list);
+static bool parse_hex(const char **s, ptr_uint_t *val);
+static const char *get_path(const char *s, const char *name, char *path);
+static const char *get_symbol(const char *s, const char *name, char *symbol);
+static const char *get_wrap_name(const char *s, const char *name, wrap_list_t *list);
+static void default_wrap_name(wrap_list_t *list, const char *name);
+
+void
+options_init(client_id_t id)
+{
+    const char *s = dr_get_options(id);
+    char token[256];
+
+    while (s != NULL && (s = dr_get_token(s, token, sizeof token)) != NULL) {
+        if (strcmp(token, "-adaptive") == 0)
+            options.adaptive = true;
+        else if (strcmp(token, "-adaptive_writes") == 0)
+            s = get_uint(s, token, &options.adaptive_writes_after);
+        else if (strcmp(token, "-adaptive_none") == 0)
+            s = get_uint(s, token, &options.adaptive_none_after);
+        else if (strcmp(token, "-hoist_loops") == 0)
+            options.hoist_loops = true;
+        else if (strcmp(token, "-shadow_stack") == 0)
+            options.shadow_stack = true;
+        else if (strcmp(token, "-include_module") == 0)
+            s = get_module(s, token, &options.include);
+        else if (strcmp(token, "-exclude_module") == 0)
+            s = get_module(s, token, &options.exclude);
+        else if (strcmp(token, "-include_range") == 0)
+            s = get_range(s, token, &options.include);
+        else if (strcmp(token, "-exclude_range") == 0)
+            s = get_range(s, token, &options.exclude);
+        else if (strcmp(token, "-quarantine_bytes") == 0)
+            s = get_uint(s, token, &options.quarantine_bytes);
+        else if (strcmp(token, "-quarantine_blocks") == 0)
+            s = get_uint(s, token, &options.quarantine_blocks);
+        else if (strcmp(token, "-guard_above") == 0)
+            s = get_uint(s, token, &options.guard_above);
+        else if (strcmp(token, "-redzone_min") == 0)
+            s = get_uint(s, token, &options.redzone_min);
+        else if (strcmp(token, "-redzone_max") == 0)
+            s = get_uint(s, token, &options.redzone_max);
+        else if (strcmp(token, "-redzone_budget_mb") == 0)
+            s = get_uint(s, token, &options.redzone_budget_mb);
+        else if (strcmp(token, "-sample") == 0)
+            s = get_uint(s, token, &options.sample);
+        else if (strcmp(token, "-replace_malloc") == 0)
+            options.replace_malloc = true;
+        else if (strcmp(token, "-arena_mb") == 0)
+            s = get_uint(s, token, &options.arena_mb);
+        else if (strcmp(token, "-malloc_name") == 0)
+            s = get_wrap_name(s, token, &options.malloc_names);
+        else if (strcmp(token, "-free_name") == 0)
+            s = get_wrap_name(s, token, &options.free_names);
+        else if (strcmp(token, "-start_at") == 0)
+            s = get_symbol(s, token, options.start_at);
+        else if (strcmp(token, "-start_paused") == 0)
+            options.start_paused = true;
+        else if (strcmp(token, "-symcache") == 0)
+            s = get_path(s, token, options.symcache);
+        else if (strcmp(token, "-persist") == 0)
+            options.persist = true;
+        else if (strcmp(token, "-stats_file") == 0)
+            s = get_path(s, token, options.stats_file);
+        else if (strcmp(token, "-stats_json") == 0)
+            s = get_path(s, token, options.stats_json);
+        else if (strcmp(token, "-stats_interval") == 0)
+            s = get_uint(s, token, &options.stats_interval_ms);
+        else if (strcmp(token, "-event_log") == 0)
+            s = get_path(s, token, options.event_log);
+        else
+            usage(token);
+    }
+
+    if (options.adaptive_writes_after == 0)
+        usage("-adaptive_writes 0");
+    // Adaptive blocks point into this run's block records.
+    if (options.persist && options.adaptive)
+        usage("-persist with -adaptive");
+    // So do hoisted checks, into this run's thread-local slots.
+    if (options.persist && options.hoist_loops)
+        usage("-persist with -hoist_loops");
+    if (options.persist && options.shadow_stack)
+        usage("-persist with -shadow_stack");
+    // Persisted blocks would come back built for the wrong mode.
+    if (options.persist && (options.start_at[0] != '\0' || options.start_paused))
+        usage("-persist with -start_at or -start_paused");
+    // Sampling decides per block which ones are guarded.
+    if (options.sample > 0 && options.guard_above > 0)
+        usage("-sample with -guard_above");
+    if (options.sample > 0 && options.replace_malloc)
+        usage("-sample with -replace_malloc");
+    // Redzones are whole shadow granules, and sizes are kept in a ushort.
+    if (options.redzone_min == 0 || options.redzone_min % 8 != 0)
+        usage("-redzone_min");
+    if (options.redzone_max % 8 != 0 || options.redzone_max < options.redzone_min
+            || options.redzone_max > 32768)
+        usage("-redzone_max");
+    if (options.arena_mb == 0)
+        usage("-arena_mb 0");
+    if (options.stats_interval_ms == 0)
+        usage("-stats_interval 0");
+    default_wrap_name(&options.malloc_names, "tmalloc");
+    default_wrap_name(&options.free_names, "tfree");
+    DEBUG("adaptive %d (writes after %u, none after %u)\n", options.adaptive,
+            options.adaptive_writes_after, options.adaptive_none_after);
+}
+
+/* Reads the number following option name. */
+static const char *
+get_uint(const char *s, const char *name, uint *val)
+{
+    char token[32];
+
+    s = dr_get_token(s, token, sizeof token);
+    if (s == NULL || dr_sscanf(token, "%u", val) != 1)
+        usage(name);
+    return s;
+}
+
+/* Reads the path following option name into path, MAXIMUM_PATH long. */
+static const char *
+get_path(const char *s, const char *name, char *path)
+{
+    s = dr_get_token(s, path, MAXIMUM_PATH);
+    if (s == NULL)
+        usage(name);
+    return s;
+}
+
+/* Reads the symbol name following option name into symbol, MAX_SYMBOL_NAME
+ * long. */
+static const char *
+get_symbol(const char *s, const char *name, char *symbol)
+{
+    s = dr_get_token(s, symbol, MAX_SYMBOL_NAME);
+    if (s == NULL)
+        usage(name);
+    return s;
+}
+
+/* Adds the symbol name following option name to list. */
+static const char *
+get_wrap_name(const char *s, const char *name, wrap_list_t *list)
+{
+    if (list->num_names == MAX_WRAP_NAMES)
+        usage(name);
+    s = dr_get_token(s, list->names[list->num_names], MAX_SYMBOL_NAME);
+    if (s == NULL)
+        usage(name);
+    list->num_names++;
+    return s;
+}
+
+static void
+default_wrap_name(wrap_list_t *list, const char *name)
+{
+    if (list->num_names == 0) {
+        strcpy(list->names[0], name);
+        list->num_names = 1;
+    }
+}
+
+/* Adds the module name following option name to list. */
+static const char *
+get_module(const char *s, const char *name, scope_list_t *list)
+{
+    if (list->num_modules == MAX_SCOPE_ENTRIES)
+        usage(name);
+    s = dr_get_token(s, list->modules[list->num_modules], MAX_MODULE_NAME);
+    if (s == NULL)
+        usage(name);
+    list->num_modules++;
+    return s;
+}
+
+/* Adds the START-END range (hex, END exclusive) following option name to
+ * list. */
+static const char *
+get_range(const char *s, const char *name, scope_list_t *list)
+{
+    char token[64];
+    const char *p = token;
+    ptr_uint_t start, end;
+
+    s = dr_get_token(s, token, sizeof token);
+    if (s == NULL || list->num_ranges == MAX_SCOPE_ENTRIES
+            || ! parse_hex(&p, &start) || *p++ != '-'
+            || ! parse_hex(&p, &end) || *p != '\0' || end <= start)
+        usage(name);
+    list->ranges[list->num_ranges].start = (app_pc)start;
+    list->ranges[list->num_ranges].end = (app_pc)end;
+    list->num_ranges++;
+    return s;
+}
+
+/* Reads a hex number, with or without 0x, advancing *s past it. */
+static bool
+parse_hex(const char **s, ptr_uint_t *val)
+{
+    const char *p = *s;
+    int digits = 0;
+
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        p += 2;
+    for (*val = 0; ; p++, digits++) {
+        int d;
+        if (*p >= '0' && *p <= '9')
+            d = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            d = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            d = *p - 'A' + 10;
+        else
+            break;
+        *val = *val * 16 + d;
+    }
+    *s = p;
+    return digits > 0;
+}
+
+static void
+usage(const char *bad)
+{
+    dr_fprintf(STDERR, "shady: bad option %s\n"
+            "options:\n"
+            "  -adaptive            check blocks that keep running clean less\n"
+            "  -adaptive_writes N   clean runs before only writes are checked\n"
+            "  -adaptive_none N     further clean runs before nothing is\n"
+            "                       (0: never)\n"
+            "  -hoist_loops         check strided loop accesses a range at\n"
+            "                       a time\n"
+            "  -shadow_stack        repair overwritten return addresses\n"
+            "  -include_module NAME only check modules named NAME* (and\n"
+            "                       any -include_range)\n"
+            "  -exclude_module NAME never check modules named NAME*\n"
+            "  -include_range S-E   only check code in [S, E) (hex)\n"
+            "  -exclude_range S-E   never check code in [S, E) (hex)\n"
+            "  -quarantine_bytes N  hold up to N freed bytes back from reuse\n"
+            "                       (default 16 MB, 0: no quarantine)\n"
+            "  -quarantine_blocks N hold up to N freed blocks (default\n"
+            "                       4096, 0: no quarantine)\n"
+            "  -guard_above N       end heap blocks of N bytes or more\n"
+            "                       against a guard page (0: never)\n"
+            "  -redzone_min N       smallest post-redzone of a heap block\n"
+            "                       (default 8, a multiple of 8)\n"
+            "  -redzone_max N       largest an allocation site's post-\n"
+            "                       redzone grows to (default 256)\n"
+            "  -redzone_budget_mb N live redzone bytes past which blocks\n"
+            "                       get the smallest (default 64)\n"
+            "  -sample N            guard only one allocation in N and\n"
+            "                       check nothing inline (0: off)\n"
+            "  -replace_malloc      allocate from Shady's own arena instead\n"
+            "                       of wrapping malloc\n"
+            "  -arena_mb N          address space the arena reserves\n"
+            "                       (default 1024)\n"
+            "  -malloc_name NAME    wrap symbol NAME as malloc (default\n"
+            "                       tmalloc)\n"
+            "  -free_name NAME      wrap symbol NAME as free (default tfree)\n"
+            "  -start_at NAME       don't check anything until function\n"
+            "                       NAME runs\n"
+            "  -start_paused        don't check anything until a nudge\n"
+            "                       (nudges toggle checking)\n"
+            "  -symcache PATH       remember symbol lookups in PATH\n"
+            "  -persist             make instrumented code persistable\n"
+            "                       (with drrun -persist)\n"
+            "  -stats_file PATH     keep live counters in a page mapped\n"
+            "                       from PATH (see tools/shady_stat)\n"
+            "  -stats_json PATH     write the final counters as JSON\n"
+            "                       (-: stderr)\n"
+            "  -stats_interval MS   refresh the stats page every MS ms\n"
+            "  -event_log PATH      log every skipped write, made-up read\n"
+            "                       and repair to PATH (see\n"
+            "                       tools/shady_events)\n", bad);
+    dr_abort();
+}
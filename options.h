@@ -0,0 +1,99 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <dr_api.h>
+
+#define MAX_SCOPE_ENTRIES 32
+#define MAX_MODULE_NAME 64
+#define MAX_WRAP_NAMES 16
+#define MAX_SYMBOL_NAME 128
+
+typedef struct {
+    app_pc start;
+    app_pc end;
+} addr_range_t;
+
+/* Modules and address ranges given with -include_* or -exclude_*. */
+typedef struct {
+    char modules[MAX_SCOPE_ENTRIES][MAX_MODULE_NAME];
+    int num_modules;
+    addr_range_t ranges[MAX_SCOPE_ENTRIES];
+    int num_ranges;
+} scope_list_t;
+
+/* Functions wrapped as malloc or free, found through symbols. */
+typedef struct {
+    char names[MAX_WRAP_NAMES][MAX_SYMBOL_NAME];
+    int num_names;
+} wrap_list_t;
+
+/* Client options, given after the client path on the drrun command line. */
+typedef struct {
+    /* -adaptive: lighten the checks on blocks that keep running clean. */
+    bool adaptive;
+    /* -adaptive_writes N: clean executions before only writes are checked. */
+    uint adaptive_writes_after;
+    /* -adaptive_none N: further clean executions before nothing is checked;
+     * 0 keeps checking writes for good. */
+    uint adaptive_none_after;
+    /* -hoist_loops: check strided accesses in simple loops a range at a
+     * time; can't be combined with -persist. */
+    bool hoist_loops;
+    /* -shadow_stack: keep a shadow stack of return addresses and repair
+     * overwritten ones; can't be combined with -persist. */
+    bool shadow_stack;
+    /* -include_module NAME, -include_range START-END: if any are given,
+     * only this code is checked. */
+    scope_list_t include;
+    /* -exclude_module NAME, -exclude_range START-END: code never checked. */
+    scope_list_t exclude;
+    /* -quarantine_bytes N, -quarantine_blocks N: how much freed memory is
+     * held back from reuse.  On by default; 0 for either turns it off. */
+    uint quarantine_bytes;
+    uint quarantine_blocks;
+    /* -guard_above N: heap blocks of N bytes or more end against a guard
+     * page instead of a redzone; 0 for none. */
+    uint guard_above;
+    /* -redzone_min N, -redzone_max N: bounds of the post-redzone each
+     * allocation site gets, which grows with overflows off its blocks;
+     * -redzone_budget_mb N: live redzone bytes past which new blocks get
+     * the minimum. */
+    uint redzone_min;
+    uint redzone_max;
+    uint redzone_budget_mb;
+    /* -sample N: only about one allocation in N gets a guard page, and
+     * nothing is checked inline; 0 for off. */
+    uint sample;
+    /* -replace_malloc: replace the allocator with Shady's own arena instead
+     * of wrapping it; -arena_mb N: how much address space it reserves. */
+    bool replace_malloc;
+    uint arena_mb;
+    /* -malloc_name NAME, -free_name NAME: extra allocator entry points,
+     * looked up by symbol; tmalloc and tfree if none are given. */
+    wrap_list_t malloc_names;
+    wrap_list_t free_names;
+    /* -start_at NAME: run unchecked until function NAME is called;
+     * -start_paused: until a nudge.  Nudges toggle checking either way. */
+    char start_at[MAX_SYMBOL_NAME];
+    bool start_paused;
+    /* -symcache PATH: keep symbol lookups in PATH across runs. */
+    char symcache[MAXIMUM_PATH];
+    /* -persist: make the instrumented code persistable (drrun -persist);
+     * can't be combined with -adaptive. */
+    bool persist;
+    /* -stats_file PATH: keep live counters in a page mapped from PATH. */
+    char stats_file[MAXIMUM_PATH];
+    /* -stats_json PATH: write the final counters as JSON ("-": stderr). */
+    char stats_json[MAXIMUM_PATH];
+    /* -stats_interval MS: how often the stats page is refreshed. */
+    uint stats_interval_ms;
+    /* -event_log PATH: log every oblivious action to PATH, in binary (see
+     * event_log.h and tools/shady_events). */
+    char event_log[MAXIMUM_PATH];
+} shady_options_t;
+
+extern shady_options_t options;
+
+void options_init(client_id_t id);
+
+#endif // OPTIONS_H
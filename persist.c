@@ -0,0 +1,121 @@
+#include "persist.h"
+
+#include "defines.h"
+#include "options.h"
+
+/* Bump whenever the instrumentation changes shape. */
+#define PERSIST_VERSION 2
+#define PERSIST_MAGIC 0x53594450    /* "PDYS" */
+
+/* What Shady adds to each persisted cache.  The code calls into the
+ * client and reads its shadow table, so it is only good for the same
+ * client build loaded at the same address.  It also passes the callbacks
+ * absolute application pcs, so it is only good for the module loaded
+ * where it was when the cache was made. */
+typedef struct {
+    uint magic;
+    uint version;
+    uint64 config_hash;
+    uint64 client_hash;
+    app_pc client_base;
+    app_pc start;
+} persist_header_t;
+
+static persist_header_t header;
+
+static size_t persist_size(void *drcontext, void *perscxt, size_t file_offs,
+        void **user_data);
+static bool persist_write(void *drcontext, void *perscxt, file_t fd, void *user_data);
+static bool persist_resurrect(void *drcontext, void *perscxt, byte **map);
+static uint64 hash_bytes(uint64 h, const void *p, size_t size);
+static bool hash_file(const char *path, uint64 *hash);
+
+void
+persist_init(client_id_t id)
+{
+    if (! options.persist)
+        return;
+
+    header.magic = PERSIST_MAGIC;
+    header.version = PERSIST_VERSION;
+    header.client_base = dr_get_client_base(id);
+    // Unused option bytes are zero, so the struct hashes as a whole.
+    header.config_hash = hash_bytes(14695981039346656037ULL, &options,
+            sizeof options);
+
+    // Without the checks, code must not be persisted at all.
+    if (! hash_file(dr_get_client_path(id), &header.client_hash)
+            || ! dr_register_persist_ro(persist_size, persist_write, persist_resurrect)) {
+        dr_fprintf(STDERR, "shady: can't persist code caches\n");
+        options.persist = false;
+    }
+}
+
+static size_t
+persist_size(void *drcontext, void *perscxt, size_t file_offs, void **user_data)
+{
+    *user_data = NULL;
+    return sizeof header;
+}
+
+static bool
+persist_write(void *drcontext, void *perscxt, file_t fd, void *user_data)
+{
+    persist_header_t h = header;
+
+    h.start = dr_persist_start(perscxt);
+    return dr_write_file(fd, &h, sizeof h) == (ssize_t)sizeof h;
+}
+
+/* Accepts a cache only if it was made by this same client build loaded at
+ * the same address, under the same options, for code that hasn't moved. */
+static bool
+persist_resurrect(void *drcontext, void *perscxt, byte **map)
+{
+    persist_header_t *saved = (persist_header_t *)*map;
+
+    *map += sizeof header;
+    if (saved->magic != header.magic || saved->version != header.version
+            || saved->config_hash != header.config_hash
+            || saved->client_hash != header.client_hash
+            || saved->client_base != header.client_base
+            || saved->start != dr_persist_start(perscxt)) {
+        DEBUG("Rejecting persisted cache at %p: stale configuration\n",
+                dr_persist_start(perscxt));
+        return false;
+    }
+    DEBUG("Using persisted cache at %p\n", dr_persist_start(perscxt));
+    return true;
+}
+
+/* Hashes the contents of the file at path, which tells client builds apart
+ * even when they load at the same address. */
+static bool
+hash_file(const char *path, uint64 *hash)
+{
+    byte buf[4096];
+    ssize_t n;
+    file_t f;
+
+    if (path == NULL || (f = dr_open_file(path, DR_FILE_READ)) == INVALID_FILE)
+        return false;
+    *hash = 14695981039346656037ULL;
+    while ((n = dr_read_file(f, buf, sizeof buf)) > 0)
+        *hash = hash_bytes(*hash, buf, n);
+    dr_close_file(f);
+    return n == 0;
+}
+
+/* FNV-1a. */
+static uint64
+hash_bytes(uint64 h, const void *p, size_t size)
+{
+    const byte *b = p;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        h ^= b[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
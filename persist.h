@@ -0,0 +1,14 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <dr_api.h>
+
+/* With -persist, the instrumented code of each module may be saved in
+ * DynamoRIO's persisted code caches (drrun -persist) and reloaded by later
+ * runs.  Every cache carries a hash of the client's configuration and of
+ * the client library, and a cache made under different options, by a
+ * different client build or for a module since loaded elsewhere is
+ * rejected.  DynamoRIO itself drops caches of modules that changed. */
+void persist_init(client_id_t id);
+
+#endif // PERSIST_H
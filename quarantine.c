@@ -0,0 +1,97 @@
+#include "quarantine.h"
+
+#include "defines.h"
+#include "options.h"
+
+/* A ring of -quarantine_blocks entries, oldest at head. */
+static quarantine_entry_t *ring;
+static uint capacity;
+static uint head;
+static uint count;
+static ptr_uint_t bytes;
+static void *quarantine_lock;
+
+/* High-water marks, for the exit summary. */
+static uint max_count;
+static ptr_uint_t max_bytes;
+
+void
+quarantine_init(void)
+{
+    quarantine_lock = dr_mutex_create();
+    if (options.quarantine_blocks > 0 && options.quarantine_bytes > 0) {
+        capacity = options.quarantine_blocks;
+        ring = dr_global_alloc(capacity * sizeof(quarantine_entry_t));
+    }
+}
+
+void
+quarantine_exit(void)
+{
+    DEBUG("Quarantine: at most %u blocks, %lu bytes\n", max_count,
+            (unsigned long)max_bytes);
+    // Whatever is still queued goes away with the process.
+    if (ring != NULL)
+        dr_global_free(ring, capacity * sizeof(quarantine_entry_t));
+    dr_mutex_destroy(quarantine_lock);
+}
+
+bool
+quarantine_accepts(ptr_uint_t size)
+{
+    // A block bigger than the whole budget would only flush everything else.
+    return ring != NULL && size <= options.quarantine_bytes;
+}
+
+/* Evicting down to a low-water mark rather than just enough for the new
+ * block means most frees don't evict at all.  A wrapped free can only hand
+ * the allocator one block, so it passes a max of 1.  When dropping max
+ * blocks wouldn't make room for the new one, the new one is given back
+ * instead, so neither budget is ever exceeded. */
+uint
+quarantine_push(void *user, ptr_uint_t size, quarantine_entry_t *evicted, uint max)
+{
+    uint blocks = options.quarantine_blocks;
+    ptr_uint_t budget = options.quarantine_bytes;
+    ptr_uint_t freed = 0;
+    uint n = 0, i;
+
+    dr_mutex_lock(quarantine_lock);
+    if (count == blocks || bytes + size > budget) {
+        uint low_blocks = blocks - blocks / 4;
+        ptr_uint_t low_bytes = budget - budget / 4;
+
+        // As many of the oldest as it takes for user to fit at all...
+        while (n < max && n < count
+                && (count - n == blocks || bytes - freed + size > budget))
+            freed += ring[(head + n++) % capacity].size;
+        if (count - n == blocks || bytes - freed + size > budget) {
+            dr_mutex_unlock(quarantine_lock);
+            evicted[0].user = user;
+            evicted[0].size = size;
+            return 1;
+        }
+        // ...and on down to the low-water mark, as far as max allows.
+        while (n < max && n < count
+                && (count - n >= low_blocks || bytes - freed + size > low_bytes))
+            freed += ring[(head + n++) % capacity].size;
+
+        for (i = 0; i < n; i++) {
+            evicted[i] = ring[head];
+            head = (head + 1) % capacity;
+        }
+        count -= n;
+        bytes -= freed;
+    }
+
+    ring[(head + count) % capacity].user = user;
+    ring[(head + count) % capacity].size = size;
+    count++;
+    bytes += size;
+    if (count > max_count)
+        max_count = count;
+    if (bytes > max_bytes)
+        max_bytes = bytes;
+    dr_mutex_unlock(quarantine_lock);
+    return n;
+}
@@ -0,0 +1,33 @@
+#ifndef QUARANTINE_H
+#define QUARANTINE_H
+
+#include <dr_api.h>
+
+/* Freed heap blocks are held back from the allocator for a while, first in
+ * first out, so a dangling pointer keeps pointing at a redzone instead of
+ * at whatever the memory is reused for.  The queue is bounded by
+ * -quarantine_bytes and -quarantine_blocks, and is on by default. */
+
+/* Most blocks one push evicts. */
+#define QUARANTINE_BATCH 64
+
+typedef struct {
+    void *user;
+    ptr_uint_t size;
+} quarantine_entry_t;
+
+void quarantine_init(void);
+void quarantine_exit(void);
+
+/* Whether a freed block of size user bytes should be quarantined at all. */
+bool quarantine_accepts(ptr_uint_t size);
+
+/* Queues the freed block at user.  If that would take the quarantine over
+ * budget, the oldest blocks, up to max of them, are dequeued until it is
+ * back down to three quarters of both budgets; if dequeuing max isn't
+ * enough to make room, user itself is left out instead.  Returns how many
+ * blocks were put in evicted for the caller to really free. */
+uint quarantine_push(void *user, ptr_uint_t size, quarantine_entry_t *evicted,
+        uint max);
+
+#endif // QUARANTINE_H
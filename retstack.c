@@ -0,0 +1,267 @@
+#include "retstack.h"
+
+#include <drmgr.h>
+#include <stddef.h>
+
+#include "defines.h"
+#include "eventlog.h"
+#include "options.h"
+#include "stats.h"
+
+/* Entries are indexed by a 16-bit top, so pushing and popping wrap around
+ * with a movzx and never touch the flags.  Past that depth the oldest
+ * entries are overwritten, and their rets go unchecked. */
+#define DEPTH 65536
+
+/* sp is the stack pointer before the call, so the entry's return address
+ * lives at sp - sizeof(ptr), and an entry with sp at or below the current
+ * stack pointer belongs to a frame that is gone.  Index 0 stays empty. */
+typedef struct {
+    ushort top;
+    ptr_uint_t ret[DEPTH];
+    ptr_uint_t sp[DEPTH];
+} retstack_t;
+
+/* Fixed, since the registers are restored before the call or ret uses any
+ * of its own. */
+#define REG_STACK DR_REG_XBX
+#define REG_TOP DR_REG_XCX
+#define REG_TARGET DR_REG_XDX
+
+static int tls_idx;
+
+static void insert_load_top(void *drcontext, instrlist_t *bb, instr_t *where);
+static void insert_move_top(void *drcontext, instrlist_t *bb, instr_t *where, int delta);
+static opnd_t entry_field(size_t offset, opnd_size_t size);
+static void insert_push(void *drcontext, instrlist_t *bb, instr_t *call);
+static void insert_check(void *drcontext, instrlist_t *bb, instr_t *ret);
+static void ret_callback(app_pc pc);
+static void event_thread_init(void *drcontext);
+static void event_thread_exit(void *drcontext);
+
+void
+retstack_init(void)
+{
+    if (! options.shadow_stack)
+        return;
+    tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(tls_idx != -1);
+    drmgr_register_thread_init_event(event_thread_init);
+    drmgr_register_thread_exit_event(event_thread_exit);
+}
+
+void
+retstack_exit(void)
+{
+    if (options.shadow_stack)
+        drmgr_unregister_tls_field(tls_idx);
+}
+
+/* Raw memory, so the pages only get backed as deep as the stack goes. */
+static void
+event_thread_init(void *drcontext)
+{
+    retstack_t *rs = dr_raw_mem_alloc(sizeof(retstack_t),
+            DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+    DR_ASSERT(rs != NULL);
+    drmgr_set_tls_field(drcontext, tls_idx, rs);
+}
+
+static void
+event_thread_exit(void *drcontext)
+{
+    dr_raw_mem_free(drmgr_get_tls_field(drcontext, tls_idx), sizeof(retstack_t));
+}
+
+void
+retstack_instrument(void *drcontext, instrlist_t *bb)
+{
+    instr_t *instr;
+
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        if (! instr_ok_to_mangle(instr))
+            continue;
+        if (instr_is_call(instr))
+            insert_push(drcontext, bb, instr);
+        else if (instr_is_return(instr))
+            insert_check(drcontext, bb, instr);
+    }
+}
+
+/* Leaves REG_STACK pointing at the thread's stack and REG_TOP holding its
+ * top, after spilling them. */
+static void
+insert_load_top(void *drcontext, instrlist_t *bb, instr_t *where)
+{
+    dr_save_reg(drcontext, bb, where, REG_STACK, SPILL_SLOT_2);
+    dr_save_reg(drcontext, bb, where, REG_TOP, SPILL_SLOT_3);
+    drmgr_insert_read_tls_field(drcontext, tls_idx, bb, where, REG_STACK);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_movzx(drcontext,
+                opnd_create_reg(REG_TOP),
+                OPND_CREATE_MEM16(REG_STACK, offsetof(retstack_t, top))));
+}
+
+/* Moves the top by delta, wrapping, and stores it back. */
+static void
+insert_move_top(void *drcontext, instrlist_t *bb, instr_t *where, int delta)
+{
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext,
+                opnd_create_reg(REG_TOP),
+                opnd_create_base_disp(REG_TOP, DR_REG_NULL, 0, delta, OPSZ_lea)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_movzx(drcontext,
+                opnd_create_reg(REG_TOP),
+                opnd_create_reg(reg_resize_to_opsz(REG_TOP, OPSZ_2))));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st(drcontext,
+                OPND_CREATE_MEM16(REG_STACK, offsetof(retstack_t, top)),
+                opnd_create_reg(reg_resize_to_opsz(REG_TOP, OPSZ_2))));
+}
+
+/* The entry field at offset of the entry REG_TOP indexes. */
+static opnd_t
+entry_field(size_t offset, opnd_size_t size)
+{
+    return opnd_create_base_disp(REG_STACK, REG_TOP, sizeof(ptr_uint_t),
+            offset, size);
+}
+
+/*
+ *      spill   stack, top
+ *      mov     stack, <this thread's retstack_t>
+ *      movzx   top, word [stack + top]
+ *      lea     top, [top + 1]
+ *      movzx   top, top16
+ *      mov     word [stack + top], top16
+ *      mov     [stack + top * ptr + sp], xsp
+ *      mov     dword [stack + top * ptr + ret], <return address>    (x2 on 64-bit)
+ *      restore top, stack
+ *      call    ...
+ */
+static void
+insert_push(void *drcontext, instrlist_t *bb, instr_t *call)
+{
+    ptr_uint_t ret = (ptr_uint_t)instr_get_app_pc(call) + instr_length(drcontext, call);
+
+    insert_load_top(drcontext, bb, call);
+    insert_move_top(drcontext, bb, call, 1);
+    instrlist_meta_preinsert(bb, call, INSTR_CREATE_mov_st(drcontext,
+                entry_field(offsetof(retstack_t, sp), OPSZ_PTR),
+                opnd_create_reg(DR_REG_XSP)));
+    instrlist_meta_preinsert(bb, call, INSTR_CREATE_mov_st(drcontext,
+                entry_field(offsetof(retstack_t, ret), OPSZ_4),
+                OPND_CREATE_INT32((int)(uint)ret)));
+#ifdef X86_64
+    instrlist_meta_preinsert(bb, call, INSTR_CREATE_mov_st(drcontext,
+                entry_field(offsetof(retstack_t, ret) + 4, OPSZ_4),
+                OPND_CREATE_INT32((int)(uint)(ret >> 32))));
+#endif
+    dr_restore_reg(drcontext, bb, call, REG_TOP, SPILL_SLOT_3);
+    dr_restore_reg(drcontext, bb, call, REG_STACK, SPILL_SLOT_2);
+}
+
+/* Hand-written code may pass flags back across a ret, so they are kept.
+ *
+ *      spill   stack, top, target
+ *      mov     stack, <this thread's retstack_t>
+ *      movzx   top, word [stack + top]
+ *      mov     target, [xsp]
+ *      save    aflags
+ *      cmp     target, [stack + top * ptr + ret]
+ *      jne     mismatch
+ *      restore aflags
+ *      lea     top, [top - 1]
+ *      movzx   top, top16
+ *      mov     word [stack + top], top16
+ *      restore target, top, stack
+ *      jmp     done
+ *  mismatch:
+ *      restore aflags, target, top, stack
+ *      clean call ret_callback(pc)
+ *  done:
+ *      ret
+ */
+static void
+insert_check(void *drcontext, instrlist_t *bb, instr_t *ret)
+{
+    instr_t *mismatch = INSTR_CREATE_label(drcontext);
+    instr_t *done = INSTR_CREATE_label(drcontext);
+
+    insert_load_top(drcontext, bb, ret);
+    dr_save_reg(drcontext, bb, ret, REG_TARGET, SPILL_SLOT_4);
+    instrlist_meta_preinsert(bb, ret, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(REG_TARGET), OPND_CREATE_MEMPTR(DR_REG_XSP, 0)));
+    dr_save_arith_flags(drcontext, bb, ret, SPILL_SLOT_1);
+    instrlist_meta_preinsert(bb, ret, INSTR_CREATE_cmp(drcontext,
+                opnd_create_reg(REG_TARGET),
+                entry_field(offsetof(retstack_t, ret), OPSZ_PTR)));
+    instrlist_meta_preinsert(bb, ret, INSTR_CREATE_jcc(drcontext, OP_jne,
+                opnd_create_instr(mismatch)));
+    dr_restore_arith_flags(drcontext, bb, ret, SPILL_SLOT_1);
+    insert_move_top(drcontext, bb, ret, -1);
+    dr_restore_reg(drcontext, bb, ret, REG_TARGET, SPILL_SLOT_4);
+    dr_restore_reg(drcontext, bb, ret, REG_TOP, SPILL_SLOT_3);
+    dr_restore_reg(drcontext, bb, ret, REG_STACK, SPILL_SLOT_2);
+    instrlist_meta_preinsert(bb, ret, INSTR_CREATE_jmp(drcontext,
+                opnd_create_instr(done)));
+
+    instrlist_meta_preinsert(bb, ret, mismatch);
+    dr_restore_arith_flags(drcontext, bb, ret, SPILL_SLOT_1);
+    dr_restore_reg(drcontext, bb, ret, REG_TARGET, SPILL_SLOT_4);
+    dr_restore_reg(drcontext, bb, ret, REG_TOP, SPILL_SLOT_3);
+    dr_restore_reg(drcontext, bb, ret, REG_STACK, SPILL_SLOT_2);
+    dr_insert_clean_call(drcontext, bb, ret, (void *)ret_callback,
+            false /*no fp save*/, 1, OPND_CREATE_INTPTR(instr_get_app_pc(ret)));
+
+    instrlist_meta_preinsert(bb, ret, done);
+}
+
+/* A ret didn't match the top entry.  Entries for frames below the stack
+ * pointer were left by longjmp or unwinding and are dropped.  If the entry
+ * then on top was pushed for this very frame, its return address was
+ * overwritten: it is put back, unless what replaced it is code, which is
+ * taken to be deliberate (an unwinder landing pad, say).  A ret of a
+ * frame that wasn't called, like a signal handler's, is left alone. */
+static void
+ret_callback(app_pc pc)
+{
+    void *drcontext = dr_get_current_drcontext();
+    retstack_t *rs = drmgr_get_tls_field(drcontext, tls_idx);
+    thread_stats_t *stats = stats_thread(drcontext);
+    ushort top = rs->top;
+    ptr_uint_t target, expected;
+    uint prot;
+
+    dr_mcontext_t mc;
+    mc.size = sizeof(mc);
+    mc.flags = DR_MC_INTEGER | DR_MC_CONTROL;
+    dr_get_mcontext(drcontext, &mc);
+    stats->slow_path++;
+
+    if (! dr_safe_read((void *)mc.xsp, sizeof(target), &target, NULL))
+        return;
+
+    while (rs->sp[top] != 0 && rs->sp[top] <= mc.xsp) {
+        rs->sp[top] = 0;
+        top--;
+    }
+    rs->top = top;
+    if (rs->sp[top] != mc.xsp + sizeof(ptr_uint_t))
+        return;
+
+    expected = rs->ret[top];
+    rs->sp[top] = 0;
+    rs->top = top - 1;
+    if (target == expected)
+        return;
+    if (dr_query_memory((byte *)target, NULL, NULL, &prot)
+            && (prot & DR_MEMPROT_EXEC) != 0) {
+        DEBUG("Ret at %p goes to code at %p instead of %p\n", pc, target, expected);
+        return;
+    }
+
+    DEBUG("Return address of ret at %p overwritten with %p, restoring %p\n",
+            pc, target, expected);
+    dr_safe_write((void *)mc.xsp, sizeof(expected), &expected, NULL);
+    stats->repaired_returns++;
+    eventlog_record(drcontext, EVENT_REPAIRED_RETURN, pc, (app_pc)mc.xsp, target,
+            sizeof(target));
+}
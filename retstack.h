@@ -0,0 +1,18 @@
+#ifndef RETSTACK_H
+#define RETSTACK_H
+
+#include <dr_api.h>
+
+/* A per-thread shadow stack of return addresses (-shadow_stack).  Every
+ * call pushes where it will return to and every ret checks the address it
+ * is about to use against it, inline.  A return address that was
+ * overwritten with something that isn't code is put back before the ret
+ * runs.  Frames that longjmp or unwinding abandon are dropped the next
+ * time a ret doesn't match. */
+void retstack_init(void);
+void retstack_exit(void);
+
+/* Adds the push before each call in bb and the check before its ret. */
+void retstack_instrument(void *drcontext, instrlist_t *bb);
+
+#endif // RETSTACK_H
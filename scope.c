@@ -0,0 +1,136 @@
+#include "scope.h"
+
+#include <string.h>
+
+#include "defines.h"
+#include "options.h"
+
+/* Loaded modules named in an include or exclude list.  There are only ever
+ * a handful, so they are kept in a small array. */
+#define MAX_SCOPED_MODULES 64
+
+typedef struct {
+    app_pc start;
+    app_pc end;
+    bool include;
+} scoped_module_t;
+
+static scoped_module_t scoped_modules[MAX_SCOPED_MODULES];
+static int num_scoped_modules;
+static void *scope_lock;
+
+static void event_module_load(void *drcontext, const module_data_t *mod, bool loaded);
+static void event_module_unload(void *drcontext, const module_data_t *mod);
+static bool name_in_list(const char *name, scope_list_t *list);
+static bool in_ranges(app_pc pc, scope_list_t *list);
+
+void
+scope_init(void)
+{
+    scope_lock = dr_mutex_create();
+    if (options.include.num_modules > 0 || options.exclude.num_modules > 0) {
+        dr_register_module_load_event(event_module_load);
+        dr_register_module_unload_event(event_module_unload);
+    }
+}
+
+void
+scope_exit(void)
+{
+    dr_mutex_destroy(scope_lock);
+}
+
+bool
+scope_should_check(app_pc pc)
+{
+    bool include_any = options.include.num_modules > 0
+        || options.include.num_ranges > 0;
+    bool included = ! include_any || in_ranges(pc, &options.include);
+    int i;
+
+    if (in_ranges(pc, &options.exclude))
+        return false;
+    if (options.include.num_modules == 0 && options.exclude.num_modules == 0)
+        return included;
+
+    dr_mutex_lock(scope_lock);
+    for (i = 0; i < num_scoped_modules; i++) {
+        scoped_module_t *m = &scoped_modules[i];
+        if (pc < m->start || pc >= m->end)
+            continue;
+        if (! m->include) {
+            dr_mutex_unlock(scope_lock);
+            return false;
+        }
+        included = true;
+    }
+    dr_mutex_unlock(scope_lock);
+    return included;
+}
+
+static void
+event_module_load(void *drcontext, const module_data_t *mod, bool loaded)
+{
+    const char *name = dr_module_preferred_name(mod);
+    bool include, exclude;
+
+    if (name == NULL)
+        return;
+    include = name_in_list(name, &options.include);
+    exclude = name_in_list(name, &options.exclude);
+    if (! include && ! exclude)
+        return;
+
+    DEBUG("%s %s (%p-%p)\n", exclude ? "Not checking" : "Checking", name,
+            mod->start, mod->end);
+    dr_mutex_lock(scope_lock);
+    if (num_scoped_modules < MAX_SCOPED_MODULES) {
+        scoped_module_t *m = &scoped_modules[num_scoped_modules++];
+        m->start = mod->start;
+        m->end = mod->end;
+        m->include = ! exclude;
+    } else {
+        dr_fprintf(STDERR, "shady: too many scoped modules, %s is checked\n", name);
+    }
+    dr_mutex_unlock(scope_lock);
+}
+
+static void
+event_module_unload(void *drcontext, const module_data_t *mod)
+{
+    int i;
+
+    dr_mutex_lock(scope_lock);
+    for (i = 0; i < num_scoped_modules; i++) {
+        if (scoped_modules[i].start == mod->start) {
+            scoped_modules[i] = scoped_modules[--num_scoped_modules];
+            break;
+        }
+    }
+    dr_mutex_unlock(scope_lock);
+}
+
+/* Names match on a prefix, so "libc.so" covers "libc.so.6". */
+static bool
+name_in_list(const char *name, scope_list_t *list)
+{
+    int i;
+
+    for (i = 0; i < list->num_modules; i++) {
+        if (strncmp(name, list->modules[i], strlen(list->modules[i])) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool
+in_ranges(app_pc pc, scope_list_t *list)
+{
+    int i;
+
+    for (i = 0; i < list->num_ranges; i++) {
+        if (pc >= list->ranges[i].start && pc < list->ranges[i].end)
+            return true;
+    }
+    return false;
+}
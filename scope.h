@@ -0,0 +1,13 @@
+#ifndef SCOPE_H
+#define SCOPE_H
+
+#include <dr_api.h>
+
+/* Which code gets checked, from the -include_* and -exclude_* options. */
+void scope_init(void);
+void scope_exit(void);
+
+/* Whether the block at pc should be instrumented. */
+bool scope_should_check(app_pc pc);
+
+#endif // SCOPE_H
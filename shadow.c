@@ -0,0 +1,235 @@
+#include "shadow.h"
+
+#include "defines.h"
+
+/* Each table entry points at the shadow for one chunk; chunks that have
+ * never been poisoned share a single read-only chunk of zeroes, so a lookup
+ * never has to test for NULL. */
+#ifdef X86_64
+#define ADDRESS_BITS 47
+#else
+#define ADDRESS_BITS 32
+#endif
+
+#define CHUNK_SHADOW_SIZE (CHUNK_SIZE >> SHADOW_SCALE)
+#define CHUNK_ALLOC_SIZE (CHUNK_SHADOW_SIZE + SHADOW_PADDING)
+#define TABLE_SIZE ((ptr_uint_t)1 << (ADDRESS_BITS - CHUNK_BITS))
+#define TABLE_MASK (TABLE_SIZE - 1)
+
+static byte *shadow_table[TABLE_SIZE];
+static byte *zero_chunk;
+static void *chunk_lock;
+static volatile uint generation = 1;
+
+static byte *shadow_byte_for_write(app_pc addr);
+
+void
+shadow_init(void)
+{
+    ptr_uint_t i;
+
+    zero_chunk = dr_raw_mem_alloc(CHUNK_ALLOC_SIZE, DR_MEMPROT_READ, NULL);
+    DR_ASSERT(zero_chunk != NULL);
+    for (i = 0; i < TABLE_SIZE; i++)
+        shadow_table[i] = zero_chunk;
+
+    chunk_lock = dr_mutex_create();
+}
+
+void
+shadow_exit(void)
+{
+    ptr_uint_t i;
+
+    for (i = 0; i < TABLE_SIZE; i++) {
+        if (shadow_table[i] != zero_chunk)
+            dr_raw_mem_free(shadow_table[i], CHUNK_ALLOC_SIZE);
+        shadow_table[i] = NULL;
+    }
+    dr_raw_mem_free(zero_chunk, CHUNK_ALLOC_SIZE);
+    dr_mutex_destroy(chunk_lock);
+}
+
+static inline byte *
+shadow_byte(app_pc addr)
+{
+    ptr_uint_t a = (ptr_uint_t)addr;
+    return shadow_table[(a >> CHUNK_BITS) & TABLE_MASK]
+        + ((a & CHUNK_MASK) >> SHADOW_SCALE);
+}
+
+/* Returns the shadow byte for addr, giving its chunk real storage first. */
+static byte *
+shadow_byte_for_write(app_pc addr)
+{
+    ptr_uint_t idx = ((ptr_uint_t)addr >> CHUNK_BITS) & TABLE_MASK;
+
+    if (shadow_table[idx] == zero_chunk) {
+        dr_mutex_lock(chunk_lock);
+        if (shadow_table[idx] == zero_chunk) {
+            byte *chunk = dr_raw_mem_alloc(CHUNK_ALLOC_SIZE,
+                    DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+            DR_ASSERT(chunk != NULL);
+            DEBUG("new shadow chunk %p for %p\n", chunk, addr);
+            shadow_table[idx] = chunk;
+        }
+        dr_mutex_unlock(chunk_lock);
+    }
+    return shadow_byte(addr);
+}
+
+void
+shadow_poison(app_pc start, size_t size, byte value)
+{
+    ptr_uint_t a = ((ptr_uint_t)start + SHADOW_GRANULE - 1) & ~(SHADOW_GRANULE - 1);
+    ptr_uint_t end = ((ptr_uint_t)start + size) & ~(SHADOW_GRANULE - 1);
+    bool was_addressable = false;
+
+    for (; a < end; a += SHADOW_GRANULE) {
+        byte *s = shadow_byte_for_write((app_pc)a);
+        if ((*s & 0x80) == 0)
+            was_addressable = true;
+        *s = value;
+    }
+    // Poisoning what already was changes nothing a loop check relied on.
+    if (was_addressable)
+        dr_atomic_add32_return_sum((volatile int *)&generation, 1);
+}
+
+void
+shadow_unpoison(app_pc start, size_t size)
+{
+    ptr_uint_t a = (ptr_uint_t)start;
+    ptr_uint_t end = a + size;
+
+    DR_ASSERT(a % SHADOW_GRANULE == 0);
+    for (; a + SHADOW_GRANULE <= end; a += SHADOW_GRANULE) {
+        // Untouched chunks are already all zeroes.
+        if (*shadow_byte((app_pc)a) != SHADOW_ADDRESSABLE)
+            *shadow_byte_for_write((app_pc)a) = SHADOW_ADDRESSABLE;
+    }
+    if (a < end)
+        *shadow_byte_for_write((app_pc)a) = (byte)(end - a);
+}
+
+uint
+shadow_generation(void)
+{
+    return generation;
+}
+
+volatile uint *
+shadow_generation_address(void)
+{
+    return &generation;
+}
+
+byte
+shadow_get(app_pc addr)
+{
+    return *shadow_byte(addr);
+}
+
+bool
+shadow_is_addressable(app_pc addr, size_t size)
+{
+    ptr_uint_t a = (ptr_uint_t)addr;
+    ptr_uint_t end = a + (size == 0 ? 1 : size);
+
+    while (a < end) {
+        ptr_uint_t granule = a & ~(SHADOW_GRANULE - 1);
+        ptr_uint_t last = end < granule + SHADOW_GRANULE ?
+            end : granule + SHADOW_GRANULE;
+        byte v = *shadow_byte((app_pc)a);
+
+        if (v & 0x80)
+            return false;
+        // A partial granule only allows its first v bytes.
+        if (v != SHADOW_ADDRESSABLE && last - granule > v)
+            return false;
+        a = last;
+    }
+    return true;
+}
+
+app_pc
+shadow_first_unaddressable(app_pc addr, size_t size)
+{
+    ptr_uint_t a = (ptr_uint_t)addr;
+    ptr_uint_t end = a + size;
+
+    while (a < end) {
+        ptr_uint_t granule = a & ~(SHADOW_GRANULE - 1);
+        ptr_uint_t last;
+        byte v;
+
+        // Skip eight clean granules at a time while they share a chunk.
+        if (a == granule && end - a >= 8 * SHADOW_GRANULE
+                && (a & CHUNK_MASK) <= CHUNK_SIZE - 8 * SHADOW_GRANULE
+                && *(uint64 *)shadow_byte((app_pc)a) == 0) {
+            a += 8 * SHADOW_GRANULE;
+            continue;
+        }
+
+        last = end < granule + SHADOW_GRANULE ? end : granule + SHADOW_GRANULE;
+        v = *shadow_byte((app_pc)a);
+        if (v & 0x80)
+            return (app_pc)a;
+        if (v != SHADOW_ADDRESSABLE && last - granule > v)
+            return (app_pc)(a > granule + v ? a : granule + v);
+        a = last;
+    }
+    return NULL;
+}
+
+/*
+ *      mov     dst, addr
+ *      shr     dst, CHUNK_BITS
+ *      and     dst, TABLE_MASK                 (64-bit only)
+ *      mov     tmp, shadow_table
+ *      mov     dst, [tmp + dst * sizeof(ptr)]
+ *      mov     tmp, addr
+ *      and     tmp, CHUNK_MASK
+ *      shr     tmp, SHADOW_SCALE
+ *      lea     dst, [dst + tmp]
+ */
+void
+shadow_insert_lea(void *drcontext, instrlist_t *bb, instr_t *where,
+        reg_id_t addr, reg_id_t dst, reg_id_t tmp)
+{
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(dst), opnd_create_reg(addr)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_shr(drcontext,
+                opnd_create_reg(dst), OPND_CREATE_INT8(CHUNK_BITS)));
+#ifdef X86_64
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_and(drcontext,
+                opnd_create_reg(dst), OPND_CREATE_INT32(TABLE_MASK)));
+#endif
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_imm(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INTPTR(shadow_table)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(dst),
+                opnd_create_base_disp(tmp, dst, sizeof(ptr_uint_t), 0, OPSZ_PTR)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld(drcontext,
+                opnd_create_reg(tmp), opnd_create_reg(addr)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_and(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT32(CHUNK_MASK)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_shr(drcontext,
+                opnd_create_reg(tmp), OPND_CREATE_INT8(SHADOW_SCALE)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext,
+                opnd_create_reg(dst),
+                opnd_create_base_disp(dst, tmp, 1, 0, OPSZ_lea)));
+}
+
+/*
+ *      <dst = address of the shadow byte>
+ *      movzx   dst, byte [dst]
+ */
+void
+shadow_insert_load(void *drcontext, instrlist_t *bb, instr_t *where,
+        reg_id_t addr, reg_id_t dst, reg_id_t tmp)
+{
+    shadow_insert_lea(drcontext, bb, where, addr, dst, tmp);
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_movzx(drcontext,
+                opnd_create_reg(dst), OPND_CREATE_MEM8(dst, 0)));
+}
@@ -0,0 +1,61 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <dr_api.h>
+
+/* One shadow byte describes SHADOW_GRANULE bytes of application memory.
+ * 0 means the whole granule is addressable, 1..7 means only that many
+ * leading bytes are, and any value with the high bit set marks a redzone. */
+#define SHADOW_SCALE 3
+#define SHADOW_GRANULE (1 << SHADOW_SCALE)
+
+#define SHADOW_ADDRESSABLE 0x00
+#define SHADOW_HEAP_REDZONE 0xfa
+#define SHADOW_HEAP_HEADER 0xfb     // a heap block's header, see inst_malloc.c
+#define SHADOW_HEAP_FREED 0xfd      // a freed block in quarantine
+
+void shadow_init(void);
+void shadow_exit(void);
+
+/* Marks every granule lying entirely inside [start, start + size). */
+void shadow_poison(app_pc start, size_t size, byte value);
+/* start must be granule aligned; a trailing partial granule is encoded. */
+void shadow_unpoison(app_pc start, size_t size);
+
+/* Bumped by every shadow_poison() that covers a granule that was at least
+ * partly addressable, so a range found addressable is known to still be
+ * while the generation is unchanged. */
+uint shadow_generation(void);
+volatile uint *shadow_generation_address(void);
+
+byte shadow_get(app_pc addr);
+bool shadow_is_addressable(app_pc addr, size_t size);
+/* Returns the first byte of [addr, addr + size) that isn't addressable, or
+ * NULL if there is none. */
+app_pc shadow_first_unaddressable(app_pc addr, size_t size);
+
+/* Emits meta instructions loading the shadow byte for the address in addr
+ * into dst (zero-extended).  addr is preserved, tmp is clobbered, and so are
+ * the arithmetic flags. */
+void shadow_insert_load(void *drcontext, instrlist_t *bb, instr_t *where,
+        reg_id_t addr, reg_id_t dst, reg_id_t tmp);
+
+/* The address space is split into chunks of CHUNK_SIZE bytes, each with
+ * its own shadow. */
+#ifdef X86_64
+#define CHUNK_BITS 28
+#else
+#define CHUNK_BITS 24
+#endif
+#define CHUNK_SIZE ((ptr_uint_t)1 << CHUNK_BITS)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+
+/* Like shadow_insert_load(), but leaves the address of the shadow byte in
+ * dst.  The shadow of consecutive granules is contiguous within a chunk,
+ * and every chunk is followed by SHADOW_PADDING readable bytes, so a check
+ * may read a few shadow bytes at once without faulting. */
+#define SHADOW_PADDING 64
+void shadow_insert_lea(void *drcontext, instrlist_t *bb, instr_t *where,
+        reg_id_t addr, reg_id_t dst, reg_id_t tmp);
+
+#endif // SHADOW_H
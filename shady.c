@@ -1,12 +1,36 @@
 #include <dr_api.h>
+#include <drmgr.h>
 
+#include "adaptive.h"
+#include "eventlog.h"
 #include "inst_malloc.h"
 #include "inst_readwrite.h"
+#include "options.h"
+#include "persist.h"
+#include "quarantine.h"
+#include "retstack.h"
+#include "scope.h"
+#include "shadow.h"
+#include "stats.h"
+#include "symcache.h"
+#include "trigger.h"
 
 static void event_exit(void);
 DR_EXPORT void
 dr_init(client_id_t id)
 {
+    options_init(id);
+    persist_init(id);
+    drmgr_init();
+    stats_init();
+    eventlog_init();
+    shadow_init();
+    scope_init();
+    adaptive_init();
+    quarantine_init();
+    retstack_init();
+    symcache_init();
+    trigger_init(id);
     malloc_init(id);
     readwrite_init(id);
     dr_register_exit_event(event_exit);
@@ -18,5 +42,16 @@ dr_init(client_id_t id)
 static void
 event_exit()
 {
+    // The stats count checks through the block records.
+    stats_exit();
+    eventlog_exit();
+    adaptive_exit();
+    quarantine_exit();
+    retstack_exit();
+    trigger_exit();
+    symcache_exit();
+    scope_exit();
+    shadow_exit();
+    drmgr_exit();
     dr_printf("Exit.\n");
 }
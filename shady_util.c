@@ -19,6 +19,36 @@ align_ptr(app_pc addr)
     return (app_pc) (unaligned - unaligned % sizeof(ptr_int_t));
 }
 
+/* Classifies a memory operand by what it can provably address.  Only the
+ * stack pointer counts as a stack base: with -fomit-frame-pointer xbp is an
+ * ordinary register and may well hold a heap pointer. */
+opnd_class_t
+opnd_classify(opnd_t opnd)
+{
+    reg_id_t base, index;
+
+    if (opnd_is_far_memory_reference(opnd)) {
+        if (opnd_is_base_disp(opnd)
+                && opnd_get_base(opnd) == DR_REG_NULL
+                && opnd_get_index(opnd) == DR_REG_NULL)
+            return OPND_CLASS_TLS;
+        return OPND_CLASS_UNKNOWN;
+    }
+    if (! opnd_is_base_disp(opnd))
+        // Absolute and rip-relative addresses.
+        return OPND_CLASS_STATIC;
+
+    base = opnd_get_base(opnd);
+    index = opnd_get_index(opnd);
+    if (index != DR_REG_NULL)
+        return OPND_CLASS_UNKNOWN;
+    if (base == DR_REG_NULL)
+        return OPND_CLASS_STATIC;
+    if (reg_overlap(base, DR_REG_XSP))
+        return OPND_CLASS_STACK;
+    return OPND_CLASS_UNKNOWN;
+}
+
 void
 print_mem_registers(dr_mcontext_t * mc, const char * prefix)
 {
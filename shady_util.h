@@ -4,6 +4,18 @@
 bool is_stack_address(dr_mcontext_t*, app_pc);
 app_pc align_ptr(app_pc);
 
+// Operand classification.  Everything but OPND_CLASS_UNKNOWN is known not
+// to reach the heap.
+typedef enum {
+    OPND_CLASS_UNKNOWN,  // may point anywhere, including the heap
+    OPND_CLASS_STACK,    // relative to the stack pointer
+    OPND_CLASS_STATIC,   // absolute or pc-relative: globals and constants
+    OPND_CLASS_TLS,      // fixed offset from the fs/gs segment base
+    NUM_OPND_CLASSES
+} opnd_class_t;
+
+opnd_class_t opnd_classify(opnd_t);
+
 // Printing helpers.
 #define char_buf_size 128
 
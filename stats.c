@@ -0,0 +1,338 @@
+#include "stats.h"
+
+#include <dr_ir_macros.h>
+#include <drmgr.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "adaptive.h"
+#include "defines.h"
+#include "inst_malloc.h"
+#include "options.h"
+
+/* Every live thread's counters, so they can be summed while it runs. */
+typedef struct _stats_node_t {
+    thread_stats_t s;
+    struct _stats_node_t *prev, *next;
+} stats_node_t;
+
+static stats_node_t *live_threads;
+static int num_threads;
+/* Counters of threads that have exited. */
+static thread_stats_t retired;
+static void *stats_lock;
+static int tls_idx;
+
+static stats_page_t *page;
+static size_t page_size;
+static void *page_lock;
+
+/* The publisher thread's life, as for the event log's flush thread: it
+ * runs unless exit got there first, and once told to stop signals
+ * publish_done as it leaves. */
+#define PUBLISH_STARTING 0
+#define PUBLISH_RUNNING 1
+#define PUBLISH_STOPPING 2
+
+static volatile int publish_state = PUBLISH_STARTING;
+static void *publish_done;
+
+static void event_thread_init(void *drcontext);
+static void event_thread_exit(void *drcontext);
+static void add_stats(thread_stats_t *to, thread_stats_t *from);
+static void snapshot(stats_page_t *out);
+static void publish(void);
+static void stats_thread_main(void *arg);
+static bool map_page(void);
+static void write_json(void);
+
+bool
+stats_enabled(void)
+{
+    return options.stats_file[0] != '\0' || options.stats_json[0] != '\0';
+}
+
+void
+stats_init(void)
+{
+    stats_lock = dr_mutex_create();
+    page_lock = dr_mutex_create();
+    tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(tls_idx != -1);
+    drmgr_register_thread_init_event(event_thread_init);
+    drmgr_register_thread_exit_event(event_thread_exit);
+
+    if (options.stats_file[0] != '\0' && map_page()) {
+        publish_done = dr_event_create();
+        dr_create_client_thread(stats_thread_main, NULL);
+    }
+}
+
+void
+stats_exit(void)
+{
+    stats_page_t totals;
+
+    snapshot(&totals);
+    DEBUG("Slow path: "UINT64_FORMAT_STRING", skipped writes: "UINT64_FORMAT_STRING
+            ", manufactured reads: "UINT64_FORMAT_STRING", repaired returns: "
+            UINT64_FORMAT_STRING"\n", totals.slow_path, totals.skipped_writes,
+            totals.manufactured_reads, totals.repaired_returns);
+    DEBUG("Allocations: "UINT64_FORMAT_STRING", frees: "UINT64_FORMAT_STRING
+            ", live redzone bytes: "UINT64_FORMAT_STRING"\n",
+            totals.allocs, totals.frees, totals.redzone_bytes);
+    if (options.adaptive) {
+        DEBUG("Adaptive: "UINT64_FORMAT_STRING" promotions, "UINT64_FORMAT_STRING
+                " demotions, code bytes full "UINT64_FORMAT_STRING", writes "
+                UINT64_FORMAT_STRING", none "UINT64_FORMAT_STRING"\n",
+                totals.promotions, totals.demotions, totals.full_bytes,
+                totals.writes_bytes, totals.none_bytes);
+    }
+
+    if (page != NULL) {
+        // The publisher mustn't be in the page or holding page_lock once
+        // they go.
+        if (! __sync_bool_compare_and_swap(&publish_state, PUBLISH_STARTING,
+                    PUBLISH_STOPPING)) {
+            publish_state = PUBLISH_STOPPING;
+            dr_event_wait(publish_done);
+        }
+        dr_event_destroy(publish_done);
+        publish();
+        dr_unmap_file(page, page_size);
+    }
+    if (options.stats_json[0] != '\0')
+        write_json();
+
+    drmgr_unregister_tls_field(tls_idx);
+    dr_mutex_destroy(page_lock);
+    dr_mutex_destroy(stats_lock);
+}
+
+thread_stats_t *
+stats_thread(void *drcontext)
+{
+    return &((stats_node_t *)drmgr_get_tls_field(drcontext, tls_idx))->s;
+}
+
+void
+stats_insert_add_checks(void *drcontext, instrlist_t *bb, instr_t *where,
+        reg_id_t scratch, int n)
+{
+    int offs = offsetof(stats_node_t, s) + offsetof(thread_stats_t, checks);
+
+    drmgr_insert_read_tls_field(drcontext, tls_idx, bb, where, scratch);
+#ifdef X86_64
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_add(drcontext,
+                OPND_CREATE_MEM64(scratch, offs), OPND_CREATE_INT32(n)));
+#else
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_add(drcontext,
+                OPND_CREATE_MEM32(scratch, offs), OPND_CREATE_INT32(n)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_adc(drcontext,
+                OPND_CREATE_MEM32(scratch, offs + 4), OPND_CREATE_INT8(0)));
+#endif
+}
+
+static void
+event_thread_init(void *drcontext)
+{
+    // Global heap: the stats thread reads it.
+    stats_node_t *node = dr_global_alloc(sizeof(stats_node_t));
+    memset(&node->s, 0, sizeof(node->s));
+    drmgr_set_tls_field(drcontext, tls_idx, node);
+
+    dr_mutex_lock(stats_lock);
+    node->prev = NULL;
+    node->next = live_threads;
+    if (live_threads != NULL)
+        live_threads->prev = node;
+    live_threads = node;
+    num_threads++;
+    dr_mutex_unlock(stats_lock);
+}
+
+static void
+event_thread_exit(void *drcontext)
+{
+    stats_node_t *node = drmgr_get_tls_field(drcontext, tls_idx);
+
+    dr_mutex_lock(stats_lock);
+    add_stats(&retired, &node->s);
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        live_threads = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    num_threads--;
+    dr_mutex_unlock(stats_lock);
+
+    dr_global_free(node, sizeof(stats_node_t));
+}
+
+static void
+add_stats(thread_stats_t *to, thread_stats_t *from)
+{
+    to->checks += from->checks;
+    to->slow_path += from->slow_path;
+    to->skipped_writes += from->skipped_writes;
+    to->manufactured_reads += from->manufactured_reads;
+    to->repaired_returns += from->repaired_returns;
+    to->allocs += from->allocs;
+    to->frees += from->frees;
+    to->bytes_allocated += from->bytes_allocated;
+    to->bytes_freed += from->bytes_freed;
+}
+
+/* Sums every thread's counters, live and exited. */
+static void
+snapshot(stats_page_t *out)
+{
+    thread_stats_t sum;
+    stats_node_t *node;
+
+    dr_mutex_lock(stats_lock);
+    sum = retired;
+    for (node = live_threads; node != NULL; node = node->next)
+        add_stats(&sum, &node->s);
+    out->threads = num_threads;
+    dr_mutex_unlock(stats_lock);
+
+    out->magic = STATS_PAGE_MAGIC;
+    out->version = STATS_PAGE_VERSION;
+    out->pid = dr_get_process_id();
+    out->timestamp_ms = dr_get_milliseconds();
+    out->checks = sum.checks;
+    out->slow_path = sum.slow_path;
+    out->skipped_writes = sum.skipped_writes;
+    out->manufactured_reads = sum.manufactured_reads;
+    out->repaired_returns = sum.repaired_returns;
+    out->allocs = sum.allocs;
+    out->frees = sum.frees;
+    out->live_blocks = sum.allocs - sum.frees;
+    out->bytes_allocated = sum.bytes_allocated;
+    out->bytes_freed = sum.bytes_freed;
+    out->redzone_bytes = malloc_redzone_bytes();
+    out->grown_sites = malloc_grown_sites();
+    out->full_bytes = adaptive_tier_bytes(TIER_FULL);
+    out->writes_bytes = adaptive_tier_bytes(TIER_WRITES);
+    out->none_bytes = adaptive_tier_bytes(TIER_NONE);
+    out->promotions = adaptive_promotions();
+    out->demotions = adaptive_demotions();
+}
+
+/* Copies a fresh snapshot into the page under its sequence count. */
+static void
+publish(void)
+{
+    stats_page_t s;
+    uint64 seq;
+
+    snapshot(&s);
+
+    dr_mutex_lock(page_lock);
+    seq = page->sequence;
+    page->sequence = seq + 1;
+    __sync_synchronize();
+    s.sequence = seq + 1;
+    memcpy(page, &s, sizeof(s));
+    __sync_synchronize();
+    page->sequence = seq + 2;
+    dr_mutex_unlock(page_lock);
+}
+
+/* Never suspended, not even at exit, so that it can't be stopped halfway
+ * through publish() and stats_exit() can wait for it to finish. */
+static void
+stats_thread_main(void *arg)
+{
+    dr_client_thread_set_suspendable(false);
+    if (! __sync_bool_compare_and_swap(&publish_state, PUBLISH_STARTING,
+                PUBLISH_RUNNING))
+        return;
+    while (publish_state == PUBLISH_RUNNING) {
+        dr_sleep(options.stats_interval_ms);
+        publish();
+    }
+    dr_event_signal(publish_done);
+}
+
+/* Creates the stats file one page long and maps it shared. */
+static bool
+map_page(void)
+{
+    static const char zeroes[4096];
+    file_t f = dr_open_file(options.stats_file, DR_FILE_WRITE_OVERWRITE);
+
+    if (f == INVALID_FILE) {
+        dr_fprintf(STDERR, "shady: can't create %s\n", options.stats_file);
+        return false;
+    }
+    dr_write_file(f, zeroes, sizeof zeroes);
+    dr_close_file(f);
+
+    // Reopen for reading too, which mapping needs.
+    f = dr_open_file(options.stats_file, DR_FILE_READ | DR_FILE_WRITE_APPEND);
+    page_size = sizeof zeroes;
+    if (f != INVALID_FILE) {
+        page = dr_map_file(f, &page_size, 0, NULL,
+                DR_MEMPROT_READ | DR_MEMPROT_WRITE, 0);
+        dr_close_file(f);
+    }
+    if (page == NULL) {
+        dr_fprintf(STDERR, "shady: can't map %s\n", options.stats_file);
+        return false;
+    }
+    publish();
+    return true;
+}
+
+/* Writes the final totals as one JSON object, to stderr for "-". */
+static void
+write_json(void)
+{
+    stats_page_t s;
+    file_t f;
+
+    snapshot(&s);
+    if (strcmp(options.stats_json, "-") == 0)
+        f = STDERR;
+    else
+        f = dr_open_file(options.stats_json, DR_FILE_WRITE_OVERWRITE);
+    if (f == INVALID_FILE) {
+        dr_fprintf(STDERR, "shady: can't create %s\n", options.stats_json);
+        return;
+    }
+
+#define FIELD(name, last) "  \"" name "\": " UINT64_FORMAT_STRING last "\n"
+    dr_fprintf(f, "{\n"
+            FIELD("pid", ",")
+            FIELD("checks", ",")
+            FIELD("slow_path", ",")
+            FIELD("skipped_writes", ",")
+            FIELD("manufactured_reads", ",")
+            FIELD("repaired_returns", ",")
+            FIELD("allocs", ",")
+            FIELD("frees", ",")
+            FIELD("live_blocks", ",")
+            FIELD("bytes_allocated", ",")
+            FIELD("bytes_freed", ",")
+            FIELD("redzone_bytes", ",")
+            FIELD("grown_sites", ",")
+            FIELD("full_bytes", ",")
+            FIELD("writes_bytes", ",")
+            FIELD("none_bytes", ",")
+            FIELD("promotions", ",")
+            FIELD("demotions", "")
+            "}\n",
+            s.pid, s.checks, s.slow_path, s.skipped_writes,
+            s.manufactured_reads, s.repaired_returns, s.allocs, s.frees,
+            s.live_blocks,
+            s.bytes_allocated, s.bytes_freed, s.redzone_bytes, s.grown_sites,
+            s.full_bytes, s.writes_bytes, s.none_bytes, s.promotions,
+            s.demotions);
+#undef FIELD
+
+    if (f != STDERR)
+        dr_close_file(f);
+}
@@ -0,0 +1,35 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <dr_api.h>
+
+#include "stats_page.h"
+
+/* One thread's counters.  Only the owning thread writes them, with plain
+ * increments; the stats thread reads them as they are. */
+typedef struct {
+    uint64 checks;              // added to inline, per block run
+    uint64 slow_path;
+    uint64 skipped_writes;
+    uint64 manufactured_reads;
+    uint64 repaired_returns;
+    uint64 allocs;
+    uint64 frees;
+    uint64 bytes_allocated;
+    uint64 bytes_freed;
+} thread_stats_t;
+
+void stats_init(void);
+void stats_exit(void);
+
+/* Whether -stats_file or -stats_json asked for statistics. */
+bool stats_enabled(void);
+
+thread_stats_t *stats_thread(void *drcontext);
+
+/* Inserts before where an add of n to the running thread's checks count,
+ * using scratch.  The caller saves scratch and the arithmetic flags. */
+void stats_insert_add_checks(void *drcontext, instrlist_t *bb, instr_t *where,
+        reg_id_t scratch, int n);
+
+#endif // STATS_H
@@ -0,0 +1,47 @@
+#ifndef STATS_PAGE_H
+#define STATS_PAGE_H
+
+/* Layout of the file Shady keeps its live counters in (-stats_file).  Shared
+ * with tools/shady_stat.c, so it uses only standard types.
+ *
+ * The client rewrites the page every -stats_interval ms.  sequence is odd
+ * while an update is in progress: a reader copies the page and retries if
+ * sequence was odd or changed meanwhile. */
+
+#include <stdint.h>
+
+#define STATS_PAGE_MAGIC 0x59444853     /* "SHDY" */
+#define STATS_PAGE_VERSION 5
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    volatile uint64_t sequence;
+    uint64_t pid;
+    uint64_t timestamp_ms;      /* when the page was last written */
+    uint64_t threads;           /* application threads alive */
+
+    uint64_t checks;            /* inline checks executed (block granular) */
+    uint64_t slow_path;         /* callbacks entered from a check */
+    uint64_t skipped_writes;
+    uint64_t manufactured_reads;
+    uint64_t repaired_returns;  /* -shadow_stack */
+
+    uint64_t allocs;            /* blocks given redzones */
+    uint64_t frees;
+    uint64_t live_blocks;       /* allocs - frees: blocks being tracked */
+    uint64_t bytes_allocated;
+    uint64_t bytes_freed;
+    uint64_t redzone_bytes;     /* post-redzones of live blocks */
+    uint64_t grown_sites;       /* allocation sites with bigger redzones */
+
+    /* -adaptive: application code bytes instrumented at each tier, and how
+     * often blocks moved down a tier or were sent back to full checks. */
+    uint64_t full_bytes;
+    uint64_t writes_bytes;
+    uint64_t none_bytes;
+    uint64_t promotions;
+    uint64_t demotions;
+} stats_page_t;
+
+#endif // STATS_PAGE_H
@@ -0,0 +1,272 @@
+#include "symcache.h"
+
+#include <drsyms.h>
+#include <elf.h>
+#include <hashtable.h>
+#include <string.h>
+
+#include "defines.h"
+#include "options.h"
+
+#ifdef X86_64
+typedef Elf64_Ehdr elf_ehdr_t;
+typedef Elf64_Phdr elf_phdr_t;
+#else
+typedef Elf32_Ehdr elf_ehdr_t;
+typedef Elf32_Phdr elf_phdr_t;
+#endif
+
+/* One lookup result.  id is "<key> <s|e> <name> <path>", which is also how
+ * it appears in the file after the offset ("-" if not found). */
+typedef struct _symcache_entry_t {
+    struct _symcache_entry_t *next;
+    size_t alloc_size;
+    size_t offs;
+    bool found;
+    char id[1];
+} symcache_entry_t;
+
+static hashtable_t entries[1];
+static symcache_entry_t *all_entries;
+static bool dirty;
+static bool drsyms_started;
+static void *symcache_lock;
+
+static int hits;
+static int misses;
+
+static symcache_entry_t *add_entry(const char *id, bool found, size_t offs);
+static void free_entry(void *entry);
+static void load(void);
+static void save(void);
+static bool find_build_id(const module_data_t *mod, char *key, size_t size);
+
+void
+symcache_init(void)
+{
+    symcache_lock = dr_mutex_create();
+    hashtable_init_ex(entries,
+            8, /* 256 buckets initially */
+            HASH_STRING, /* keys are entry ids */
+            0, /* don't duplicate string keys: they live in the entry */
+            0, /* don't synchronize: symcache_lock covers it */
+            free_entry,
+            NULL, /* use default key hash fn */
+            NULL /* use default key cmp fn */
+            );
+    if (options.symcache[0] != '\0')
+        load();
+}
+
+void
+symcache_exit(void)
+{
+    DEBUG("Symbol cache: %d hits, %d misses\n", hits, misses);
+    if (options.symcache[0] != '\0' && dirty)
+        save();
+    hashtable_delete(entries);
+    if (drsyms_started)
+        drsym_exit();
+    dr_mutex_destroy(symcache_lock);
+}
+
+void
+symcache_module_key(const module_data_t *mod, char *key, size_t size)
+{
+    file_t f;
+    uint64 file_size = 0;
+
+    if (find_build_id(mod, key, size))
+        return;
+    f = dr_open_file(mod->full_path, DR_FILE_READ);
+    if (f != INVALID_FILE) {
+        dr_file_size(f, &file_size);
+        dr_close_file(f);
+    }
+    dr_snprintf(key, size, "size-"UINT64_FORMAT_STRING, file_size);
+    key[size - 1] = '\0';
+}
+
+bool
+symcache_lookup(const module_data_t *mod, const char *key, const char *name,
+        bool exported, size_t *offs)
+{
+    char id[SYMCACHE_KEY_SIZE + MAX_SYMBOL_NAME + MAXIMUM_PATH + 8];
+    symcache_entry_t *entry;
+    app_pc pc;
+    bool found;
+
+    if (mod->full_path == NULL || mod->full_path[0] == '\0')
+        return false;
+    dr_snprintf(id, sizeof id, "%s %c %s %s", key, exported ? 'e' : 's', name,
+            mod->full_path);
+    id[sizeof id - 1] = '\0';
+
+    dr_mutex_lock(symcache_lock);
+    entry = hashtable_lookup(entries, id);
+    if (entry != NULL) {
+        hits++;
+        found = entry->found;
+        *offs = entry->offs;
+        dr_mutex_unlock(symcache_lock);
+        return found;
+    }
+
+    misses++;
+    if (exported) {
+        pc = (app_pc)dr_get_proc_address(mod->start, name);
+        found = pc != NULL;
+        *offs = pc - mod->start;
+        // An export resolved outside the module can't be kept as an offset.
+        if (found && (pc < mod->start || pc >= mod->end)) {
+            dr_mutex_unlock(symcache_lock);
+            return true;
+        }
+    } else {
+        if (! drsyms_started) {
+            drsym_init(0);
+            drsyms_started = true;
+        }
+        found = drsym_lookup_symbol(mod->full_path, name, offs, 0) == DRSYM_SUCCESS;
+    }
+    add_entry(id, found, found ? *offs : 0);
+    dirty = true;
+    dr_mutex_unlock(symcache_lock);
+    return found;
+}
+
+/* Caller holds symcache_lock, or is the only thread. */
+static symcache_entry_t *
+add_entry(const char *id, bool found, size_t offs)
+{
+    size_t alloc_size = sizeof(symcache_entry_t) + strlen(id);
+    symcache_entry_t *entry = dr_global_alloc(alloc_size);
+
+    entry->alloc_size = alloc_size;
+    entry->found = found;
+    entry->offs = offs;
+    strcpy(entry->id, id);
+    if (! hashtable_add(entries, entry->id, entry)) {
+        free_entry(entry);
+        return NULL;
+    }
+    entry->next = all_entries;
+    all_entries = entry;
+    return entry;
+}
+
+static void
+free_entry(void *entry)
+{
+    dr_global_free(entry, ((symcache_entry_t *)entry)->alloc_size);
+}
+
+/* Reads the cache file, one "<offset|-> <id>" per line.  Lines that don't
+ * parse are dropped; they'll be looked up again. */
+static void
+load(void)
+{
+    file_t f = dr_open_file(options.symcache, DR_FILE_READ);
+    uint64 file_size;
+    char *buf, *line, *end;
+
+    if (f == INVALID_FILE)
+        return;
+    if (! dr_file_size(f, &file_size) || file_size == 0) {
+        dr_close_file(f);
+        return;
+    }
+    buf = dr_global_alloc(file_size + 1);
+    file_size = dr_read_file(f, buf, file_size);
+    dr_close_file(f);
+    buf[file_size] = '\0';
+
+    for (line = buf; *line != '\0'; line = end) {
+        char *id = strchr(line, ' ');
+        unsigned long offs;
+
+        end = strchr(line, '\n');
+        if (end == NULL)
+            end = line + strlen(line);
+        else
+            *end++ = '\0';
+        if (id == NULL || id > end)
+            continue;
+        *id++ = '\0';
+        if (strcmp(line, "-") == 0)
+            add_entry(id, false, 0);
+        else if (dr_sscanf(line, "%lx", &offs) == 1)
+            add_entry(id, true, offs);
+    }
+    dr_global_free(buf, file_size + 1);
+}
+
+static void
+save(void)
+{
+    file_t f = dr_open_file(options.symcache, DR_FILE_WRITE_OVERWRITE);
+    symcache_entry_t *entry;
+
+    if (f == INVALID_FILE) {
+        dr_fprintf(STDERR, "shady: can't write %s\n", options.symcache);
+        return;
+    }
+    for (entry = all_entries; entry != NULL; entry = entry->next) {
+        if (entry->found)
+            dr_fprintf(f, "%lx %s\n", (unsigned long)entry->offs, entry->id);
+        else
+            dr_fprintf(f, "- %s\n", entry->id);
+    }
+    dr_close_file(f);
+}
+
+/* Formats the GNU build id from mod's notes as hex into key.  The headers
+ * are read from where the module is mapped, so no file is opened. */
+static bool
+find_build_id(const module_data_t *mod, char *key, size_t size)
+{
+    elf_ehdr_t *ehdr = (elf_ehdr_t *)mod->start;
+    elf_phdr_t *phdr;
+    ptr_uint_t bias = 0, lowest = (ptr_uint_t)-1;
+    int i;
+
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+            || mod->start + ehdr->e_phoff + ehdr->e_phnum * sizeof(*phdr) > mod->end)
+        return false;
+    phdr = (elf_phdr_t *)(mod->start + ehdr->e_phoff);
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && phdr[i].p_vaddr < lowest)
+            lowest = phdr[i].p_vaddr;
+    }
+    if (lowest != (ptr_uint_t)-1)
+        bias = (ptr_uint_t)mod->start - ALIGN_BACKWARD(lowest, PAGE_SIZE);
+
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        byte *note, *notes_end;
+
+        if (phdr[i].p_type != PT_NOTE)
+            continue;
+        note = (byte *)(bias + phdr[i].p_vaddr);
+        notes_end = note + phdr[i].p_memsz;
+        if (note < mod->start || notes_end > mod->end)
+            continue;
+        while (note + sizeof(Elf32_Nhdr) <= notes_end) {
+            Elf32_Nhdr *nhdr = (Elf32_Nhdr *)note;
+            byte *name = note + sizeof(*nhdr);
+            byte *desc = name + ALIGN_FORWARD(nhdr->n_namesz, 4);
+            uint j;
+
+            if (desc + nhdr->n_descsz > notes_end)
+                break;
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+                    && memcmp(name, "GNU", 4) == 0 && nhdr->n_descsz * 2 < size) {
+                for (j = 0; j < nhdr->n_descsz; j++)
+                    dr_snprintf(key + j * 2, 3, "%02x", desc[j]);
+                key[j * 2] = '\0';
+                return true;
+            }
+            note = desc + ALIGN_FORWARD(nhdr->n_descsz, 4);
+        }
+    }
+    return false;
+}
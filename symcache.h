@@ -0,0 +1,24 @@
+#ifndef SYMCACHE_H
+#define SYMCACHE_H
+
+#include <dr_api.h>
+
+/* Symbol and export lookups in loaded modules, remembered across runs in
+ * the -symcache file.  Entries are keyed by the module's path and its
+ * build id (its file size if it has none), so a rebuilt module is looked
+ * up afresh.  drsyms is only started on a miss. */
+void symcache_init(void);
+void symcache_exit(void);
+
+#define SYMCACHE_KEY_SIZE 64
+
+/* Fills key with what identifies mod's contents. */
+void symcache_module_key(const module_data_t *mod, char *key, size_t size);
+
+/* Finds name in mod, among its exports if exported is set and in its
+ * symbols otherwise.  key is from symcache_module_key().  Returns false if
+ * mod has no such name. */
+bool symcache_lookup(const module_data_t *mod, const char *key,
+        const char *name, bool exported, size_t *offs);
+
+#endif // SYMCACHE_H
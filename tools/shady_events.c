@@ -0,0 +1,283 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event_log.h"
+
+/* Decodes the file a Shady run logs its oblivious actions to
+ * (-event_log PATH) and prints how often each kind of action happened at
+ * each pc, most frequent first:
+ *
+ *     shady_events [-s] PATH
+ *
+ * -s symbolizes pcs with addr2line. */
+
+#define MAX_RECORD 4096
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t preferred_base;
+    char* path;
+} module_t;
+
+typedef struct
+{
+    uint8_t kind;
+    uint64_t pc;
+    uint64_t count;
+} site_t;
+
+static module_t* modules;
+static size_t num_modules, max_modules;
+
+static site_t* sites;
+static size_t num_sites, max_sites;
+/* Open-addressed index into sites by kind and pc: entry i + 1 for
+ * sites[i], 0 for empty.  Twice max_sites long, so never over half full. */
+static size_t* site_index;
+static size_t site_index_size;
+
+static uint64_t dropped;
+
+static void*
+grow(void* p, size_t* max, size_t elt)
+{
+    *max = *max == 0 ? 64 : *max * 2;
+    p = realloc(p, *max * elt);
+    if (p == NULL)
+    {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+static void
+add_module(const event_module_t* m)
+{
+    if (num_modules == max_modules)
+        modules = grow(modules, &max_modules, sizeof *modules);
+    modules[num_modules].start = m->start;
+    modules[num_modules].end = m->end;
+    modules[num_modules].preferred_base = m->preferred_base;
+    modules[num_modules].path = strdup(m->path);
+    num_modules++;
+}
+
+/* Later loads may reuse an earlier module's range, so search newest first. */
+static const module_t*
+find_module(uint64_t pc)
+{
+    size_t i;
+
+    for (i = num_modules; i > 0; i--)
+    {
+        if (pc >= modules[i - 1].start && pc < modules[i - 1].end)
+            return &modules[i - 1];
+    }
+    return NULL;
+}
+
+static size_t
+hash_site(uint8_t kind, uint64_t pc)
+{
+    uint64_t h = (pc ^ kind) * 0x9e3779b97f4a7c15ULL;
+
+    return (size_t)(h >> 32) & (site_index_size - 1);
+}
+
+static void
+rebuild_index(void)
+{
+    size_t i, h;
+
+    free(site_index);
+    site_index_size = max_sites * 2;
+    site_index = calloc(site_index_size, sizeof *site_index);
+    if (site_index == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < num_sites; i++)
+    {
+        h = hash_site(sites[i].kind, sites[i].pc);
+        while (site_index[h] != 0)
+            h = (h + 1) & (site_index_size - 1);
+        site_index[h] = i + 1;
+    }
+}
+
+static void
+add_event(const event_record_t* e)
+{
+    size_t h, i;
+
+    if (num_sites == max_sites)
+    {
+        sites = grow(sites, &max_sites, sizeof *sites);
+        rebuild_index();
+    }
+    for (h = hash_site(e->kind, e->pc); site_index[h] != 0;
+         h = (h + 1) & (site_index_size - 1))
+    {
+        i = site_index[h] - 1;
+        if (sites[i].kind == e->kind && sites[i].pc == e->pc)
+        {
+            sites[i].count++;
+            return;
+        }
+    }
+    i = num_sites++;
+    sites[i].kind = e->kind;
+    sites[i].pc = e->pc;
+    sites[i].count = 1;
+    site_index[h] = i + 1;
+}
+
+static int
+by_count(const void* a, const void* b)
+{
+    const site_t* x = a;
+    const site_t* y = b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+static const char*
+kind_name(uint8_t kind)
+{
+    switch (kind)
+    {
+    case EVENT_SKIPPED_WRITE: return "skipped-write";
+    case EVENT_MANUFACTURED_READ: return "made-up-read";
+    case EVENT_REPAIRED_RETURN: return "repaired-ret";
+    case EVENT_BAD_FREE: return "bad-free";
+    default: return "?";
+    }
+}
+
+/* Prints "function at file:line" for pc, or nothing if addr2line can't. */
+static void
+symbolize(const module_t* m, uint64_t pc)
+{
+    char cmd[4096 + 64];
+    char func[512], line[512];
+    FILE* p;
+
+    snprintf(cmd, sizeof cmd, "addr2line -f -C -e '%s' 0x%" PRIx64, m->path,
+             pc - m->start + m->preferred_base);
+    p = popen(cmd, "r");
+    if (p == NULL)
+        return;
+    if (fgets(func, sizeof func, p) != NULL
+        && fgets(line, sizeof line, p) != NULL)
+    {
+        func[strcspn(func, "\n")] = '\0';
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(func, "??") != 0)
+            printf(" %s at %s", func, line);
+    }
+    pclose(p);
+}
+
+int
+main(int argc, char** argv)
+{
+    event_log_header_t header;
+    uint64_t record[MAX_RECORD / 8];
+    int symbols = 0;
+    const char* path;
+    FILE* f;
+    size_t i;
+
+    if (argc == 3 && strcmp(argv[1], "-s") == 0)
+        symbols = 1;
+    else if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s [-s] PATH\n", argv[0]);
+        return 1;
+    }
+    path = argv[argc - 1];
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    if (fread(&header, sizeof header, 1, f) != 1
+        || header.magic != EVENT_LOG_MAGIC
+        || header.version != EVENT_LOG_VERSION)
+    {
+        fprintf(stderr, "%s: not a Shady event log\n", path);
+        return 1;
+    }
+
+    for (;;)
+    {
+        const event_record_t* e = (const event_record_t*)record;
+
+        // Every record starts with at least kind, size and length.
+        if (fread(record, 8, 1, f) != 1)
+            break;
+        if (e->length < 8 || e->length % 8 != 0 || e->length > MAX_RECORD)
+        {
+            fprintf(stderr, "%s: bad record length %u\n", path, e->length);
+            return 1;
+        }
+        if (fread(record + 1, e->length - 8, 1, f) != 1 && e->length > 8)
+        {
+            fprintf(stderr, "%s: truncated record\n", path);
+            break;
+        }
+
+        switch (e->kind)
+        {
+        case EVENT_SKIPPED_WRITE:
+        case EVENT_MANUFACTURED_READ:
+        case EVENT_REPAIRED_RETURN:
+        case EVENT_BAD_FREE:
+            add_event(e);
+            break;
+        case EVENT_DROPPED:
+            dropped += e->value;
+            break;
+        case EVENT_MODULE:
+            ((char*)record)[e->length - 1] = '\0';
+            add_module((const event_module_t*)record);
+            break;
+        default:
+            break;
+        }
+    }
+    fclose(f);
+
+    qsort(sites, num_sites, sizeof *sites, by_count);
+    printf("pid %" PRIu64 "\n", header.pid);
+    printf("%12s %-14s %18s  %s\n", "count", "kind", "pc", "where");
+    for (i = 0; i < num_sites; i++)
+    {
+        const module_t* m = find_module(sites[i].pc);
+
+        printf("%12" PRIu64 " %-14s %#18" PRIx64, sites[i].count,
+               kind_name(sites[i].kind), sites[i].pc);
+        if (m != NULL)
+        {
+            const char* name = strrchr(m->path, '/');
+            printf("  %s+%#" PRIx64, name != NULL ? name + 1 : m->path,
+                   sites[i].pc - m->start);
+            if (symbols)
+                symbolize(m, sites[i].pc);
+        }
+        printf("\n");
+    }
+    if (dropped > 0)
+        printf("%" PRIu64 " events dropped\n", dropped);
+    return 0;
+}
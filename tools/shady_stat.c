@@ -0,0 +1,115 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "stats_page.h"
+
+/* Polls the page a Shady run keeps its counters in (-stats_file PATH) and
+ * prints the totals and their rates once per interval:
+ *
+ *     shady_stat PATH [seconds]
+ */
+
+static void
+read_page(const volatile stats_page_t* page, stats_page_t* out)
+{
+    uint64_t seq;
+
+    for (;;)
+    {
+        seq = page->sequence;
+        __sync_synchronize();
+        memcpy(out, (const void*)page, sizeof *out);
+        __sync_synchronize();
+        if (seq % 2 == 0 && page->sequence == seq)
+            return;
+        usleep(1000);
+    }
+}
+
+static double
+rate(uint64_t now, uint64_t then, double secs)
+{
+    return secs > 0 ? (now - then) / secs : 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    const stats_page_t* page;
+    stats_page_t prev, cur;
+    int interval = 1;
+    int fd;
+
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: %s PATH [seconds]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 3)
+        interval = atoi(argv[2]);
+    if (interval <= 0)
+        interval = 1;
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    page = mmap(NULL, sizeof *page, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    read_page(page, &prev);
+    if (prev.magic != STATS_PAGE_MAGIC || prev.version != STATS_PAGE_VERSION)
+    {
+        fprintf(stderr, "%s: not a Shady stats page (version %u)\n",
+                argv[1], prev.version);
+        return 1;
+    }
+    printf("pid %" PRIu64 "\n", prev.pid);
+    printf("%8s %14s %12s %10s %10s %10s %12s %12s %10s %10s %6s"
+           " %9s %9s %9s %7s %7s\n",
+           "threads", "checks/s", "slow/s", "skipped", "made-up", "rets",
+           "allocs/s", "frees/s", "live", "rz-KB", "sites",
+           "full-KB", "wr-KB", "none-KB", "down", "back");
+
+    for (;;)
+    {
+        double secs;
+
+        sleep(interval);
+        read_page(page, &cur);
+        if (cur.pid != prev.pid)
+        {
+            printf("pid %" PRIu64 "\n", cur.pid);
+            prev = cur;
+            continue;
+        }
+        secs = (cur.timestamp_ms - prev.timestamp_ms) / 1000.0;
+        printf("%8" PRIu64 " %14.0f %12.0f %10" PRIu64 " %10" PRIu64
+               " %10" PRIu64 " %12.0f %12.0f %10" PRIu64 " %10" PRIu64
+               " %6" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64
+               " %7" PRIu64 " %7" PRIu64 "\n",
+               cur.threads,
+               rate(cur.checks, prev.checks, secs),
+               rate(cur.slow_path, prev.slow_path, secs),
+               cur.skipped_writes, cur.manufactured_reads, cur.repaired_returns,
+               rate(cur.allocs, prev.allocs, secs),
+               rate(cur.frees, prev.frees, secs),
+               cur.live_blocks, cur.redzone_bytes >> 10,
+               cur.grown_sites, cur.full_bytes >> 10, cur.writes_bytes >> 10,
+               cur.none_bytes >> 10, cur.promotions, cur.demotions);
+        fflush(stdout);
+        prev = cur;
+    }
+}
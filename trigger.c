@@ -0,0 +1,117 @@
+#include "trigger.h"
+
+#include "defines.h"
+#include "options.h"
+#include "symcache.h"
+
+static volatile bool checking = true;
+/* Where -start_at was found; NULL until its module loads. */
+static app_pc trigger_pc;
+/* Set by the first switch either way, after which only nudges switch. */
+static volatile bool switched;
+
+static void event_module_load(void *drcontext, const module_data_t *mod, bool loaded);
+static void event_nudge(void *drcontext, uint64 arg);
+static bool set_checking(bool from, bool to);
+static void trigger_callback(app_pc pc);
+
+void
+trigger_init(client_id_t id)
+{
+    if (options.start_at[0] != '\0' || options.start_paused)
+        checking = false;
+    if (options.start_at[0] != '\0')
+        dr_register_module_load_event(event_module_load);
+    dr_register_nudge_event(event_nudge, id);
+}
+
+void
+trigger_exit(void)
+{
+    if (options.start_at[0] == '\0')
+        return;
+    dr_unregister_module_load_event(event_module_load);
+    // Otherwise a misspelt name quietly leaves the whole run unchecked.
+    if (trigger_pc == NULL) {
+        dr_fprintf(STDERR, "shady: -start_at %s was never found, nothing was "
+                "checked%s\n", options.start_at,
+                switched ? " before a nudge" : "");
+    }
+}
+
+bool
+trigger_checking(void)
+{
+    return checking;
+}
+
+void
+trigger_instrument(void *drcontext, instrlist_t *bb)
+{
+    instr_t *instr;
+
+    if (trigger_pc == NULL || switched)
+        return;
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        if (instr_get_app_pc(instr) == trigger_pc) {
+            dr_insert_clean_call(drcontext, bb, instr, (void *)trigger_callback,
+                    false /*no fp save*/, 1, OPND_CREATE_INTPTR(trigger_pc));
+            return;
+        }
+    }
+}
+
+/* The first module defining the symbol is the one that counts. */
+static void
+event_module_load(void *drcontext, const module_data_t *mod, bool loaded)
+{
+    char key[SYMCACHE_KEY_SIZE];
+    size_t offs;
+
+    if (trigger_pc != NULL || switched)
+        return;
+    symcache_module_key(mod, key, sizeof key);
+    if (symcache_lookup(mod, key, options.start_at, false, &offs)) {
+        DEBUG("Checking starts at %s (%p)\n", options.start_at, mod->start + offs);
+        trigger_pc = mod->start + offs;
+    }
+}
+
+static void
+event_nudge(void *drcontext, uint64 arg)
+{
+    bool on = checking;
+
+    // Lost a race with the trigger: the next nudge tries again.
+    set_checking(on, ! on);
+}
+
+/* Switches from one mode to the other and flushes every block built for
+ * the old one.  Returns false if another thread switched first. */
+static bool
+set_checking(bool from, bool to)
+{
+    if (! __sync_bool_compare_and_swap(&checking, from, to))
+        return false;
+    switched = true;
+    DEBUG("Checking %s\n", to ? "on" : "off");
+    dr_flush_region(NULL, ~(size_t)0);
+    return true;
+}
+
+/* Nothing of the block after the trigger has run yet, so once it is
+ * flushed execution restarts at the trigger with checks in place. */
+static void
+trigger_callback(app_pc pc)
+{
+    void *drcontext = dr_get_current_drcontext();
+    dr_mcontext_t mc;
+
+    mc.size = sizeof(mc);
+    mc.flags = DR_MC_ALL;
+    dr_get_mcontext(drcontext, &mc);
+    if (! set_checking(false, true))
+        return;
+    mc.pc = pc;
+    dr_redirect_execution(&mc);
+}
@@ -0,0 +1,19 @@
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <dr_api.h>
+
+/* When code is checked at all.  With -start_at or -start_paused the process
+ * starts out running unchecked until the trigger function runs or a nudge
+ * arrives; a nudge toggles checking at any time after that.  Each switch
+ * flushes the code cache so blocks are built again the other way. */
+void trigger_init(client_id_t id);
+void trigger_exit(void);
+
+/* Whether blocks are being built with checks. */
+bool trigger_checking(void);
+
+/* While checking is off, arms bb to turn it on if bb holds the trigger. */
+void trigger_instrument(void *drcontext, instrlist_t *bb);
+
+#endif // TRIGGER_H